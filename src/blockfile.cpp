@@ -0,0 +1,397 @@
+// Copyright (c) 2017 The Mokacoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+
+#include "sync.h"
+#include "util.h"
+
+#include <algorithm>
+#include <limits>
+#include <list>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
+
+using namespace std;
+
+int nBlockFileHandles = DEFAULT_BLOCKFILE_HANDLES;
+
+// A reader this far past the end of the mapping gets the file remapped
+static const uint64_t BLOCKFILE_REMAP_SLACK = 16 * 1024 * 1024;
+
+// Size of the pread buffer for reads outside the mapping
+static const size_t BLOCKFILE_READ_BUFFER = 64 * 1024;
+
+// Block files stay below this size, fseek and ftell elsewhere are limited to 2GB
+static const uint64_t BLOCKFILE_MAX_SIZE = 0x7F000000 - MAX_SIZE;
+
+// The file being appended to is preallocated this much at a time
+static const uint64_t BLOCKFILE_CHUNK_SIZE = 16 * 1024 * 1024;
+
+// Appended data is fsynced once this many bytes or seconds have accumulated
+static const uint64_t BLOCKFILE_SYNC_BYTES = 32 * 1024 * 1024;
+static const int64_t BLOCKFILE_SYNC_INTERVAL = 30;
+
+boost::filesystem::path GetBlockFilePath(unsigned int nFile)
+{
+    return GetDataDir() / strprintf("blk%04u.dat", nFile);
+}
+
+CBlockFileHandle::CBlockFileHandle(unsigned int nFileIn) : nFile(nFileIn), fd(-1), pbegin(NULL), nMapped(0), nSizeAtOpen(0)
+{
+    string strPath = GetBlockFilePath(nFile).string();
+#ifdef WIN32
+    fd = _open(strPath.c_str(), _O_RDONLY | _O_BINARY);
+    if (fd == -1)
+        return;
+    nSizeAtOpen = _filelengthi64(fd);
+#else
+    fd = open(strPath.c_str(), O_RDONLY);
+    if (fd == -1)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+        nSizeAtOpen = st.st_size;
+
+    // Map what is there now; a failed mmap (e.g. no address space left on
+    // 32 bit systems) just leaves every read to pread
+    if (nSizeAtOpen > 0 && nSizeAtOpen <= (uint64_t)std::numeric_limits<size_t>::max())
+    {
+        void* p = mmap(NULL, nSizeAtOpen, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            pbegin = (const char*)p;
+            nMapped = nSizeAtOpen;
+        }
+        else
+            LogPrint("blockfile", "CBlockFileHandle() : mmap of %s failed, using pread\n", strPath);
+    }
+#endif
+}
+
+CBlockFileHandle::~CBlockFileHandle()
+{
+#ifndef WIN32
+    if (pbegin)
+        munmap((void*)pbegin, nMapped);
+#endif
+    if (fd != -1)
+#ifdef WIN32
+        _close(fd);
+#else
+        close(fd);
+#endif
+}
+
+size_t CBlockFileHandle::Read(char* pch, size_t nSize, uint64_t nPos) const
+{
+    size_t nDone = 0;
+    while (nDone < nSize)
+    {
+#ifdef WIN32
+        // ReadFile with an offset is positional on synchronous handles too
+        OVERLAPPED ov;
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)(nPos + nDone);
+        ov.OffsetHigh = (DWORD)((nPos + nDone) >> 32);
+        DWORD nRead = 0;
+        if (!ReadFile((HANDLE)_get_osfhandle(fd), pch + nDone, (DWORD)(nSize - nDone), &nRead, &ov))
+            break;
+#else
+        ssize_t nRead = pread(fd, pch + nDone, nSize - nDone, nPos + nDone);
+        if (nRead < 0 && errno == EINTR)
+            continue;
+        if (nRead < 0)
+            break;
+#endif
+        if (nRead == 0)
+            break;
+        nDone += nRead;
+    }
+    return nDone;
+}
+
+static CCriticalSection cs_blockFiles;
+// Open block files, most recently used first
+static list<boost::shared_ptr<CBlockFileHandle> > lruBlockFiles;
+
+boost::shared_ptr<CBlockFileHandle> GetBlockFileHandle(unsigned int nFile, uint64_t nPos)
+{
+    if ((nFile < 1) || (nFile == (unsigned int) -1))
+        return boost::shared_ptr<CBlockFileHandle>();
+
+    {
+        LOCK(cs_blockFiles);
+        for (list<boost::shared_ptr<CBlockFileHandle> >::iterator it = lruBlockFiles.begin(); it != lruBlockFiles.end(); ++it)
+        {
+            if ((*it)->nFile != nFile)
+                continue;
+            boost::shared_ptr<CBlockFileHandle> handle = *it;
+            lruBlockFiles.erase(it);
+            if (nPos < handle->nSizeAtOpen + BLOCKFILE_REMAP_SLACK)
+            {
+                lruBlockFiles.push_front(handle);
+                return handle;
+            }
+            break;
+        }
+    }
+
+    // Open outside the lock, mapping a large file can take a moment
+    boost::shared_ptr<CBlockFileHandle> handle(new CBlockFileHandle(nFile));
+    if (!handle->IsOpen())
+        return boost::shared_ptr<CBlockFileHandle>();
+
+    if (nBlockFileHandles > 0)
+    {
+        LOCK(cs_blockFiles);
+        // Another reader may have opened the file meanwhile
+        for (list<boost::shared_ptr<CBlockFileHandle> >::iterator it = lruBlockFiles.begin(); it != lruBlockFiles.end(); ++it)
+        {
+            if ((*it)->nFile == nFile)
+            {
+                lruBlockFiles.erase(it);
+                break;
+            }
+        }
+        lruBlockFiles.push_front(handle);
+        while (lruBlockFiles.size() > (size_t)nBlockFileHandles)
+            lruBlockFiles.pop_back();
+    }
+    return handle;
+}
+
+//
+// The block file being appended to
+//
+static CCriticalSection cs_blockFileWriter;
+static int fdAppend = -1;
+static unsigned int nAppendFile = 1;
+static uint64_t nAppendPos = 0;         // end of the data written so far
+static uint64_t nAppendAllocated = 0;   // end of the preallocated space
+static uint64_t nAppendUnsynced = 0;
+static int64_t nLastBlockFileSync = 0;
+
+static bool SyncAppendFile()
+{
+    AssertLockHeld(cs_blockFileWriter);
+    if (fdAppend == -1 || nAppendUnsynced == 0)
+        return true;
+#ifdef WIN32
+    if (_commit(fdAppend) != 0)
+#elif defined(__linux__)
+    if (fdatasync(fdAppend) != 0)
+#else
+    if (fsync(fdAppend) != 0)
+#endif
+        return error("SyncBlockFiles() : sync of blk%04u.dat failed", nAppendFile);
+    nAppendUnsynced = 0;
+    nLastBlockFileSync = GetTime();
+    return true;
+}
+
+static void CloseAppendFile()
+{
+    AssertLockHeld(cs_blockFileWriter);
+    if (fdAppend == -1)
+        return;
+    SyncAppendFile();
+#ifdef WIN32
+    _close(fdAppend);
+#else
+    // Give back preallocated space past the end of the data
+    if (nAppendAllocated > nAppendPos && ftruncate(fdAppend, nAppendPos) != 0)
+        LogPrintf("CloseAppendFile() : ftruncate of blk%04u.dat failed\n", nAppendFile);
+    close(fdAppend);
+#endif
+    fdAppend = -1;
+}
+
+// Reserve space for the next chunk of the file without changing its size,
+// which is what tells the next start where appending continues
+static void PreallocateAppendFile(uint64_t nEnd)
+{
+    AssertLockHeld(cs_blockFileWriter);
+    if (nEnd <= nAppendAllocated)
+        return;
+    uint64_t nNewAllocated = std::min(nAppendAllocated + BLOCKFILE_CHUNK_SIZE, BLOCKFILE_MAX_SIZE + MAX_SIZE);
+    nNewAllocated = std::max(nNewAllocated, nEnd);
+#if defined(__linux__)
+    if (fallocate(fdAppend, FALLOC_FL_KEEP_SIZE, nAppendAllocated, nNewAllocated - nAppendAllocated) != 0)
+        LogPrint("blockfile", "PreallocateAppendFile() : fallocate failed (%d)\n", errno);
+#elif defined(MAC_OSX)
+    fstore_t fst;
+    fst.fst_flags = F_ALLOCATECONTIG;
+    fst.fst_posmode = F_PEOFPOSMODE;
+    fst.fst_offset = 0;
+    fst.fst_length = nNewAllocated - nAppendPos;
+    fst.fst_bytesalloc = 0;
+    if (fcntl(fdAppend, F_PREALLOCATE, &fst) == -1)
+    {
+        fst.fst_flags = F_ALLOCATEALL;
+        fcntl(fdAppend, F_PREALLOCATE, &fst);
+    }
+#endif
+    nAppendAllocated = nNewAllocated;
+}
+
+static bool OpenAppendFile()
+{
+    AssertLockHeld(cs_blockFileWriter);
+    while (fdAppend == -1)
+    {
+        string strPath = GetBlockFilePath(nAppendFile).string();
+#ifdef WIN32
+        fdAppend = _open(strPath.c_str(), _O_WRONLY | _O_APPEND | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+        if (fdAppend == -1)
+            return error("OpenAppendFile() : can't open %s", strPath);
+        nAppendPos = _filelengthi64(fdAppend);
+#else
+        fdAppend = open(strPath.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fdAppend == -1)
+            return error("OpenAppendFile() : can't open %s", strPath);
+        struct stat st;
+        if (fstat(fdAppend, &st) != 0)
+        {
+            close(fdAppend);
+            fdAppend = -1;
+            return error("OpenAppendFile() : can't stat %s", strPath);
+        }
+        nAppendPos = st.st_size;
+#endif
+        nAppendAllocated = nAppendPos;
+        nAppendUnsynced = 0;
+        if (nAppendPos >= BLOCKFILE_MAX_SIZE)
+        {
+            CloseAppendFile();
+            nAppendFile++;
+        }
+    }
+    if (nLastBlockFileSync == 0)
+        nLastBlockFileSync = GetTime();
+    return true;
+}
+
+bool AppendBlockToFile(const unsigned char* pchMessageStart, const char* pchBlock, unsigned int nSize,
+                       unsigned int& nFileRet, unsigned int& nBlockPosRet)
+{
+    LOCK(cs_blockFileWriter);
+    nFileRet = 0;
+    if (fdAppend != -1 && nAppendPos >= BLOCKFILE_MAX_SIZE)
+    {
+        // Full, finish it off before moving on
+        CloseAppendFile();
+        nAppendFile++;
+    }
+    if (!OpenAppendFile())
+        return false;
+
+    // Message start and size, then the block, in one write
+    char pchHeader[8];
+    memcpy(&pchHeader[0], pchMessageStart, 4);
+    memcpy(&pchHeader[4], &nSize, 4);
+    PreallocateAppendFile(nAppendPos + sizeof(pchHeader) + nSize);
+
+    const char* pchParts[2] = { pchHeader, pchBlock };
+    size_t nParts[2] = { sizeof(pchHeader), nSize };
+    uint64_t nWritten = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        size_t nDone = 0;
+        while (nDone < nParts[i])
+        {
+#ifdef WIN32
+            int nRet = _write(fdAppend, pchParts[i] + nDone, nParts[i] - nDone);
+#else
+            ssize_t nRet = write(fdAppend, pchParts[i] + nDone, nParts[i] - nDone);
+            if (nRet < 0 && errno == EINTR)
+                continue;
+#endif
+            if (nRet <= 0)
+            {
+                // Whatever made it to the file is garbage behind the last
+                // good block; carry on after it next time
+                nAppendPos += nWritten;
+                CloseAppendFile();
+                return error("AppendBlockToFile() : write to blk%04u.dat failed", nAppendFile);
+            }
+            nDone += nRet;
+            nWritten += nRet;
+        }
+    }
+
+    nFileRet = nAppendFile;
+    nBlockPosRet = nAppendPos + sizeof(pchHeader);
+    nAppendPos += nWritten;
+    nAppendUnsynced += nWritten;
+
+    if (nAppendUnsynced >= BLOCKFILE_SYNC_BYTES || GetTime() - nLastBlockFileSync >= BLOCKFILE_SYNC_INTERVAL)
+        return SyncAppendFile();
+    return true;
+}
+
+bool SyncBlockFiles()
+{
+    LOCK(cs_blockFileWriter);
+    return SyncAppendFile();
+}
+
+void CloseBlockFiles()
+{
+    {
+        LOCK(cs_blockFileWriter);
+        CloseAppendFile();
+    }
+    LOCK(cs_blockFiles);
+    lruBlockFiles.clear();
+}
+
+bool CBlockFileReader::Open(unsigned int nFile, uint64_t nPosIn)
+{
+    handle = GetBlockFileHandle(nFile, nPosIn);
+    nPos = nPosIn;
+    nBufferSize = 0;
+    return handle.get() != NULL;
+}
+
+void CBlockFileReader::ReadBuffered(char* pch, size_t nSize)
+{
+    while (nSize > 0)
+    {
+        if (nPos < nBufferPos || nPos >= nBufferPos + nBufferSize)
+        {
+            // Large reads go straight into the caller's memory
+            if (nSize >= BLOCKFILE_READ_BUFFER)
+            {
+                if (handle->Read(pch, nSize, nPos) != nSize)
+                    throw std::ios_base::failure("CBlockFileReader::read : end of file");
+                nPos += nSize;
+                return;
+            }
+            vBuffer.resize(BLOCKFILE_READ_BUFFER);
+            nBufferPos = nPos;
+            nBufferSize = handle->Read(&vBuffer[0], vBuffer.size(), nPos);
+            if (nBufferSize == 0)
+                throw std::ios_base::failure("CBlockFileReader::read : end of file");
+        }
+        size_t nChunk = std::min(nSize, (size_t)(nBufferPos + nBufferSize - nPos));
+        memcpy(pch, &vBuffer[nPos - nBufferPos], nChunk);
+        pch += nChunk;
+        nPos += nChunk;
+        nSize -= nChunk;
+    }
+}
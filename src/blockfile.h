@@ -0,0 +1,147 @@
+// Copyright (c) 2017 The Mokacoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKFILE_H
+#define BITCOIN_BLOCKFILE_H
+
+#include "serialize.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <ios>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+
+/** Default for -blockfilehandles, the number of blk*.dat files kept open for reading */
+static const int DEFAULT_BLOCKFILE_HANDLES = 8;
+
+extern int nBlockFileHandles;
+
+/** Path of blkNNNN.dat in the data directory */
+boost::filesystem::path GetBlockFilePath(unsigned int nFile);
+
+/** A read-only open blk*.dat file.
+ *
+ *  The file is memory mapped up to the size it had when it was opened. Data
+ *  appended later, and everything when mmap is not available, is read with
+ *  positional reads on the descriptor, so one handle can be shared by any
+ *  number of readers without seeking.
+ */
+class CBlockFileHandle
+{
+private:
+    CBlockFileHandle(const CBlockFileHandle&);
+    CBlockFileHandle& operator=(const CBlockFileHandle&);
+
+public:
+    unsigned int nFile;
+    int fd;
+    const char* pbegin;     // start of the mapping, NULL if not mapped
+    uint64_t nMapped;       // bytes covered by the mapping
+    uint64_t nSizeAtOpen;   // file size when the handle was opened
+
+    CBlockFileHandle(unsigned int nFileIn);
+    ~CBlockFileHandle();
+
+    bool IsOpen() const { return fd != -1; }
+
+    /** Read up to nSize bytes at nPos without moving any file offset.
+     *  Returns the number of bytes read, which is short only at the end of
+     *  the file or on an error. */
+    size_t Read(char* pch, size_t nSize, uint64_t nPos) const;
+};
+
+/** Get a shared handle on block file nFile from the LRU of open files,
+ *  opening (and possibly evicting the least recently used file) if needed.
+ *  Readers positioned well past the mapped size get a freshly mapped handle,
+ *  so the file currently being appended to is remapped now and then rather
+ *  than read by pread forever.
+ */
+boost::shared_ptr<CBlockFileHandle> GetBlockFileHandle(unsigned int nFile, uint64_t nPos);
+
+/** Sync and close the block file being appended to, and drop all cached
+ *  read handles. Readers still holding one keep it alive until they are done. */
+void CloseBlockFiles();
+
+/** Append a serialized block to the current blk*.dat file, framed by
+ *  pchMessageStart and its size as LoadExternalBlockFile expects, moving on
+ *  to the next file when the current one is full. Returns the file number
+ *  and the position of the block data itself.
+ *
+ *  The file stays open between blocks, is preallocated in large chunks where
+ *  the platform allows it without changing the file size, and is only
+ *  fsynced every so many bytes or seconds, or by SyncBlockFiles().
+ */
+bool AppendBlockToFile(const unsigned char* pchMessageStart, const char* pchBlock, unsigned int nSize,
+                       unsigned int& nFileRet, unsigned int& nBlockPosRet);
+
+/** Make everything appended so far durable. Must be called before a
+ *  database write referring to the new blocks is itself made durable. */
+bool SyncBlockFiles();
+
+/** Read-only stream over a block file, positioned at a byte offset.
+ *
+ *  Deserializes straight out of the mapped file. Reads that fall outside the
+ *  mapping go through a small pread buffer instead, so reading an object
+ *  field by field doesn't turn into one system call per field.
+ */
+class CBlockFileReader
+{
+private:
+    boost::shared_ptr<CBlockFileHandle> handle;
+    uint64_t nPos;
+
+    // pread buffer for data outside the mapping
+    std::vector<char> vBuffer;
+    uint64_t nBufferPos;
+    size_t nBufferSize;
+
+    void ReadBuffered(char* pch, size_t nSize);
+
+public:
+    int nType;
+    int nVersion;
+
+    CBlockFileReader(int nTypeIn, int nVersionIn) : nPos(0), nBufferPos(0), nBufferSize(0), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    /** Open block file nFile and position the stream at nPosIn */
+    bool Open(unsigned int nFile, uint64_t nPosIn);
+    void Seek(uint64_t nPosIn) { nPos = nPosIn; }
+    uint64_t GetPos() const    { return nPos; }
+    bool operator!() const     { return !handle; }
+
+    //
+    // Stream subset
+    //
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+
+    CBlockFileReader& read(char* pch, size_t nSize)
+    {
+        if (!handle)
+            throw std::ios_base::failure("CBlockFileReader::read : file handle is NULL");
+        if (handle->pbegin && nPos + nSize <= handle->nMapped)
+        {
+            memcpy(pch, handle->pbegin + nPos, nSize);
+            nPos += nSize;
+        }
+        else
+            ReadBuffered(pch, nSize);
+        return (*this);
+    }
+
+    template<typename T>
+    CBlockFileReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+#endif
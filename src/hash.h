@@ -39,6 +39,9 @@ public:
         Init();
     }
 
+    // Continue from the state of an earlier hash over some prefix
+    CHashWriter(int nTypeIn, int nVersionIn, const SHA256_CTX& ctxIn) : ctx(ctxIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
     CHashWriter& write(const char *pch, size_t size) {
         SHA256_Update(&ctx, pch, size);
         return (*this);
@@ -6,6 +6,7 @@
 #include "init.h"
 #include "main.h"
 #include "chainparams.h"
+#include "kernel.h"
 #include "txdb.h"
 #include "rpcserver.h"
 #include "net.h"
@@ -100,15 +101,19 @@ void Shutdown()
     StopNode();
     {
         LOCK(cs_main);
+        FlushTxIndexCache();
 #ifdef ENABLE_WALLET
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
 #endif
     }
+    if (fBlockIndexSnapshot)
+        WriteBlockIndexSnapshot();
 #ifdef ENABLE_WALLET
     if (pwalletMain)
         bitdb.Flush(true);
 #endif
+    CloseBlockFiles();
     boost::filesystem::remove(GetPidFile());
     UnregisterAllWallets();
 #ifdef ENABLE_WALLET
@@ -165,6 +170,10 @@ std::string HelpMessage()
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n";
     strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n";
+    strUsage += "  -txindexcache=<n>      " + strprintf(_("Cache up to <n> megabytes of the transaction index in memory and write it back in batches, 0 to disable (default: %u)"), DEFAULT_TXINDEX_CACHE) + "\n";
+    strUsage += "  -blockcache=<n>        " + strprintf(_("Keep up to <n> megabytes of recently used blocks in memory, 0 to disable (default: %u)"), DEFAULT_BLOCK_CACHE) + "\n";
+    strUsage += "  -blockindexsnapshot    " + _("Save the block index to a snapshot file at shutdown and every few hours for faster restarts (default: 1)") + "\n";
+    strUsage += "  -blockfilehandles=<n>  " + strprintf(_("Keep up to <n> block files open and memory mapped for reading, 0 to open them for every read (default: %u)"), DEFAULT_BLOCKFILE_HANDLES) + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS5 proxy") + "\n";
@@ -206,7 +215,7 @@ std::string HelpMessage()
     strUsage +=                               _("If <category> is not supplied, output all debugging information.") + "\n";
     strUsage +=                               _("<category> can be:");
     strUsage +=                                 " addrman, alert, db, lock, rand, rpc, selectcoins, mempool, net,"; // Don't translate these and qt below
-    strUsage +=                                 " coinage, coinstake, creation, stakemodifier";
+    strUsage +=                                 " coinage, coinstake, creation, stakemodifier, import";
     if (fHaveGUI)
     {
         strUsage += ", qt.\n";
@@ -238,14 +247,19 @@ std::string HelpMessage()
     strUsage += "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n";
     strUsage += "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n";
     strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n";
-    strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 500, 0 = all)") + "\n";
-    strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
+    strUsage += "  -checkblocks=<n>       " + strprintf(_("How many blocks to check in the background after startup (default: %u, 0 = all)"), DEFAULT_CHECKBLOCKS) + "\n";
+    strUsage += "  -checklevel=<n>        " + strprintf(_("How thorough the block verification is (0-6, default: %u)"), DEFAULT_CHECKLEVEL) + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
+    strUsage += "  -exportbootstrap=<file> " + _("Write the block chain to a bootstrap file with a checksum manifest on startup, then exit") + "\n";
+    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (up to %d, 0 = auto, <0 = leave that many cores free, default: 0)"), MAX_SCRIPTCHECK_THREADS) + "\n";
+    strUsage += "  -prefetchthreads=<n>   " + strprintf(_("Set the number of threads reading block inputs ahead of validation (up to %d, 0 = off, 1 = in the validating thread only, default: %d)"), MAX_PREFETCH_THREADS, DEFAULT_PREFETCH_THREADS) + "\n";
+    strUsage += "  -sigcachesize=<n>      " + strprintf(_("Limit the signature cache to <n> megabytes (default: %u)"), DEFAULT_SIG_CACHE_SIZE) + "\n";
     strUsage += "  -maxorphanblocksmib=<n> " + strprintf(_("Keep at most <n> MiB of unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
     strUsage += "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n";
     strUsage += "  -blockmaxsize=<n>      "   + _("Set maximum block size in bytes (default: 250000)") + "\n";
+    strUsage += "  -stakethreads=<n>      "   + _("Set the number of threads searching for stake kernels (0 = all cores, default: 1)") + "\n";
 
     strUsage += "\n" + _("SSL options: (see the Bitcoin Wiki for SSL setup instructions)") + "\n";
     strUsage += "  -rpcssl                                  " + _("Use OpenSSL (https) for JSON-RPC connections") + "\n";
@@ -335,7 +349,14 @@ bool AppInit2(boost::thread_group& threadGroup, const bool bGUI)
 
     nNodeLifespan = GetArg("-addrlifespan", 7);
     fUseFastIndex = GetBoolArg("-fastindex", true);
+    nTxIndexCacheSize = std::max((int64_t)0, GetArg("-txindexcache", DEFAULT_TXINDEX_CACHE)) * 1048576;
+    nBlockFileHandles = std::max(0, (int)GetArg("-blockfilehandles", DEFAULT_BLOCKFILE_HANDLES));
+    fBlockIndexSnapshot = GetBoolArg("-blockindexsnapshot", true);
+    nBlockCacheSize = std::max((int64_t)0, GetArg("-blockcache", DEFAULT_BLOCK_CACHE)) * 1048576;
     nMinerSleep = GetArg("-minersleep", 500);
+    nStakeThreads = GetArg("-stakethreads", 1);
+    if (nStakeThreads <= 0)
+        nStakeThreads = boost::thread::hardware_concurrency();
 
     nDerivationMethodIndex = 0;
 
@@ -433,6 +454,21 @@ bool AppInit2(boost::thread_group& threadGroup, const bool bGUI)
     }
 #endif
 
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
+    nPrefetchThreads = GetArg("-prefetchthreads", DEFAULT_PREFETCH_THREADS);
+    if (nPrefetchThreads < 0)
+        nPrefetchThreads = 0;
+    else if (nPrefetchThreads > MAX_PREFETCH_THREADS)
+        nPrefetchThreads = MAX_PREFETCH_THREADS;
+
     fConfChange = GetBoolArg("-confchange", false);
 
 #ifdef ENABLE_WALLET
@@ -479,6 +515,18 @@ bool AppInit2(boost::thread_group& threadGroup, const bool bGUI)
     if (fDaemon)
         fprintf(stdout, "Mokacoin server starting\n");
 
+    if (nScriptCheckThreads) {
+        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+    }
+
+    if (nPrefetchThreads) {
+        LogPrintf("Using %u threads for input prefetch\n", nPrefetchThreads);
+        for (int i=0; i<nPrefetchThreads-1; i++)
+            threadGroup.create_thread(&ThreadPrefetch);
+    }
+
     int64_t nStart;
 
     // ********************************************************* Step 5: verify database integrity
@@ -632,6 +680,7 @@ bool AppInit2(boost::thread_group& threadGroup, const bool bGUI)
 
     if (GetBoolArg("-loadblockindextest", false))
     {
+        LOCK(cs_main);
         CTxDB txdb("r");
         txdb.LoadBlockIndex();
         PrintBlockTree();
@@ -665,7 +714,7 @@ bool AppInit2(boost::thread_group& threadGroup, const bool bGUI)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (CBlockIndexMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -683,6 +732,17 @@ bool AppInit2(boost::thread_group& threadGroup, const bool bGUI)
         return false;
     }
 
+    if (mapArgs.count("-exportbootstrap"))
+    {
+        int nBlocks = 0;
+        uint64_t nBytes = 0;
+        if (!ExportBootstrap(GetArg("-exportbootstrap", ""), 0, -1, nBlocks, nBytes))
+            return InitError(_("Failed to write the bootstrap file, see debug.log for details"));
+        // Done, exit cleanly without starting the node
+        StartShutdown();
+        return true;
+    }
+
     // ********************************************************* Step 8: load wallet
 #ifdef ENABLE_WALLET
     if (fDisableWallet) {
@@ -761,7 +821,10 @@ bool AppInit2(boost::thread_group& threadGroup, const bool bGUI)
             CWalletDB walletdb(strWalletFileName);
             CBlockLocator locator;
             if (walletdb.ReadBestBlock(locator))
+            {
+                LOCK(cs_main);
                 pindexRescan = locator.GetBlockIndex();
+            }
             else
                 pindexRescan = pindexGenesisBlock;
         }
@@ -789,6 +852,12 @@ bool AppInit2(boost::thread_group& threadGroup, const bool bGUI)
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
 
+    // Verify the tip of the best chain while the node is already running
+    threadGroup.create_thread(&ThreadVerifyChain);
+
+    if (fBlockIndexSnapshot)
+        threadGroup.create_thread(&ThreadBlockIndexSnapshot);
+
     // ********************************************************* Step 10: load peers
 
     uiInterface.InitMessage(_("Loading addresses..."));
@@ -5,12 +5,15 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <boost/thread.hpp>
 
 #include "kernel.h"
 #include "txdb.h"
 
 using namespace std;
 
+int nStakeThreads = 1;
+
 // Get time weight
 int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd)
 {
@@ -72,7 +75,7 @@ static bool SelectBlockFromCandidates(vector<pair<int64_t, uint256> >& vSortedBy
         // compute the selection hash by hashing its proof-hash and the
         // previous proof-of-stake modifier
         CDataStream ss(SER_GETHASH, 0);
-        ss << pindex->hashProof << nStakeModifierPrev;
+        ss << pindex->GetProofHash() << nStakeModifierPrev;
         uint256 hashSelection = Hash(ss.begin(), ss.end());
         // the selection hash is divided by 2**32 so that proof-of-stake block
         // is always favored over proof-of-work block. this is to preserve
@@ -338,9 +341,9 @@ static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom,
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
 //
-static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int nTimeTxPrev, int64_t nValueIn, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
+    if (nTimeTx < nTimeTxPrev)  // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
     // Base target
@@ -348,7 +351,6 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
     bnTarget.SetCompact(nBits);
 
     // Weighted target
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
     CBigNum bnWeight = CBigNum(nValueIn);
     bnTarget *= bnWeight;
 
@@ -361,7 +363,7 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
 
     // Calculate hash
     CDataStream ss(SER_GETHASH, 0);
-    ss << bnStakeModifierV2 << txPrev.nTime << prevout.hash << prevout.n << nTimeTx;
+    ss << bnStakeModifierV2 << nTimeTxPrev << prevout.hash << prevout.n << nTimeTx;
     hashProofOfStake = Hash(ss.begin(), ss.end());
 
     if (fPrintProofOfStake)
@@ -372,7 +374,7 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : check modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, nTimeTxPrev, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -388,7 +390,7 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : pass modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, nTimeTxPrev, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -397,7 +399,7 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
 
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    return CheckStakeKernelHashV2(pindexPrev, nBits, blockFrom.GetBlockTime(), txPrev, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
+    return CheckStakeKernelHashV2(pindexPrev, nBits, blockFrom.GetBlockTime(), txPrev.nTime, txPrev.vout[prevout.n].nValue, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
 }
 
 // Check kernel hash target and coinstake signature
@@ -420,10 +422,11 @@ bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned
     if (!VerifySignature(txPrev, tx, 0, SCRIPT_VERIFY_NONE, 0))
         return tx.DoS(100, error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString()));
 
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-        return fDebug? error("CheckProofOfStake() : read block failed") : false; // unable to read block of previous transaction
+    // Find the block of the previous transaction
+    CBlockIndex* pindexFrom = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+    if (!pindexFrom)
+        return fDebug? error("CheckProofOfStake() : block of txPrev not in index") : false; // unable to find block of previous transaction
+    CBlock block = pindexFrom->GetBlockHeader();
 
     int nDepth;
     if (IsConfirmedInNPrevBlocks(txindex, pindexPrev, nStakeMinConfirmations - 1, nDepth))
@@ -451,10 +454,11 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
     if (!txPrev.ReadFromDisk(txdb, prevout, txindex))
         return false;
 
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+    // Find the block of the previous transaction
+    CBlockIndex* pindexFrom = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+    if (!pindexFrom)
         return false;
+    CBlock block = pindexFrom->GetBlockHeader();
 
     int nDepth;
     if (IsConfirmedInNPrevBlocks(txindex, pindexPrev, nStakeMinConfirmations - 1, nDepth))
@@ -465,3 +469,114 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
 
     return CheckStakeKernelHash(pindexPrev, nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
 }
+
+bool GetStakeCandidate(CTxDB& txdb, const COutPoint& prevout, CStakeCandidate& candidate)
+{
+    candidate.SetNull();
+
+    CTransaction txPrev;
+    CTxIndex txindex;
+    if (!txPrev.ReadFromDisk(txdb, prevout, txindex))
+        return false;
+    if (prevout.n >= txPrev.vout.size())
+        return false;
+
+    // Find the block of the previous transaction
+    CBlockIndex* pindexFrom = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+    if (!pindexFrom || !pindexFrom->IsInMainChain())
+        return false;
+
+    candidate.prevout = prevout;
+    candidate.nTimeTxPrev = txPrev.nTime;
+    candidate.nValue = txPrev.vout[prevout.n].nValue;
+    candidate.hashBlockFrom = pindexFrom->GetBlockHash();
+    candidate.nBlockTime = pindexFrom->GetBlockTime();
+    candidate.nHeight = pindexFrom->nHeight;
+    return true;
+}
+
+// Search the kernels of vCandidates[nBegin, nEnd)
+//
+// This is CheckStakeKernelHashV2() unrolled for the search loop. The 76 byte
+// kernel (bnStakeModifierV2, txPrev.nTime, prevout.hash, prevout.n, nTimeTx)
+// is laid out once per candidate and its first 64 byte block, which does not
+// depend on nTimeTx, is compressed only once. The value-weighted target is also
+// computed once per candidate and compared as a uint256.
+static void SearchStakeKernelRange(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, int64_t nSearchInterval, const vector<CStakeCandidate>* pvCandidates, size_t nBegin, size_t nEnd, vector<int64_t>* pvTimeRet)
+{
+    CBigNum bnTargetPerCoin;
+    bnTargetPerCoin.SetCompact(nBits);
+
+    unsigned char pchKernel[76];
+    memcpy(pchKernel, &pindexPrev->bnStakeModifierV2, 32);
+
+    for (size_t i = nBegin; i < nEnd; i++)
+    {
+        const CStakeCandidate& candidate = (*pvCandidates)[i];
+        if (candidate.IsNull())
+            continue;
+
+        // Same rule as IsConfirmedInNPrevBlocks(), the candidate being in the main chain
+        if (pindexPrev->nHeight - candidate.nHeight < nStakeMinConfirmations - 1)
+            continue;
+
+        // Weighted target, saturated to 256 bits
+        CBigNum bnTarget = bnTargetPerCoin * CBigNum(candidate.nValue);
+        uint256 hashTarget = bnTarget.bitSize() > 256 ? ~uint256(0) : bnTarget.getuint256();
+
+        memcpy(pchKernel + 32, &candidate.nTimeTxPrev, 4);
+        memcpy(pchKernel + 36, &candidate.prevout.hash, 32);
+        memcpy(pchKernel + 68, &candidate.prevout.n, 4);
+
+        SHA256_CTX ctxPrefix;
+        SHA256_Init(&ctxPrefix);
+        SHA256_Update(&ctxPrefix, pchKernel, 64);
+
+        for (int64_t n = 0; n < nSearchInterval; n++)
+        {
+            unsigned int nTimeTx = nTime - n;
+            if (nTimeTx < candidate.nTimeTxPrev)
+                break;
+
+            memcpy(pchKernel + 72, &nTimeTx, 4);
+
+            SHA256_CTX ctx = ctxPrefix;
+            SHA256_Update(&ctx, pchKernel + 64, 12);
+            uint256 hash1;
+            SHA256_Final((unsigned char*)&hash1, &ctx);
+            uint256 hashProofOfStake;
+            SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hashProofOfStake);
+
+            if (hashProofOfStake <= hashTarget)
+            {
+                (*pvTimeRet)[i] = nTimeTx;
+                break;
+            }
+        }
+    }
+}
+
+void SearchStakeKernels(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, int64_t nSearchInterval, const vector<CStakeCandidate>& vCandidates, vector<int64_t>& vTimeRet)
+{
+    vTimeRet.assign(vCandidates.size(), 0);
+
+    // Not worth starting threads for a handful of coins
+    static const size_t nMinCandidatesPerThread = 64;
+    size_t nThreads = min((size_t)max(nStakeThreads, 1), vCandidates.size() / nMinCandidatesPerThread);
+    if (nThreads <= 1)
+    {
+        SearchStakeKernelRange(pindexPrev, nBits, nTime, nSearchInterval, &vCandidates, 0, vCandidates.size(), &vTimeRet);
+        return;
+    }
+
+    boost::thread_group threadGroup;
+    size_t nChunk = (vCandidates.size() + nThreads - 1) / nThreads;
+    for (size_t nBegin = 0; nBegin < vCandidates.size(); nBegin += nChunk)
+    {
+        size_t nEnd = min(nBegin + nChunk, vCandidates.size());
+        threadGroup.create_thread(boost::bind(&SearchStakeKernelRange, pindexPrev, nBits, nTime, nSearchInterval, &vCandidates, nBegin, nEnd, &vTimeRet));
+    }
+    // The workers reference our arguments, never leave before they are done
+    boost::this_thread::disable_interruption di;
+    threadGroup.join_all();
+}
@@ -13,6 +13,9 @@ static const int STAKE_TIMESTAMP_MASK = 127;
 // MODIFIER_INTERVAL: time to elapse before new modifier is computed
 extern unsigned int nModifierInterval;
 
+// Number of threads used by SearchStakeKernels()
+extern int nStakeThreads;
+
 // MODIFIER_INTERVAL_RATIO:
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
@@ -40,4 +43,45 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 // Convenient for searching a kernel
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+/** Kernel inputs of a stakeable output.
+ * Everything CheckKernel() would otherwise fetch from disk for a given prevout,
+ * so that the kernel search over many timestamps can run purely in memory.
+ */
+class CStakeCandidate
+{
+public:
+    COutPoint prevout;
+    unsigned int nTimeTxPrev;
+    int64_t nValue;
+    uint256 hashBlockFrom;
+    int64_t nBlockTime;
+    int nHeight;
+
+    CStakeCandidate()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        prevout.SetNull();
+        nTimeTxPrev = 0;
+        nValue = 0;
+        hashBlockFrom = 0;
+        nBlockTime = 0;
+        nHeight = -1;
+    }
+
+    bool IsNull() const { return nHeight == -1; }
+};
+
+// Read the kernel inputs of prevout from the tx database
+bool GetStakeCandidate(CTxDB& txdb, const COutPoint& prevout, CStakeCandidate& candidate);
+
+// Batched kernel search over many candidates, split across nStakeThreads threads.
+// Tries timestamps nTime down to nTime - nSearchInterval + 1 for every candidate;
+// vTimeRet[i] receives the first timestamp at which vCandidates[i] meets the
+// target, or 0 if none does.
+void SearchStakeKernels(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, int64_t nSearchInterval, const std::vector<CStakeCandidate>& vCandidates, std::vector<int64_t>& vTimeRet);
+
 #endif // PPCOIN_KERNEL_H
@@ -8,6 +8,7 @@
 #include <openssl/obj_mac.h>
 
 #include "key.h"
+#include "secp256k1.h"
 
 
 // anonymous namespace with local implementation code (OpenSSL interaction)
@@ -521,6 +522,14 @@ bool CKey::Load(CPrivKey &privkey, CPubKey &vchPubKey, bool fSkipCheck=false) {
 }
 
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+#ifdef USE_SECP256K1
+    return VerifySecp256k1(hash, vchSig);
+#else
+    return VerifyOpenSSL(hash, vchSig);
+#endif
+}
+
+bool CPubKey::VerifyOpenSSL(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
     CECKey key;
@@ -531,6 +540,34 @@ bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchS
     return true;
 }
 
+bool CPubKey::VerifySecp256k1(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+    if (!IsValid() || vchSig.empty())
+        return false;
+
+    // Decode the signature the way ECDSA_verify does: DER only, so it has
+    // to encode back to exactly the same bytes, and r, s in [1, n-1]
+    const unsigned char *pbegin = &vchSig[0];
+    ECDSA_SIG *sig = d2i_ECDSA_SIG(NULL, &pbegin, vchSig.size());
+    if (sig == NULL)
+        return false;
+    bool fOk = false;
+    unsigned char *der = NULL;
+    int nDerLen = i2d_ECDSA_SIG(sig, &der);
+    if (nDerLen == (int)vchSig.size() && memcmp(der, &vchSig[0], nDerLen) == 0 &&
+        !BN_is_negative(sig->r) && !BN_is_negative(sig->s) &&
+        BN_num_bytes(sig->r) <= 32 && BN_num_bytes(sig->s) <= 32) {
+        unsigned char r[32], s[32];
+        memset(r, 0, sizeof(r));
+        memset(s, 0, sizeof(s));
+        BN_bn2bin(sig->r, &r[32 - BN_num_bytes(sig->r)]);
+        BN_bn2bin(sig->s, &s[32 - BN_num_bytes(sig->s)]);
+        fOk = Secp256k1Verify(begin(), size(), (const unsigned char*)&hash, r, s);
+    }
+    OPENSSL_free(der);
+    ECDSA_SIG_free(sig);
+    return fOk;
+}
+
 bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
     if (vchSig.size() != 65)
         return false;
@@ -709,6 +746,17 @@ bool ECC_InitSanityCheck() {
         return false;
     EC_KEY_free(pkey);
 
+#ifdef USE_SECP256K1
+    // The in-tree verifier has to accept what OpenSSL signs
+    CKey key;
+    key.MakeNewKey(true);
+    uint256 hash;
+    RAND_bytes((unsigned char*)&hash, sizeof(hash));
+    std::vector<unsigned char> vchSig;
+    if (!key.Sign(hash, vchSig) || !key.GetPubKey().VerifySecp256k1(hash, vchSig))
+        return false;
+#endif
+
     // TODO Is there more EC functionality that could be missing?
     return true;
 }
@@ -153,8 +153,13 @@ public:
 
     // Verify a DER signature (~72 bytes).
     // If this public key is not fully valid, the return value will be false.
+    // Uses the in-tree secp256k1 code when built with USE_SECP256K1, else OpenSSL.
     bool Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
 
+    // Verify a DER signature with a specific implementation.
+    bool VerifyOpenSSL(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
+    bool VerifySecp256k1(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
+
     // Verify a compact signature (~65 bytes).
     // See CKey::SignCompact.
     bool VerifyCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
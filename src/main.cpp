@@ -10,6 +10,7 @@
 #include "alert.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h"
 #include "kernel.h"
@@ -36,7 +37,8 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+CBlockIndexMap mapBlockIndex;
+BlockPosMap mapBlockIndexByPos;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
 unsigned int nTargetSpacing = 5;
@@ -57,10 +59,13 @@ uint256 nBestInvalidTrust = 0;
 
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CChain chainActive;
 int64_t nTimeBestReceived = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fHaveGUI = false;
+int nScriptCheckThreads = 0;
+int nPrefetchThreads = 0;
 
 struct COrphanBlock {
     uint256 hashBlock;
@@ -490,7 +495,8 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
         CTxIndex txindex;
         if (!CTxDB("r").ReadTxIndex(GetHash(), txindex))
             return 0;
-        if (!blockTmp.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos))
+        CBlockIndex* pindexTx = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+        if (!pindexTx || !blockTmp.ReadFromDisk(pindexTx))
             return 0;
         pblock = &blockTmp;
     }
@@ -514,7 +520,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     vMerkleBranch = pblock->GetMerkleBranch(nIndex);
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -732,7 +738,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -803,15 +809,8 @@ bool CWalletTx::AcceptWalletTransaction()
 
 int CTxIndex::GetDepthInMainChain() const
 {
-    // Read block header
-    CBlock block;
-    if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
-        return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
-    if (mi == mapBlockIndex.end())
-        return 0;
-    CBlockIndex* pindex = (*mi).second;
+    CBlockIndex* pindex = FindBlockByPos(pos.nFile, pos.nBlockPos);
     if (!pindex || !pindex->IsInMainChain())
         return 0;
     return 1 + nBestHeight - pindex->nHeight;
@@ -832,9 +831,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
         CTxIndex txindex;
         if (tx.ReadFromDisk(txdb, COutPoint(hash, 0), txindex))
         {
-            CBlock block;
-            if (block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                hashBlock = block.GetHash();
+            CBlockIndex* pindex = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+            if (pindex)
+                hashBlock = pindex->GetBlockHash();
             return true;
         }
     }
@@ -853,30 +852,325 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
+    return chainActive[nHeight];
+}
+
+void CChain::SetTip(CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    if (pindex == NULL)
+    {
+        vChain.clear();
+        return;
+    }
+    vChain.resize(pindex->nHeight + 1);
+    while (pindex && vChain[pindex->nHeight] != pindex)
+    {
+        vChain[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+}
+
+CBlockIndex* CChain::FindFork(CBlockIndex* pindex) const
+{
+    if (pindex->nHeight > Height())
+        pindex = pindex->GetAncestor(Height());
+    while (pindex && !Contains(pindex))
+        pindex = pindex->pprev;
+    return pindex;
+}
+
+uint64_t CBlockIndexMap::Digest(const uint256& hash) const
+{
+    // Block hashes are already well mixed, the salt is there so nobody can
+    // line up blocks that all land in the same few slots
+    uint64_t pn[4];
+    memcpy(pn, const_cast<uint256&>(hash).begin(), sizeof(pn));
+    uint64_t h = nSalt;
+    for (int i = 0; i < 4; i++)
+    {
+        h ^= pn[i];
+        h *= 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+size_t CBlockIndexMap::FindSlot(const uint256& hash, uint64_t nDigest) const
+{
+    size_t nMask = vSlots.size() - 1;
+    for (size_t nSlot = nDigest & nMask; ; nSlot = (nSlot + 1) & nMask)
+    {
+        const Slot& slot = vSlots[nSlot];
+        if (slot.pindex == NULL || (slot.nDigest == nDigest && *slot.pindex->phashBlock == hash))
+            return nSlot;
+    }
+}
+
+void CBlockIndexMap::Resize(size_t nSlots)
+{
+    if (vSlots.empty())
+        nSalt = GetRand(std::numeric_limits<uint64_t>::max());
+    std::vector<Slot> vOld;
+    vOld.swap(vSlots);
+    Slot empty = { 0, NULL };
+    vSlots.assign(nSlots, empty);
+    BOOST_FOREACH(const Slot& slot, vOld)
+        if (slot.pindex)
+            vSlots[FindSlot(*slot.pindex->phashBlock, slot.nDigest)] = slot;
+}
+
+void CBlockIndexMap::reserve(size_t nCount)
+{
+    // Keep the table at most 3/4 full
+    size_t nSlots = 16;
+    while (nSlots * 3 / 4 < nCount)
+        nSlots *= 2;
+    if (nSlots > vSlots.size())
+        Resize(nSlots);
+}
+
+CBlockIndexMap::const_iterator CBlockIndexMap::find(const uint256& hash) const
+{
+    if (nSize == 0)
+        return end();
+    size_t nSlot = FindSlot(hash, Digest(hash));
+    if (vSlots[nSlot].pindex == NULL)
+        return end();
+    return const_iterator(this, nSlot);
+}
+
+std::pair<CBlockIndexMap::const_iterator, bool> CBlockIndexMap::insert(const value_type& item)
+{
+    assert(item.second && item.second->phashBlock && *item.second->phashBlock == item.first);
+    reserve(nSize + 1);
+    uint64_t nDigest = Digest(item.first);
+    size_t nSlot = FindSlot(item.first, nDigest);
+    if (vSlots[nSlot].pindex)
+        return std::make_pair(const_iterator(this, nSlot), false);
+    vSlots[nSlot].nDigest = nDigest;
+    vSlots[nSlot].pindex = item.second;
+    nSize++;
+    return std::make_pair(const_iterator(this, nSlot), true);
+}
+
+// Cold block index fields that have been loaded or set, see CBlockIndexCold.
+// The least recently used are dropped beyond MAX_BLOCKINDEX_COLD_CACHE
+// entries. Fields changed by SetCold() are pinned until the database
+// transaction writing them has committed: until then reading them back from
+// the database would give the old values.
+static const size_t MAX_BLOCKINDEX_COLD_CACHE = 50000;
+
+struct CBlockIndexColdEntry
+{
+    const CBlockIndex* pindex;
+    CBlockIndexCold cold;
+    bool fPinned;
+};
+
+static CCriticalSection cs_blockIndexCold;
+typedef std::list<CBlockIndexColdEntry> BlockIndexColdList;
+static BlockIndexColdList lruBlockIndexCold;    // most recently used first
+static map<const CBlockIndex*, BlockIndexColdList::iterator> mapBlockIndexCold;
+static vector<const CBlockIndex*> vBlockIndexColdPinned;
+static unsigned int nBlockIndexColdEvictions = 0;
+
+static void TrimBlockIndexCold()
+{
+    AssertLockHeld(cs_blockIndexCold);
+    size_t nSkipped = 0;
+    while (lruBlockIndexCold.size() > MAX_BLOCKINDEX_COLD_CACHE && nSkipped < lruBlockIndexCold.size())
+    {
+        BlockIndexColdList::iterator it = --lruBlockIndexCold.end();
+        if (it->fPinned)
+        {
+            lruBlockIndexCold.splice(lruBlockIndexCold.begin(), lruBlockIndexCold, it);
+            nSkipped++;
+            continue;
+        }
+        mapBlockIndexCold.erase(it->pindex);
+        lruBlockIndexCold.erase(it);
+        nBlockIndexColdEvictions++;
+    }
+}
+
+// Called once the block index entries changed by SetCold() are committed
+static void UnpinBlockIndexCold()
+{
+    LOCK(cs_blockIndexCold);
+    BOOST_FOREACH(const CBlockIndex* pindex, vBlockIndexColdPinned)
+    {
+        map<const CBlockIndex*, BlockIndexColdList::iterator>::iterator mi = mapBlockIndexCold.find(pindex);
+        if (mi != mapBlockIndexCold.end())
+            mi->second->fPinned = false;
+    }
+    vBlockIndexColdPinned.clear();
+    TrimBlockIndexCold();
+}
+
+CBlockIndexCold CBlockIndex::GetCold() const
+{
+    unsigned int nEvictions;
+    {
+        LOCK(cs_blockIndexCold);
+        map<const CBlockIndex*, BlockIndexColdList::iterator>::iterator mi = mapBlockIndexCold.find(this);
+        if (mi != mapBlockIndexCold.end())
+        {
+            lruBlockIndexCold.splice(lruBlockIndexCold.begin(), lruBlockIndexCold, mi->second);
+            return mi->second->cold;
+        }
+        nEvictions = nBlockIndexColdEvictions;
+    }
+
+    CBlockIndexCold cold;
+    if (phashBlock == NULL)
+        return cold;
+    CDiskBlockIndex diskindex;
+    CTxDB txdb("r");
+    if (!txdb.ReadBlockIndex(*phashBlock, diskindex))
+    {
+        LogPrintf("CBlockIndex::GetCold() : block index entry of %s not found\n", phashBlock->ToString());
+        return cold;
+    }
+    cold = diskindex.GetCold();
+
+    LOCK(cs_blockIndexCold);
+    map<const CBlockIndex*, BlockIndexColdList::iterator>::iterator mi = mapBlockIndexCold.find(this);
+    if (mi != mapBlockIndexCold.end())
+        return mi->second->cold;
+    // An entry dropped meanwhile may have been set and committed after the
+    // read, don't cache what was read then
+    if (nBlockIndexColdEvictions == nEvictions)
+    {
+        CBlockIndexColdEntry entry = { this, cold, false };
+        lruBlockIndexCold.push_front(entry);
+        mapBlockIndexCold[this] = lruBlockIndexCold.begin();
+        TrimBlockIndexCold();
+    }
+    return cold;
+}
+
+void CBlockIndex::SetCold(const CBlockIndexCold& cold)
+{
+    LOCK(cs_blockIndexCold);
+    map<const CBlockIndex*, BlockIndexColdList::iterator>::iterator mi = mapBlockIndexCold.find(this);
+    if (mi == mapBlockIndexCold.end())
+    {
+        CBlockIndexColdEntry entry = { this, cold, false };
+        lruBlockIndexCold.push_front(entry);
+        mi = mapBlockIndexCold.insert(make_pair(this, lruBlockIndexCold.begin())).first;
+    }
     else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    {
+        lruBlockIndexCold.splice(lruBlockIndexCold.begin(), lruBlockIndexCold, mi->second);
+        mi->second->cold = cold;
+    }
+    if (!mi->second->fPinned)
+    {
+        mi->second->fPinned = true;
+        vBlockIndexColdPinned.push_back(this);
+    }
+    TrimBlockIndexCold();
+}
+
+CBlockIndex* FindBlockByPos(unsigned int nFile, unsigned int nBlockPos)
+{
+    BlockPosMap::const_iterator mi = mapBlockIndexByPos.find(make_pair(nFile, nBlockPos));
+    if (mi == mapBlockIndexByPos.end())
+        return NULL;
+    return (*mi).second;
+}
+
+//
+// Recently used blocks, kept deserialized. Blocks never change once they
+// have a hash, so entries are shared with the callers as immutable objects
+// and never need invalidating.
+//
+static CCriticalSection cs_blockCache;
+typedef std::list<std::pair<uint256, boost::shared_ptr<const CBlock> > > BlockCacheList;
+static BlockCacheList lruBlockCache;    // most recently used first
+static map<uint256, BlockCacheList::iterator> mapBlockCache;
+static int64_t nBlockCacheUsage = 0;
+int64_t nBlockCacheSize = DEFAULT_BLOCK_CACHE * 1048576;
+
+// Rough in-memory size of a deserialized block
+static int64_t BlockMemoryUsage(const CBlock& block)
+{
+    int64_t nUsage = sizeof(CBlock) + ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        nUsage += sizeof(CTransaction) + tx.vin.size() * sizeof(CTxIn) + tx.vout.size() * sizeof(CTxOut);
+    return nUsage;
+}
+
+static boost::shared_ptr<const CBlock> LookupBlockCache(const uint256& hash)
+{
+    LOCK(cs_blockCache);
+    map<uint256, BlockCacheList::iterator>::iterator mi = mapBlockCache.find(hash);
+    if (mi == mapBlockCache.end())
+        return boost::shared_ptr<const CBlock>();
+    lruBlockCache.splice(lruBlockCache.begin(), lruBlockCache, mi->second);
+    return mi->second->second;
+}
+
+static void InsertBlockCache(const uint256& hash, const boost::shared_ptr<const CBlock>& pblock)
+{
+    int64_t nUsage = BlockMemoryUsage(*pblock);
+    LOCK(cs_blockCache);
+    if (nUsage > nBlockCacheSize || mapBlockCache.count(hash))
+        return;
+    lruBlockCache.push_front(make_pair(hash, pblock));
+    mapBlockCache[hash] = lruBlockCache.begin();
+    nBlockCacheUsage += nUsage;
+    while (nBlockCacheUsage > nBlockCacheSize)
+    {
+        const BlockCacheList::value_type& entry = lruBlockCache.back();
+        nBlockCacheUsage -= BlockMemoryUsage(*entry.second);
+        mapBlockCache.erase(entry.first);
+        lruBlockCache.pop_back();
+    }
+}
+
+void CacheBlock(const CBlock& block)
+{
+    if (nBlockCacheSize > 0)
+        InsertBlockCache(block.GetHash(), boost::shared_ptr<const CBlock>(new CBlock(block)));
+}
+
+boost::shared_ptr<const CBlock> ReadBlockCached(const CBlockIndex* pindex)
+{
+    boost::shared_ptr<const CBlock> pblock = LookupBlockCache(pindex->GetBlockHash());
+    if (pblock)
+        return pblock;
+
+    CBlock* pblockNew = new CBlock();
+    pblock.reset(pblockNew);
+    if (!pblockNew->ReadFromDisk(pindex))
+        return boost::shared_ptr<const CBlock>();
+    if (nBlockCacheSize > 0)
+        InsertBlockCache(pindex->GetBlockHash(), pblock);
+    return pblock;
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
 {
+    // Start from the indexed header, which carries the known hash of a legacy
+    // block: if the header on disk matches, it is not scrypted again
+    *this = pindex->GetBlockHeader();
     if (!fReadTransactions)
-    {
-        *this = pindex->GetBlockHeader();
         return true;
+    // Copying a cached block is much cheaper than reading and hashing it,
+    // but a miss doesn't fill the cache: sequential scans would only evict
+    // the blocks peers and RPC callers actually come back for
+    if (nBlockCacheSize > 0)
+    {
+        boost::shared_ptr<const CBlock> pblock = LookupBlockCache(pindex->GetBlockHash());
+        if (pblock)
+        {
+            *this = *pblock;
+            return true;
+        }
     }
     if (!ReadFromDisk(pindex->nFile, pindex->nBlockPos, fReadTransactions))
         return false;
@@ -962,9 +1256,11 @@ static const int64_t nTargetTimespan = 24 * 60 * 60;  // 24 hours
 // ppcoin: find last block index up to pindex
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake)
 {
-    while (pindex && pindex->pprev && (pindex->IsProofOfStake() != fProofOfStake))
-        pindex = pindex->pprev;
-    return pindex;
+    if (!pindex || pindex->IsProofOfStake() == fProofOfStake)
+        return pindex;
+    const CBlockIndex* pindexLast = fProofOfStake ? pindex->pprevStake : pindex->pprevWork;
+    // Without one the search ends at the first block of the chain
+    return pindexLast ? pindexLast : pindex->GetAncestor(0);
 }
 
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake)
@@ -1033,6 +1329,8 @@ bool IsInitialBlockDownload()
             pindexBest->GetBlockTime() < GetTime() - nMaxTipAge);
 }
 
+bool static IsCanonicalBlockSignature(const CBlock* pblock, bool checkLowS);
+
 void static InvalidChainFound(CBlockIndex* pindexNew)
 {
     if (pindexNew->nChainTrust > nBestInvalidTrust)
@@ -1063,16 +1361,20 @@ void CBlock::UpdateTime(const CBlockIndex* pindexPrev)
 
 bool IsConfirmedInNPrevBlocks(const CTxIndex& txindex, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth)
 {
-    for (const CBlockIndex* pindex = pindexFrom; pindex && pindexFrom->nHeight - pindex->nHeight < nMaxDepth; pindex = pindex->pprev)
-    {
-        if (pindex->nBlockPos == txindex.pos.nBlockPos && pindex->nFile == txindex.pos.nFile)
-        {
-            nActualDepth = pindexFrom->nHeight - pindex->nHeight;
-            return true;
-        }
-    }
+    const CBlockIndex* pindexTx = FindBlockByPos(txindex.pos.nFile, txindex.pos.nBlockPos);
+    if (!pindexTx || !pindexFrom)
+        return false;
 
-    return false;
+    int nDepth = pindexFrom->nHeight - pindexTx->nHeight;
+    if (nDepth < 0 || nDepth >= nMaxDepth)
+        return false;
+
+    // Within the main chain the height is enough, otherwise check that pindexTx is an ancestor
+    if (!(pindexFrom->IsInMainChain() && pindexTx->IsInMainChain()) && pindexFrom->GetAncestor(pindexTx->nHeight) != pindexTx)
+        return false;
+
+    nActualDepth = nDepth;
+    return true;
 }
 
 
@@ -1119,8 +1421,141 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 }
 
 
+/** Closure reading a run of previous transactions from one block file, in
+ *  ascending position, into the entries prepared by PrefetchInputs */
+class CPrefetchRead
+{
+private:
+    unsigned int nFile;
+    std::vector<std::pair<CTxIndex, CTransaction>*> vEntries;
+
+public:
+    CPrefetchRead() : nFile(0) {}
+    CPrefetchRead(unsigned int nFileIn) : nFile(nFileIn) {}
+
+    unsigned int GetFile() const { return nFile; }
+    unsigned int size() const { return vEntries.size(); }
+    void Add(std::pair<CTxIndex, CTransaction>* pentry) { vEntries.push_back(pentry); }
+
+    bool operator()()
+    {
+        CBlockFileReader filein(SER_DISK, CLIENT_VERSION);
+        bool fOpen = filein.Open(nFile, vEntries.empty() ? 0 : vEntries.back()->first.pos.nTxPos);
+        for (unsigned int i = 0; i < vEntries.size(); i++)
+        {
+            std::pair<CTxIndex, CTransaction>* pentry = vEntries[i];
+            // Failed reads are dropped here and left to FetchInputs to report
+            if (!fOpen)
+            {
+                pentry->first.SetNull();
+                continue;
+            }
+            filein.Seek(pentry->first.pos.nTxPos);
+            try {
+                filein >> pentry->second;
+            }
+            catch (std::exception &e) {
+                pentry->first.SetNull();
+            }
+        }
+        return true;
+    }
+
+    void swap(CPrefetchRead &read)
+    {
+        std::swap(nFile, read.nFile);
+        vEntries.swap(read.vEntries);
+    }
+};
+
+// Transactions read by one prefetch job, all from the same block file
+static const unsigned int PREFETCH_RUN_SIZE = 16;
+
+static CCheckQueue<CPrefetchRead> prefetchqueue(1);
+
+void ThreadPrefetch() {
+    RenameThread("mokacoin-prefetch");
+    prefetchqueue.Thread();
+}
+
+static bool ComparePrefetchPos(const pair<CTxIndex, CTransaction>* a, const pair<CTxIndex, CTransaction>* b)
+{
+    if (a->first.pos.nFile != b->first.pos.nFile)
+        return a->first.pos.nFile < b->first.pos.nFile;
+    return a->first.pos.nTxPos < b->first.pos.nTxPos;
+}
+
+void PrefetchInputs(CTxDB& txdb, const vector<const CTransaction*>& vtx, MapPrevTx& mapPrefetchedRet)
+{
+    mapPrefetchedRet.clear();
+    if (nPrefetchThreads == 0)
+        return;
+    int64_t nStart = GetTimeMicros();
+
+    set<uint256> setCreated;
+    BOOST_FOREACH(const CTransaction* ptx, vtx)
+        setCreated.insert(ptx->GetHash());
+
+    // Resolve the index entries of all distinct inputs first
+    vector<pair<CTxIndex, CTransaction>*> vRead;
+    BOOST_FOREACH(const CTransaction* ptx, vtx)
+    {
+        if (ptx->IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, ptx->vin)
+        {
+            const uint256& hashPrev = txin.prevout.hash;
+            if (setCreated.count(hashPrev) || mapPrefetchedRet.count(hashPrev))
+                continue;
+            CTxIndex txindex;
+            if (!txdb.ReadTxIndex(hashPrev, txindex) || txindex.pos == CDiskTxPos(1,1,1))
+                continue;
+            pair<CTxIndex, CTransaction>& entry = mapPrefetchedRet[hashPrev];
+            entry.first = txindex;
+            vRead.push_back(&entry);
+        }
+    }
+
+    // Then read them in disk order, in runs of nearby transactions
+    sort(vRead.begin(), vRead.end(), ComparePrefetchPos);
+    vector<CPrefetchRead> vRuns;
+    for (unsigned int i = 0; i < vRead.size(); i++)
+    {
+        pair<CTxIndex, CTransaction>* pentry = vRead[i];
+        if (vRuns.empty() || vRuns.back().GetFile() != pentry->first.pos.nFile || vRuns.back().size() >= PREFETCH_RUN_SIZE)
+            vRuns.push_back(CPrefetchRead(pentry->first.pos.nFile));
+        vRuns.back().Add(pentry);
+    }
+
+    if (nPrefetchThreads > 1 && vRuns.size() > 1)
+    {
+        // The queue hands out work from the back, start with the lowest positions
+        reverse(vRuns.begin(), vRuns.end());
+        CCheckQueueControl<CPrefetchRead> control(&prefetchqueue);
+        control.Add(vRuns);
+        control.Wait();
+    }
+    else
+    {
+        BOOST_FOREACH(CPrefetchRead& run, vRuns)
+            run();
+    }
+
+    for (MapPrevTx::iterator mi = mapPrefetchedRet.begin(); mi != mapPrefetchedRet.end(); )
+    {
+        if (mi->second.first.IsNull())
+            mapPrefetchedRet.erase(mi++);
+        else
+            ++mi;
+    }
+
+    LogPrint("txdb", "PrefetchInputs() : read %u of %u inputs in %.2fms\n",
+             mapPrefetchedRet.size(), vRead.size(), (GetTimeMicros() - nStart) * 0.001);
+}
+
 bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTestPool,
-                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid)
+                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid,
+                               const MapPrevTx* pmapPrefetched)
 {
     // FetchInputs can return false either because we just haven't seen some inputs
     // (in which case the transaction should be stored as an orphan)
@@ -1137,6 +1572,14 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         if (inputsRet.count(prevout.hash))
             continue; // Got it already
 
+        const std::pair<CTxIndex, CTransaction>* pprefetched = NULL;
+        if (pmapPrefetched)
+        {
+            MapPrevTx::const_iterator mi = pmapPrefetched->find(prevout.hash);
+            if (mi != pmapPrefetched->end())
+                pprefetched = &mi->second;
+        }
+
         // Read txindex
         CTxIndex& txindex = inputsRet[prevout.hash].first;
         bool fFound = true;
@@ -1145,6 +1588,11 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
             // Get txindex from current proposed changes
             txindex = mapTestPool.find(prevout.hash)->second;
         }
+        else if (pprefetched)
+        {
+            // Unchanged since PrefetchInputs, changes go to mapTestPool
+            txindex = pprefetched->first;
+        }
         else
         {
             // Read txindex from txdb
@@ -1163,6 +1611,11 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
             if (!fFound)
                 txindex.vSpent.resize(txPrev.vout.size());
         }
+        else if (pprefetched && pprefetched->first.pos == txindex.pos)
+        {
+            // Already read by PrefetchInputs
+            txPrev = pprefetched->second;
+        }
         else
         {
             // Get prev tx from disk
@@ -1217,8 +1670,37 @@ int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
 
 }
 
+bool CScriptCheck::operator()() const
+{
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    return VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, pSigHashCache.get());
+}
+
+bool CScriptCheck::Invalid() const
+{
+    if (nFlags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
+        // Check whether the failure was caused by a
+        // non-mandatory script verification check, such as
+        // non-null dummy arguments;
+        // if so, don't trigger DoS protection to
+        // avoid splitting the network between upgraded and
+        // non-upgraded nodes.
+        const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+        if (VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, nHashType, pSigHashCache.get()))
+            return error("ConnectInputs() : %s non-mandatory VerifySignature failed", ptxTo->GetHash().ToString());
+    }
+    // Failures of other flags indicate a transaction that is
+    // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
+    // such nodes as they are not following the protocol. That
+    // said during an upgrade careful thought should be taken
+    // as to the correct behavior - we may want to continue
+    // peering with non-upgraded nodes even after a soft-fork
+    // super-majority vote has passed.
+    return ptxTo->DoS(100, error("ConnectInputs() : %s VerifySignature failed", ptxTo->GetHash().ToString()));
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1265,6 +1747,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
+        boost::shared_ptr<const CSigHashCache> pSigHashCache;
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             COutPoint prevout = vin[i].prevout;
@@ -1283,28 +1766,19 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
+                // Serialize the parts of the signature hash all inputs share only once
+                if (!pSigHashCache && vin.size() > 1)
+                    pSigHashCache.reset(new CSigHashCache(*this));
+
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, flags, 0))
+                CScriptCheck check(txPrev, *this, i, flags, 0, pSigHashCache);
+                if (pvChecks)
                 {
-                    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
-                        // Check whether the failure was caused by a
-                        // non-mandatory script verification check, such as
-                        // non-null dummy arguments;
-                        // if so, don't trigger DoS protection to
-                        // avoid splitting the network between upgraded and
-                        // non-upgraded nodes.
-                        if (VerifySignature(txPrev, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0))
-                            return error("ConnectInputs() : %s non-mandatory VerifySignature failed", GetHash().ToString());
-                    }
-                    // Failures of other flags indicate a transaction that is
-                    // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
-                    // such nodes as they are not following the protocol. That
-                    // said during an upgrade careful thought should be taken
-                    // as to the correct behavior - we may want to continue
-                    // peering with non-upgraded nodes even after a soft-fork
-                    // super-majority vote has passed.
-                    return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString()));
+                    pvChecks->push_back(CScriptCheck());
+                    check.swap(pvChecks->back());
                 }
+                else if (!check())
+                    return check.Invalid();
             }
 
             // Mark outpoints as spent
@@ -1364,12 +1838,51 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck() {
+    RenameThread("mokacoin-scriptch");
+    scriptcheckqueue.Thread();
+}
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
     if (!CheckBlock(!fJustCheck, !fJustCheck, false))
         return false;
 
+    if (!nScriptCheckThreads)
+        return ConnectBlockInner(txdb, pindex, fJustCheck, NULL);
+
+    int nDoSBlock = nDoS;
+    vector<int> vDoSTx;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        vDoSTx.push_back(tx.nDoS);
+
+    CScriptCheck checkFailed;
+    if (ConnectBlockInner(txdb, pindex, fJustCheck, &checkFailed))
+        return true;
+    if (!checkFailed.GetTx())
+        return false;
+
+    // A script check failed. Serial validation would have stopped there:
+    // every check queued comes before the point the inline checks reached,
+    // and the queue reports the earliest failure. Take back the score of a
+    // later inline check and report the script the way ConnectInputs does.
+    nDoS = nDoSBlock;
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        vtx[i].nDoS = vDoSTx[i];
+    return checkFailed.Invalid();
+}
+
+bool CBlock::ConnectBlockInner(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck, CScriptCheck* pcheckFailed)
+{
+    // Script checks are queued for the verification threads when
+    // pcheckFailed is given, the queue is always drained before returning
+    // as the checks refer to vtx
+    bool fParallel = pcheckFailed != NULL;
+    CCheckQueueControl<CScriptCheck> control(fParallel ? &scriptcheckqueue : NULL, pcheckFailed);
+
     unsigned int flags = SCRIPT_VERIFY_NOCACHE;
     flags |= SCRIPT_VERIFY_NULLDUMMY |
              SCRIPT_VERIFY_STRICTENC |
@@ -1386,6 +1899,15 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    // Read the spent transactions in disk order before going through them
+    MapPrevTx mapPrefetched;
+    {
+        vector<const CTransaction*> vpTx;
+        BOOST_FOREACH(const CTransaction& tx, vtx)
+            vpTx.push_back(&tx);
+        PrefetchInputs(txdb, vpTx, mapPrefetched);
+    }
+
     map<uint256, CTxIndex> mapQueuedChanges;
     int64_t nFees = 0;
     int64_t nValueIn = 0;
@@ -1429,7 +1951,7 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         else
         {
             bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid))
+            if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid, &mapPrefetched))
                 return false;
 
             // Add in sigops done by pay-to-script-hash inputs;
@@ -1448,13 +1970,18 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (tx.IsCoinStake())
                 nStakeReward = nTxValueOut - nTxValueIn;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags))
+            vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, fParallel ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
 
+    if (!control.Wait())
+        return false;
+
     if (IsProofOfWork())
     {
         int64_t nReward = GetProofOfWorkReward(nFees);
@@ -1478,8 +2005,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     }
 
     // ppcoin: track money supply and mint amount info
-    pindex->nMint = nValueOut - nValueIn + nFees;
-    pindex->nMoneySupply = (pindex->pprev? pindex->pprev->nMoneySupply : 0) + nValueOut - nValueIn;
+    CBlockIndexCold cold = pindex->GetCold();
+    cold.nMint = nValueOut - nValueIn + nFees;
+    cold.nMoneySupply = (pindex->pprev? pindex->pprev->GetMoneySupply() : 0) + nValueOut - nValueIn;
+    pindex->SetCold(cold);
     if (!txdb.WriteBlockIndex(CDiskBlockIndex(pindex)))
         return error("Connect() : WriteBlockIndex for pindex failed");
 
@@ -1515,18 +2044,9 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     LogPrintf("REORGANIZE\n");
 
     // Find the fork
-    CBlockIndex* pfork = pindexBest;
-    CBlockIndex* plonger = pindexNew;
-    while (pfork != plonger)
-    {
-        while (plonger->nHeight > pfork->nHeight)
-            if (!(plonger = plonger->pprev))
-                return error("Reorganize() : plonger->pprev is null");
-        if (pfork == plonger)
-            break;
-        if (!(pfork = pfork->pprev))
-            return error("Reorganize() : pfork->pprev is null");
-    }
+    CBlockIndex* pfork = chainActive.FindFork(pindexNew);
+    if (!pfork)
+        return error("Reorganize() : no fork with the main chain");
 
     // List of what to disconnect
     vector<CBlockIndex*> vDisconnect;
@@ -1584,6 +2104,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     // Make sure it's successfully written to disk before changing memory structure
     if (!txdb.TxnCommit())
         return error("Reorganize() : TxnCommit failed");
+    UnpinBlockIndexCold();
 
     // Disconnect shorter branch
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
@@ -1594,6 +2115,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+    chainActive.SetTip(pindexNew);
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
@@ -1625,9 +2147,11 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
     }
     if (!txdb.TxnCommit())
         return error("SetBestChain() : TxnCommit failed");
+    UnpinBlockIndexCold();
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    chainActive.SetTip(pindexNew);
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
@@ -1649,6 +2173,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
         pindexGenesisBlock = pindexNew;
+        chainActive.SetTip(pindexNew);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -1712,7 +2237,6 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
@@ -1726,6 +2250,8 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
       nBestBlockTrust.GetLow64(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()));
 
+    uiInterface.NotifyBlockTip(hashBestChain);
+
     // Check the version of the last 100 blocks to see if we need to upgrade:
     if (!fIsInitialDownload)
     {
@@ -1812,13 +2338,15 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
     if (!pindexNew)
         return error("AddToBlockIndex() : new CBlockIndex failed");
-    pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    pindexNew->hashBlock = hash;
+    pindexNew->phashBlock = &pindexNew->hashBlock;
+    CBlockIndexMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
     }
+    pindexNew->BuildSkip();
 
     // ppcoin: compute chain trust score
     pindexNew->nChainTrust = (pindexNew->pprev ? pindexNew->pprev->nChainTrust : 0) + pindexNew->GetBlockTrust();
@@ -1827,8 +2355,16 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     if (!pindexNew->SetStakeEntropyBit(GetStakeEntropyBit()))
         return error("AddToBlockIndex() : SetStakeEntropyBit() failed");
 
-    // Record proof hash value
-    pindexNew->hashProof = hashProof;
+    // Record proof hash value. The entry is new, there is nothing to read
+    // back from the database yet.
+    CBlockIndexCold cold;
+    cold.hashProof = hashProof;
+    pindexNew->SetCold(cold);
+
+    // Blocks reach here through ProcessBlock, which normalizes the signature,
+    // so peers can be sent the stored bytes
+    if (IsCanonicalBlockSignature(this, true))
+        pindexNew->SetStoredLowS();
 
     // ppcoin: compute stake modifier
     uint64_t nStakeModifier = 0;
@@ -1839,18 +2375,19 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     pindexNew->bnStakeModifierV2 = ComputeStakeModifierV2(pindexNew->pprev, IsProofOfWork() ? hash : vtx[1].vin[0].prevout.hash);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    mapBlockIndex.insert(make_pair(hash, pindexNew));
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-    pindexNew->phashBlock = &((*mi).first);
+    mapBlockIndexByPos[make_pair(nFile, nBlockPos)] = pindexNew;
 
     // Write to disk block index
     CTxDB txdb;
     if (!txdb.TxnBegin())
         return false;
-    txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew));
+    txdb.AddBlockIndex(CDiskBlockIndex(pindexNew));
     if (!txdb.TxnCommit())
         return false;
+    UnpinBlockIndexCold();
 
     // New best
     if (pindexNew->nChainTrust > nBestChainTrust)
@@ -1963,7 +2500,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2022,7 +2559,7 @@ ACCEPT_BLOCK_LOOP:
                         continue;
                     }
 
-                    if(prev->hashProof == uint256())
+                    if(prev->GetProofHash() == uint256())
                     {
                         prev = prev->pprev;
                         continue;
@@ -2068,6 +2605,8 @@ ACCEPT_BLOCK_LOOP:
     unsigned int nBlockPos = 0;
     if (!WriteToDisk(nFile, nBlockPos))
         return error("AcceptBlock() : WriteToDisk failed");
+    // Peers are about to ask for it, and a reorganization may need it again
+    CacheBlock(*this);
     if (!AddToBlockIndex(nFile, nBlockPos, hashProof))
         return error("AcceptBlock() : AddToBlockIndex failed");
 
@@ -2095,6 +2634,59 @@ uint256 CBlockIndex::GetBlockTrust() const
     return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
 }
 
+// Turn the lowest set bit of n off
+static inline int InvertLowestOne(int n) { return n & (n - 1); }
+
+// The height pskip points to at nHeight. Any height is reached from any
+// higher one in O(log n) steps, mixing skips and pprev steps.
+static inline int GetSkipHeight(int nHeight)
+{
+    if (nHeight < 2)
+        return 0;
+    return (nHeight & 1) ? InvertLowestOne(InvertLowestOne(nHeight - 1)) + 1 : InvertLowestOne(nHeight);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (!pprev)
+        return;
+    pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+    pprevStake = pprev->IsProofOfStake() ? pprev : pprev->pprevStake;
+    pprevWork = pprev->IsProofOfWork() ? pprev : pprev->pprevWork;
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int nHeightAncestor)
+{
+    if (nHeightAncestor > nHeight || nHeightAncestor < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int nHeightWalk = nHeight;
+    while (nHeightWalk > nHeightAncestor)
+    {
+        int nHeightSkip = GetSkipHeight(nHeightWalk);
+        int nHeightSkipPrev = GetSkipHeight(nHeightWalk - 1);
+        // Only skip if that doesn't overshoot, or skipping from pprev wouldn't do better
+        if (pindexWalk->pskip && (nHeightSkip == nHeightAncestor ||
+            (nHeightSkip > nHeightAncestor && !(nHeightSkipPrev < nHeightSkip - 2 && nHeightSkipPrev >= nHeightAncestor))))
+        {
+            pindexWalk = pindexWalk->pskip;
+            nHeightWalk = nHeightSkip;
+        }
+        else
+        {
+            pindexWalk = pindexWalk->pprev;
+            nHeightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int nHeightAncestor) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(nHeightAncestor);
+}
+
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
 {
     unsigned int nFound = 0;
@@ -2118,7 +2710,7 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
     pnode->PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
 
-bool static IsCanonicalBlockSignature(CBlock* pblock, bool checkLowS)
+bool static IsCanonicalBlockSignature(const CBlock* pblock, bool checkLowS)
 {
     if (pblock->IsProofOfWork()) {
         return pblock->vchBlockSig.empty();
@@ -2127,7 +2719,7 @@ bool static IsCanonicalBlockSignature(CBlock* pblock, bool checkLowS)
     return checkLowS ? IsLowDERSignature(pblock->vchBlockSig, false) : IsDERSignature(pblock->vchBlockSig, false);
 }
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fCheckedBlock)
 {
     AssertLockHeld(cs_main);
 
@@ -2179,8 +2771,8 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             return error("ProcessBlock(): EnsureLowS failed");
     }
 
-    // Preliminary checks
-    if (!pblock->CheckBlock())
+    // Preliminary checks, the signature normalization above doesn't change their outcome
+    if (!fCheckedBlock && !pblock->CheckBlock())
         return error("ProcessBlock() : CheckBlock FAILED");
 
     // If we don't already have its previous block, shunt it off to holding area until we get it
@@ -2276,38 +2868,32 @@ bool CBlock::SignBlock(CWallet& wallet, int64_t nFees)
     if (IsProofOfStake())
         return true;
 
-    static int64_t nLastCoinStakeSearchTime = GetAdjustedTime(); // startup timestamp
-
+    // ThreadStakeMiner decides when to search and keeps
+    // nLastCoinStakeSearchInterval, this only signs at the current time
     CKey key;
     CTransaction txCoinStake;
     txCoinStake.nTime &= ~STAKE_TIMESTAMP_MASK;
 
-    int64_t nSearchTime = txCoinStake.nTime; // search to current time
-
-    if (nSearchTime > nLastCoinStakeSearchTime)
+    if (wallet.CreateCoinStake(wallet, nBits, 1, nFees, txCoinStake, key))
     {
-        if (wallet.CreateCoinStake(wallet, nBits, 1, nFees, txCoinStake, key))
+        if (txCoinStake.nTime >= pindexBest->GetPastTimeLimit()+1)
         {
-            if (txCoinStake.nTime >= pindexBest->GetPastTimeLimit()+1)
-            {
-                // make sure coinstake would meet timestamp protocol
-                //    as it would be the same as the block timestamp
-                vtx[0].nTime = nTime = txCoinStake.nTime;
+            // make sure coinstake would meet timestamp protocol
+            //    as it would be the same as the block timestamp
+            vtx[0].nTime = nTime = txCoinStake.nTime;
+            vtx[0].InvalidateCache();
 
-                // we have to make sure that we have no future timestamps in
-                //    our transactions set
-                for (vector<CTransaction>::iterator it = vtx.begin(); it != vtx.end();)
-                    if (it->nTime > nTime) { it = vtx.erase(it); } else { ++it; }
+            // we have to make sure that we have no future timestamps in
+            //    our transactions set
+            for (vector<CTransaction>::iterator it = vtx.begin(); it != vtx.end();)
+                if (it->nTime > nTime) { it = vtx.erase(it); } else { ++it; }
 
-                vtx.insert(vtx.begin() + 1, txCoinStake);
-                hashMerkleRoot = BuildMerkleTree();
+            vtx.insert(vtx.begin() + 1, txCoinStake);
+            hashMerkleRoot = BuildMerkleTree();
 
-                // append a signature to our block
-                return key.Sign(GetHash(), vchBlockSig);
-            }
+            // append a signature to our block
+            return key.Sign(GetHash(), vchBlockSig);
         }
-        nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
-        nLastCoinStakeSearchTime = nSearchTime;
     }
 
     return false;
@@ -2376,17 +2962,11 @@ bool CheckDiskSpace(uint64_t nAdditionalBytes)
     return true;
 }
 
-static filesystem::path BlockFilePath(unsigned int nFile)
-{
-    string strBlockFn = strprintf("blk%04u.dat", nFile);
-    return GetDataDir() / strBlockFn;
-}
-
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode)
 {
     if ((nFile < 1) || (nFile == (unsigned int) -1))
         return NULL;
-    FILE* file = fopen(BlockFilePath(nFile).string().c_str(), pszMode);
+    FILE* file = fopen(GetBlockFilePath(nFile).string().c_str(), pszMode);
     if (!file)
         return NULL;
     if (nBlockPos != 0 && !strchr(pszMode, 'a') && !strchr(pszMode, 'w'))
@@ -2400,27 +2980,51 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
     return file;
 }
 
-static unsigned int nCurrentBlockFile = 1;
-
-FILE* AppendBlockFile(unsigned int& nFileRet)
+// With the transaction index cache, a crash can leave the transaction index
+// on disk behind the best chain in the database (see CTxDB::TxnCommit). Move
+// the best chain back to where the transaction index is, and connect the
+// blocks since then again.
+static bool CatchUpTxIndex(CTxDB& txdb)
 {
-    nFileRet = 0;
-    while (true)
+    uint256 hashTxIndexBest;
+    if (pindexBest != NULL && txdb.ReadHashTxIndexBest(hashTxIndexBest) && hashTxIndexBest != hashBestChain)
     {
-        FILE* file = OpenBlockFile(nCurrentBlockFile, 0, "ab");
-        if (!file)
-            return NULL;
-        if (fseek(file, 0, SEEK_END) != 0)
-            return NULL;
-        // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-        if (ftell(file) < (long)(0x7F000000 - MAX_SIZE))
+        // Zero stands for an empty transaction index, the genesis block's
+        // coinbase is not in it
+        CBlockIndex* pindexTxIndex = hashTxIndexBest == 0 ? pindexGenesisBlock : mapBlockIndex[hashTxIndexBest];
+        if (pindexTxIndex == NULL)
+            return error("CatchUpTxIndex() : block %s of the transaction index not found", hashTxIndexBest.ToString());
+        CBlockIndex* pindexTip = pindexBest;
+        LogPrintf("CatchUpTxIndex() : transaction index is at height %d, connecting blocks up to %d again\n",
+                  pindexTxIndex->nHeight, pindexTip->nHeight);
+
+        hashBestChain = pindexTxIndex->GetBlockHash();
+        pindexBest = pindexTxIndex;
+        chainActive.SetTip(pindexBest);
+        nBestHeight = pindexBest->nHeight;
+        nBestChainTrust = pindexBest->nChainTrust;
+
+        CBlock block;
+        if (!block.ReadFromDisk(pindexTip) || !block.SetBestChain(txdb, pindexTip))
         {
-            nFileRet = nCurrentBlockFile;
-            return file;
+            // The database still has the old tip, put it back in memory too.
+            // Running on would leave the two apart.
+            hashBestChain = pindexTip->GetBlockHash();
+            pindexBest = pindexTip;
+            chainActive.SetTip(pindexBest);
+            nBestHeight = pindexBest->nHeight;
+            nBestChainTrust = pindexBest->nChainTrust;
+            return error("CatchUpTxIndex() : connecting blocks %d to %d again failed",
+                         pindexTxIndex->nHeight + 1, pindexTip->nHeight);
         }
-        fclose(file);
-        nCurrentBlockFile++;
     }
+
+    // The transaction index on disk is in step with the best chain now
+    if (!FlushTxIndexCache())
+        return false;
+    if (nTxIndexCacheSize > 0)
+        return txdb.WriteHashTxIndexBest(pindexBest ? hashBestChain : 0);
+    return txdb.EraseHashTxIndexBest();
 }
 
 bool LoadBlockIndex(bool fAllowNew)
@@ -2439,6 +3043,8 @@ bool LoadBlockIndex(bool fAllowNew)
     CTxDB txdb("cr+");
     if (!txdb.LoadBlockIndex())
         return false;
+    if (!CatchUpTxIndex(txdb))
+        return false;
 
     //
     // Init with genesis block
@@ -2463,12 +3069,290 @@ bool LoadBlockIndex(bool fAllowNew)
 
 
 
+// Positions of the best chain blocks being verified, and their heights
+typedef boost::unordered_map<pair<unsigned int, unsigned int>, int> ChainVerifyPosMap;
+
+// Whether the output spent at txpos was spent by a best chain block at or
+// above nHeight. Looks in pmapPos, or with cs_main held in mapBlockIndexByPos
+// if it is NULL.
+static bool IsSpentInChainAbove(const CDiskTxPos& txpos, int nHeight, const ChainVerifyPosMap* pmapPos)
+{
+    pair<unsigned int, unsigned int> pos = make_pair(txpos.nFile, txpos.nBlockPos);
+    if (pmapPos)
+    {
+        ChainVerifyPosMap::const_iterator mi = pmapPos->find(pos);
+        return mi != pmapPos->end() && mi->second >= nHeight;
+    }
+    AssertLockHeld(cs_main);
+    CBlockIndex* pindexSpend = FindBlockByPos(txpos.nFile, txpos.nBlockPos);
+    return pindexSpend && pindexSpend->IsInMainChain() && pindexSpend->nHeight >= nHeight;
+}
+
+// Check one best chain block at -checklevel nCheckLevel. Returns false if
+// anything is wrong with it.
+static bool VerifyChainBlock(CTxDB& txdb, CBlockIndex* pindex, int nCheckLevel, const ChainVerifyPosMap* pmapPos)
+{
+    CBlock block;
+    if (!block.ReadFromDisk(pindex))
+    {
+        LogPrintf("VerifyChainBlock() : *** cannot read block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+        return false;
+    }
+    bool fValid = true;
+    // check level 1: verify block validity
+    // check level 7: verify block signature too
+    if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
+    {
+        LogPrintf("VerifyChainBlock() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+        fValid = false;
+    }
+    // check level 2: verify transaction index validity
+    if (nCheckLevel>1)
+    {
+        BOOST_FOREACH(const CTransaction &tx, block.vtx)
+        {
+            uint256 hashTx = tx.GetHash();
+            CTxIndex txindex;
+            if (txdb.ReadTxIndex(hashTx, txindex))
+            {
+                // check level 3: checker transaction hashes
+                if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
+                {
+                    // either an error or a duplicate transaction
+                    CTransaction txFound;
+                    if (!txFound.ReadFromDisk(txindex.pos))
+                    {
+                        LogPrintf("VerifyChainBlock() : *** cannot read mislocated transaction %s\n", hashTx.ToString());
+                        fValid = false;
+                    }
+                    else
+                        if (txFound.GetHash() != hashTx) // not a duplicate tx
+                        {
+                            LogPrintf("VerifyChainBlock() : *** invalid tx position for %s\n", hashTx.ToString());
+                            fValid = false;
+                        }
+                }
+                // check level 4: check whether spent txouts were spent within the main chain
+                unsigned int nOutput = 0;
+                if (nCheckLevel>3)
+                {
+                    BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
+                    {
+                        if (!txpos.IsNull())
+                        {
+                            if (!IsSpentInChainAbove(txpos, pindex->nHeight, pmapPos))
+                            {
+                                LogPrintf("VerifyChainBlock() : *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString(), hashTx.ToString());
+                                fValid = false;
+                            }
+                            // check level 6: check whether spent txouts were spent by a valid transaction that consume them
+                            if (nCheckLevel>5)
+                            {
+                                CTransaction txSpend;
+                                if (!txSpend.ReadFromDisk(txpos))
+                                {
+                                    LogPrintf("VerifyChainBlock() : *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString(), nOutput);
+                                    fValid = false;
+                                }
+                                else if (!txSpend.CheckTransaction())
+                                {
+                                    LogPrintf("VerifyChainBlock() : *** spending transaction of %s:%i is invalid\n", hashTx.ToString(), nOutput);
+                                    fValid = false;
+                                }
+                                else
+                                {
+                                    bool fFound = false;
+                                    BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
+                                        if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
+                                            fFound = true;
+                                    if (!fFound)
+                                    {
+                                        LogPrintf("VerifyChainBlock() : *** spending transaction of %s:%i does not spend it\n", hashTx.ToString(), nOutput);
+                                        fValid = false;
+                                    }
+                                }
+                            }
+                        }
+                        nOutput++;
+                    }
+                }
+            }
+            // check level 5: check whether all prevouts are marked spent
+            if (nCheckLevel>4)
+            {
+                 BOOST_FOREACH(const CTxIn &txin, tx.vin)
+                 {
+                      CTxIndex txindex;
+                      if (txdb.ReadTxIndex(txin.prevout.hash, txindex))
+                          if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
+                          {
+                              LogPrintf("VerifyChainBlock() : *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString(), txin.prevout.n, hashTx.ToString());
+                              fValid = false;
+                          }
+                 }
+            }
+        }
+    }
+    return fValid;
+}
+
+static CCriticalSection cs_chainVerify;
+static CChainVerifyStatus chainVerifyStatus;
+
+CChainVerifyStatus GetChainVerifyStatus()
+{
+    LOCK(cs_chainVerify);
+    return chainVerifyStatus;
+}
+
+// The blocks to verify, shared by the verification threads
+struct CChainVerifyJob
+{
+    int nCheckLevel;
+    std::vector<CBlockIndex*> vBlocks;
+    ChainVerifyPosMap mapPos;
+
+    boost::mutex mutex;
+    size_t nNext;
+    std::vector<CBlockIndex*> vSuspect;
+
+    CChainVerifyJob() : nCheckLevel(0), nNext(0) {}
+};
+
+static void ThreadVerifyChainBlocks(CChainVerifyJob* pjob)
+{
+    RenameThread("mokacoin-verify-check");
+    CTxDB txdb("r");
+
+    while (true)
+    {
+        boost::this_thread::interruption_point();
+        CBlockIndex* pindex;
+        {
+            boost::unique_lock<boost::mutex> lock(pjob->mutex);
+            if (pjob->nNext == pjob->vBlocks.size())
+                return;
+            pindex = pjob->vBlocks[pjob->nNext++];
+        }
+
+        bool fValid = VerifyChainBlock(txdb, pindex, pjob->nCheckLevel, &pjob->mapPos);
+        if (!fValid)
+        {
+            boost::unique_lock<boost::mutex> lock(pjob->mutex);
+            pjob->vSuspect.push_back(pindex);
+        }
+        LOCK(cs_chainVerify);
+        chainVerifyStatus.nChecked++;
+        if (!fValid && (chainVerifyStatus.nBadHeight == -1 || pindex->nHeight < chainVerifyStatus.nBadHeight))
+            chainVerifyStatus.nBadHeight = pindex->nHeight;
+    }
+}
+
+// Sort suspect blocks, lowest first
+static bool CompareBlockIndexHeight(const CBlockIndex* pa, const CBlockIndex* pb)
+{
+    return pa->nHeight < pb->nHeight;
+}
+
+void ThreadVerifyChain()
+{
+    RenameThread("mokacoin-verify");
+
+    CChainVerifyJob job;
+    job.nCheckLevel = GetArg("-checklevel", DEFAULT_CHECKLEVEL);
+    int nCheckDepth = GetArg("-checkblocks", DEFAULT_CHECKBLOCKS);
+    {
+        LOCK(cs_main);
+        if (nCheckDepth == 0)
+            nCheckDepth = 1000000000; // suffices until the year 19000
+        if (nCheckDepth > nBestHeight)
+            nCheckDepth = nBestHeight;
+        for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
+        {
+            if (pindex->nHeight < nBestHeight-nCheckDepth)
+                break;
+            job.vBlocks.push_back(pindex);
+            if (job.nCheckLevel>3)
+                job.mapPos[make_pair(pindex->nFile, pindex->nBlockPos)] = pindex->nHeight;
+        }
+
+        {
+            LOCK(cs_chainVerify);
+            chainVerifyStatus.fRunning = true;
+            chainVerifyStatus.nCheckLevel = job.nCheckLevel;
+            chainVerifyStatus.nStartHeight = job.vBlocks.empty() ? nBestHeight : job.vBlocks.back()->nHeight;
+            chainVerifyStatus.nEndHeight = nBestHeight;
+            chainVerifyStatus.nTotal = job.vBlocks.size();
+        }
+    }
+
+    int nThreads = std::min(std::max(nScriptCheckThreads, 1), MAX_VERIFY_THREADS);
+    LogPrintf("Verifying last %i blocks at level %i in the background with %i threads\n", job.vBlocks.size(), job.nCheckLevel, nThreads);
+    int64_t nStart = GetTimeMillis();
+    {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&ThreadVerifyChainBlocks, &job));
+        try {
+            threadGroup.join_all();
+        }
+        catch (boost::thread_interrupted&) {
+            threadGroup.interrupt_all();
+            threadGroup.join_all();
+            {
+                LOCK(cs_chainVerify);
+                chainVerifyStatus.fRunning = false;
+            }
+            throw;
+        }
+    }
+
+    // The chain moved on while the blocks were checked, so a block only
+    // counts as bad if it still fails with cs_main held
+    sort(job.vSuspect.begin(), job.vSuspect.end(), CompareBlockIndexHeight);
+    {
+        LOCK(cs_main);
+        CTxDB txdb("r");
+        CBlockIndex* pindexFork = NULL;
+        BOOST_FOREACH(CBlockIndex* pindex, job.vSuspect)
+        {
+            if (pindex->IsInMainChain() && !VerifyChainBlock(txdb, pindex, job.nCheckLevel, NULL))
+            {
+                pindexFork = pindex->pprev;
+                break;
+            }
+        }
+        if (pindexFork)
+        {
+            // Reorg back to the fork
+            LogPrintf("ThreadVerifyChain() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
+            CBlock block;
+            if (!block.ReadFromDisk(pindexFork))
+                LogPrintf("ThreadVerifyChain() : block.ReadFromDisk failed\n");
+            else
+            {
+                CTxDB txdbFork;
+                block.SetBestChain(txdbFork, pindexFork);
+            }
+        }
+
+        {
+            LOCK(cs_chainVerify);
+            chainVerifyStatus.fRunning = false;
+            chainVerifyStatus.fDone = true;
+            chainVerifyStatus.nForkHeight = pindexFork ? pindexFork->nHeight : -1;
+        }
+    }
+    LogPrintf("Verified %u blocks in %dms, %u suspect\n", job.vBlocks.size(), GetTimeMillis() - nStart, job.vSuspect.size());
+}
+
+
 void PrintBlockTree()
 {
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (CBlockIndexMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2516,7 +3400,7 @@ void PrintBlockTree()
             block.GetHash().ToString(),
             block.nBits,
             DateTimeStrFormat("%x %H:%M:%S", block.GetBlockTime()),
-            FormatMoney(pindex->nMint),
+            FormatMoney(pindex->GetMint()),
             block.vtx.size());
 
         // put the main time-chain first
@@ -2536,64 +3420,294 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn)
+//
+// External block files are imported in a pipeline: a reader thread streams
+// the file and cuts it into blocks, a pool of threads runs the context free
+// checks (hashing, merkle root, signatures), and the calling thread connects
+// them in file order. The reader deserializes each block itself, so that a
+// record that isn't one can be told apart right away and the scan for the
+// next message start resumes inside it.
+//
+
+// Size of the reader's window on the file
+static const size_t IMPORT_READ_BUFFER = 8 * 1024 * 1024;
+// Blocks read ahead of the one being connected
+static const size_t IMPORT_MAX_QUEUED_BYTES = 32 * 1024 * 1024;
+static const size_t IMPORT_MAX_QUEUED_BLOCKS = 2000;
+// Maximum number of threads checking blocks
+static const int IMPORT_MAX_CHECK_THREADS = 8;
+
+struct CImportBlock
 {
-    int64_t nStart = GetTimeMillis();
+    unsigned int nSize;         // stored size, for the read ahead limit
+    CBlock block;
+    bool fChecked;              // done with by the check threads
+    bool fValid;                // passed CheckBlock
 
-    int nLoaded = 0;
+    CImportBlock() : nSize(0), fChecked(false), fValid(false) {}
+};
+
+class CBlockImportQueue
+{
+public:
+    boost::mutex mutex;
+    boost::condition_variable condRead;     // room for more blocks
+    boost::condition_variable condCheck;    // blocks to check
+    boost::condition_variable condConnect;  // the next block to connect is checked
+    std::deque<CImportBlock*> queue;        // in file order
+    size_t nCheckStarted;                   // blocks at the front handed to check threads
+    size_t nQueuedBytes;
+    uint64_t nBytesRead;
+    bool fReadDone;
+    bool fAbort;
+
+    CBlockImportQueue() : nCheckStarted(0), nQueuedBytes(0), nBytesRead(0), fReadDone(false), fAbort(false) {}
+
+    ~CBlockImportQueue()
     {
-        try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good())
+        BOOST_FOREACH(CImportBlock* pblock, queue)
+            delete pblock;
+    }
+
+    void Abort()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fAbort = true;
+        condRead.notify_all();
+        condCheck.notify_all();
+        condConnect.notify_all();
+    }
+};
+
+// Cut the file into blocks at the message start and size headers
+static void ThreadImportRead(CBlockImportQueue* pqueue, FILE* file)
+{
+    RenameThread("mokacoin-loadblk-read");
+
+    const unsigned char* pchMessageStart = Params().MessageStart();
+    std::vector<char> vchBuffer(IMPORT_READ_BUFFER);
+    size_t nBegin = 0, nEnd = 0;
+    bool fEOF = false;
+    try {
+        while (true)
+        {
+            // Find the next message start
+            char* pchFound = NULL;
+            if (nEnd - nBegin >= MESSAGE_START_SIZE)
             {
-                boost::this_thread::interruption_point();
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
+                for (char* pch = &vchBuffer[nBegin]; (pch = (char*)memchr(pch, pchMessageStart[0], &vchBuffer[0] + nEnd - pch - MESSAGE_START_SIZE + 1)) != NULL; pch++)
+                {
+                    if (memcmp(pch, pchMessageStart, MESSAGE_START_SIZE) == 0)
                     {
-                        nPos = (unsigned int)-1;
+                        pchFound = pch;
                         break;
                     }
-                    void* nFind = memchr(pchData, Params().MessageStart()[0], nRead+1-MESSAGE_START_SIZE);
-                    if (nFind)
+                }
+                nBegin = pchFound ? pchFound - &vchBuffer[0] : nEnd - MESSAGE_START_SIZE + 1;
+            }
+
+            unsigned int nSize = 0;
+            if (pchFound && nEnd - nBegin >= MESSAGE_START_SIZE + sizeof(nSize))
+            {
+                memcpy(&nSize, &vchBuffer[nBegin + MESSAGE_START_SIZE], sizeof(nSize));
+                if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+                {
+                    // Not a block after all, look further on
+                    nBegin += MESSAGE_START_SIZE;
+                    continue;
+                }
+                size_t nRecord = MESSAGE_START_SIZE + sizeof(nSize) + nSize;
+                if (nEnd - nBegin >= nRecord)
+                {
+                    // A block has to fill its record exactly. Anything else,
+                    // like a record cut short with the next one's bytes
+                    // counted into it, is skipped by its message start only:
+                    // good blocks may follow inside it.
+                    CImportBlock* pblock = new CImportBlock();
+                    pblock->nSize = nSize;
+                    try {
+                        const char* pchData = &vchBuffer[nBegin + MESSAGE_START_SIZE + sizeof(nSize)];
+                        CDataStream ssBlock(pchData, pchData + nSize, SER_DISK, CLIENT_VERSION);
+                        ssBlock >> pblock->block;
+                        if (!ssBlock.empty())
+                            throw std::ios_base::failure("block doesn't fill its record");
+                    }
+                    catch (std::exception &e) {
+                        LogPrint("import", "ThreadImportRead() : skipping a bad record of %u bytes: %s\n", nSize, e.what());
+                        delete pblock;
+                        nBegin += MESSAGE_START_SIZE;
+                        continue;
+                    }
+                    nBegin += nRecord;
+
+                    boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+                    while (!pqueue->fAbort && (pqueue->nQueuedBytes >= IMPORT_MAX_QUEUED_BYTES || pqueue->queue.size() >= IMPORT_MAX_QUEUED_BLOCKS))
+                        pqueue->condRead.wait(lock);
+                    if (pqueue->fAbort)
                     {
-                        if (memcmp(nFind, Params().MessageStart(), MESSAGE_START_SIZE)==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + MESSAGE_START_SIZE;
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
+                        delete pblock;
+                        return;
                     }
-                    else
-                        nPos += sizeof(pchData) - MESSAGE_START_SIZE + 1;
-                    boost::this_thread::interruption_point();
-                } while(true);
-                if (nPos == (unsigned int)-1)
+                    pqueue->nQueuedBytes += nSize;
+                    pqueue->queue.push_back(pblock);
+                    pqueue->condCheck.notify_one();
+                    continue;
+                }
+            }
+
+            // Need more data: keep what is left of the window and refill it.
+            // At the end of the file a record that is still incomplete was
+            // cut short, look for blocks inside it.
+            if (fEOF)
+            {
+                if (!pchFound)
                     break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+                nBegin += MESSAGE_START_SIZE;
+                continue;
+            }
+            memmove(&vchBuffer[0], &vchBuffer[nBegin], nEnd - nBegin);
+            nEnd -= nBegin;
+            nBegin = 0;
+            size_t nRead = fread(&vchBuffer[nEnd], 1, vchBuffer.size() - nEnd, file);
+            if (nRead < vchBuffer.size() - nEnd)
+                fEOF = true;
+            nEnd += nRead;
+            {
+                boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+                if (pqueue->fAbort)
+                    return;
+                pqueue->nBytesRead += nRead;
+            }
+        }
+    }
+    catch (std::exception &e) {
+        LogPrintf("%s() : error reading block file: %s\n", __PRETTY_FUNCTION__, e.what());
+    }
+
+    boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+    pqueue->fReadDone = true;
+    pqueue->condCheck.notify_all();
+    pqueue->condConnect.notify_all();
+}
+
+// Run the checks that don't depend on the chain
+static void ThreadImportCheck(CBlockImportQueue* pqueue)
+{
+    RenameThread("mokacoin-loadblk-check");
+
+    while (true)
+    {
+        CImportBlock* pblock = NULL;
+        {
+            boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+            while (!pqueue->fAbort && pqueue->nCheckStarted == pqueue->queue.size() && !pqueue->fReadDone)
+                pqueue->condCheck.wait(lock);
+            if (pqueue->fAbort || pqueue->nCheckStarted == pqueue->queue.size())
+                return;
+            pblock = pqueue->queue[pqueue->nCheckStarted++];
+        }
+
+        pblock->fValid = pblock->block.CheckBlock();
+
+        boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+        pblock->fChecked = true;
+        if (pblock == pqueue->queue.front())
+            pqueue->condConnect.notify_one();
+    }
+}
+
+// Stops the helper threads before the queue goes away, also when the import
+// is interrupted by a shutdown
+struct CImportThreadsGuard
+{
+    CBlockImportQueue& queue;
+    boost::thread_group& threadGroup;
+
+    CImportThreadsGuard(CBlockImportQueue& queueIn, boost::thread_group& threadGroupIn) : queue(queueIn), threadGroup(threadGroupIn) {}
+
+    ~CImportThreadsGuard()
+    {
+        queue.Abort();
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        uiInterface.ShowProgress("", 100);
+    }
+};
+
+bool LoadExternalBlockFile(FILE* fileIn)
+{
+    int64_t nStart = GetTimeMillis();
+
+    CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
+    if (!blkdat)
+        return false;
+
+    // Only needed for the progress report
+    int64_t nFileSize = 0;
+    if (fseek(blkdat, 0, SEEK_END) == 0)
+        nFileSize = ftell(blkdat);
+    rewind(blkdat);
+
+    CBlockImportQueue queue;
+    boost::thread_group threadGroup;
+    int nCheckThreads = std::min(std::max(nScriptCheckThreads, 1), IMPORT_MAX_CHECK_THREADS);
+
+    int nLoaded = 0, nProcessed = 0;
+    int64_t nLastProgress = nStart, nLastBytes = 0;
+    int nLastProcessed = 0;
+    {
+        CImportThreadsGuard guard(queue, threadGroup);
+        try {
+            threadGroup.create_thread(boost::bind(&ThreadImportRead, &queue, (FILE*)blkdat));
+            for (int i = 0; i < nCheckThreads; i++)
+                threadGroup.create_thread(boost::bind(&ThreadImportCheck, &queue));
+
+            while (true)
+            {
+                CImportBlock* pblock = NULL;
+                uint64_t nBytesRead = 0;
+                {
+                    boost::unique_lock<boost::mutex> lock(queue.mutex);
+                    while (!(queue.fReadDone && queue.queue.empty()) && (queue.queue.empty() || !queue.queue.front()->fChecked))
+                        queue.condConnect.wait(lock);
+                    if (queue.queue.empty())
+                        break;
+                    pblock = queue.queue.front();
+                    queue.queue.pop_front();
+                    queue.nCheckStarted--;
+                    queue.nQueuedBytes -= pblock->nSize;
+                    queue.condRead.notify_one();
+                    nBytesRead = queue.nBytesRead;
+                }
+
+                if (pblock->fValid)
                 {
-                    CBlock block;
-                    blkdat >> block;
                     LOCK(cs_main);
-                    if (ProcessBlock(NULL,&block))
-                    {
+                    if (ProcessBlock(NULL, &pblock->block, true))
                         nLoaded++;
-                        nPos += 4 + nSize;
-                    }
+                }
+                delete pblock;
+                nProcessed++;
+
+                int64_t nNow = GetTimeMillis();
+                if (nNow - nLastProgress >= 1000)
+                {
+                    double dBlocksPerSec = (nProcessed - nLastProcessed) * 1000.0 / (nNow - nLastProgress);
+                    double dMBPerSec = (nBytesRead - nLastBytes) * 1000.0 / (nNow - nLastProgress) / 1048576;
+                    int nPercent = nFileSize > 0 ? (int)std::min((int64_t)100, (int64_t)(nBytesRead * 100 / nFileSize)) : 0;
+                    uiInterface.ShowProgress(strprintf(_("Importing blocks (%.0f blocks/s, %.1f MB/s)..."), dBlocksPerSec, dMBPerSec), nPercent);
+                    LogPrint("import", "LoadExternalBlockFile() : %d%% read, %d blocks, %.0f blocks/s, %.1f MB/s\n", nPercent, nProcessed, dBlocksPerSec, dMBPerSec);
+                    nLastProgress = nNow;
+                    nLastBytes = nBytesRead;
+                    nLastProcessed = nProcessed;
                 }
             }
         }
         catch (std::exception &e) {
-            LogPrintf("%s() : Deserialize or I/O error caught during load\n",
-                   __PRETTY_FUNCTION__);
+            LogPrintf("%s() : error caught during load: %s\n", __PRETTY_FUNCTION__, e.what());
         }
     }
+
     LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
 }
@@ -2707,6 +3821,156 @@ string GetWarnings(string strFor)
 //
 
 
+// Send a block as it is stored in its block file. The stored bytes are the
+// network serialization, so there is no need to deserialize and reserialize.
+// Open the block file at the block of pindex, checking the message start and
+// size it is stored with. The stream is left at the start of the block.
+bool static OpenStoredBlock(CBlockFileReader& filein, const CBlockIndex* pindex, unsigned int& nSizeRet)
+{
+    // Each block is preceded by the message start and its size
+    if (pindex->nBlockPos < 8)
+        return false;
+    if (!filein.Open(pindex->nFile, pindex->nBlockPos - 8))
+        return false;
+
+    unsigned char pchMessageStart[4];
+    unsigned int nSize = 0;
+    try {
+        filein >> FLATDATA(pchMessageStart) >> nSize;
+    }
+    catch (std::exception &e) {
+        return false;
+    }
+    if (memcmp(pchMessageStart, Params().MessageStart(), sizeof(pchMessageStart)) != 0 || nSize > MAX_BLOCK_SIZE)
+        return error("OpenStoredBlock() : bad block header in blk%04u.dat at %u", pindex->nFile, pindex->nBlockPos);
+    nSizeRet = nSize;
+    return true;
+}
+
+bool static PushStoredBlock(CNode* pfrom, const CBlockIndex* pindex)
+{
+    CBlockFileReader filein(SER_DISK, CLIENT_VERSION);
+    unsigned int nSize = 0;
+    if (!OpenStoredBlock(filein, pindex, nSize))
+        return false;
+
+    pfrom->BeginMessage("block");
+    try {
+        size_t nOffset = pfrom->ssSend.size();
+        pfrom->ssSend.resize(nOffset + nSize);
+        filein.read(&pfrom->ssSend[nOffset], nSize);
+    }
+    catch (std::exception &e) {
+        pfrom->AbortMessage();
+        return error("PushStoredBlock() : read of blk%04u.dat at %u failed", pindex->nFile, pindex->nBlockPos);
+    }
+    pfrom->EndMessage();
+    return true;
+}
+
+// Bootstrap files are written in chunks of about this size, each with its own
+// checksum in the manifest so an importer can verify them in parallel
+static const uint64_t BOOTSTRAP_CHUNK_SIZE = 64 * 1024 * 1024;
+// Size of the writes to the bootstrap file
+static const size_t BOOTSTRAP_WRITE_BUFFER = 8 * 1024 * 1024;
+
+bool ExportBootstrap(const boost::filesystem::path& path, int nStartHeight, int nEndHeight, int& nBlocksRet, uint64_t& nBytesRet)
+{
+    int64_t nStart = GetTimeMillis();
+    nBlocksRet = 0;
+    nBytesRet = 0;
+
+    // Block index entries are never freed and their position doesn't change,
+    // so only collecting them needs cs_main
+    std::vector<const CBlockIndex*> vBlocks;
+    {
+        LOCK(cs_main);
+        if (nEndHeight < 0 || nEndHeight > nBestHeight)
+            nEndHeight = nBestHeight;
+        if (nStartHeight < 0 || nStartHeight > nEndHeight)
+            return error("ExportBootstrap() : invalid height range %d to %d", nStartHeight, nEndHeight);
+        vBlocks.reserve(nEndHeight - nStartHeight + 1);
+        for (int nHeight = nStartHeight; nHeight <= nEndHeight; nHeight++)
+            vBlocks.push_back(chainActive[nHeight]);
+    }
+
+    FILE* file = fopen(path.string().c_str(), "wb");
+    if (!file)
+        return error("ExportBootstrap() : can't open %s", path.string());
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+
+    std::string strManifest = "# Mokacoin bootstrap manifest\n";
+    strManifest += "# Each line is a chunk starting at a block: offset, size, first height, last height, sha256\n";
+
+    std::vector<char> vchBuffer;
+    vchBuffer.reserve(BOOTSTRAP_WRITE_BUFFER + MAX_BLOCK_SIZE + 8);
+    SHA256_CTX ctx;
+    uint64_t nChunkPos = 0, nChunkSize = 0;
+    int nChunkFirst = nStartHeight;
+    CBlockFileReader filein(SER_DISK, CLIENT_VERSION);
+    for (unsigned int i = 0; i < vBlocks.size(); i++)
+    {
+        const CBlockIndex* pindex = vBlocks[i];
+        if (ShutdownRequested())
+            return error("ExportBootstrap() : interrupted at height %d", pindex->nHeight);
+
+        // Copy the block as it is stored, after the usual message start and size
+        unsigned int nSize = 0;
+        if (!OpenStoredBlock(filein, pindex, nSize))
+            return error("ExportBootstrap() : can't read block at height %d", pindex->nHeight);
+        size_t nOffset = vchBuffer.size();
+        vchBuffer.resize(nOffset + 8 + nSize);
+        memcpy(&vchBuffer[nOffset], Params().MessageStart(), 4);
+        memcpy(&vchBuffer[nOffset + 4], &nSize, 4);
+        try {
+            filein.read(&vchBuffer[nOffset + 8], nSize);
+        }
+        catch (std::exception &e) {
+            return error("ExportBootstrap() : read of block at height %d failed", pindex->nHeight);
+        }
+
+        if (nChunkSize == 0)
+        {
+            SHA256_Init(&ctx);
+            nChunkFirst = pindex->nHeight;
+        }
+        SHA256_Update(&ctx, &vchBuffer[nOffset], 8 + nSize);
+        nChunkSize += 8 + nSize;
+        if (nChunkSize >= BOOTSTRAP_CHUNK_SIZE || i == vBlocks.size() - 1)
+        {
+            unsigned char hash[SHA256_DIGEST_LENGTH];
+            SHA256_Final(hash, &ctx);
+            strManifest += strprintf("%u %u %d %d %s\n", nChunkPos, nChunkSize, nChunkFirst, pindex->nHeight, HexStr(hash, hash + sizeof(hash)));
+            nChunkPos += nChunkSize;
+            nChunkSize = 0;
+        }
+
+        if (vchBuffer.size() >= BOOTSTRAP_WRITE_BUFFER || i == vBlocks.size() - 1)
+        {
+            if (fwrite(&vchBuffer[0], 1, vchBuffer.size(), fileout) != vchBuffer.size())
+                return error("ExportBootstrap() : write to %s failed", path.string());
+            nBytesRet += vchBuffer.size();
+            vchBuffer.clear();
+        }
+        nBlocksRet++;
+    }
+    fflush(fileout);
+    FileCommit(fileout);
+    fileout.fclose();
+
+    boost::filesystem::path pathManifest = path.string() + ".manifest";
+    FILE* fileManifest = fopen(pathManifest.string().c_str(), "w");
+    if (!fileManifest)
+        return error("ExportBootstrap() : can't open %s", pathManifest.string());
+    bool fOk = fwrite(strManifest.data(), 1, strManifest.size(), fileManifest) == strManifest.size();
+    fclose(fileManifest);
+    if (!fOk)
+        return error("ExportBootstrap() : write to %s failed", pathManifest.string());
+
+    LogPrintf("Exported %d blocks (%u bytes) to %s in %dms\n", nBlocksRet, nBytesRet, path.string(), GetTimeMillis() - nStart);
+    return true;
+}
+
 bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 {
     switch (inv.type)
@@ -2752,20 +4016,31 @@ void static ProcessGetData(CNode* pfrom)
             if (inv.type == MSG_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                CBlockIndexMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-
-                    // previous versions could accept sigs with high s
-                    if (!IsCanonicalBlockSignature(&block, true)) {
-                        bool ret = EnsureLowS(block.vchBlockSig);
-                        assert(ret);
+                    CBlockIndex* pindex = (*mi).second;
+                    boost::shared_ptr<const CBlock> pblock;
+                    if (!pindex->IsStoredLowS() || !PushStoredBlock(pfrom, pindex))
+                        pblock = ReadBlockCached(pindex);
+                    if (pblock)
+                    {
+                        // previous versions could accept sigs with high s
+                        if (!IsCanonicalBlockSignature(pblock.get(), true)) {
+                            CBlock block(*pblock);
+                            bool ret = EnsureLowS(block.vchBlockSig);
+                            assert(ret);
+                            pfrom->PushMessage("block", block);
+                        }
+                        else
+                        {
+                            // Send the stored bytes next time. The flag is only
+                            // set in memory here, so this runs again after a restart.
+                            pindex->SetStoredLowS();
+                            pfrom->PushMessage("block", *pblock);
+                        }
                     }
 
-                    pfrom->PushMessage("block", block);
-
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
                     {
@@ -3139,7 +4414,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3716,7 +4991,7 @@ int GetHeightFromTxHash(const uint256& hash)
     {
         if (hashBlock != 0)
         {
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
             if (mi != mapBlockIndex.end() && (*mi).second)
             {
                 CBlockIndex* pindex = (*mi).second;
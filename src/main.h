@@ -7,6 +7,7 @@
 
 #include "core.h"
 #include "bignum.h"
+#include "blockfile.h"
 #include "sync.h"
 #include "txmempool.h"
 #include "net.h"
@@ -15,8 +16,14 @@
 
 #include <list>
 
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
 class CBlock;
 class CBlockIndex;
+class CBlockIndexMap;
+class CChain;
 class CInv;
 class CKeyItem;
 class CNode;
@@ -37,8 +44,22 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** The maximum number of orphan transactions kept in memory */
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Default for -prefetchthreads, number of threads reading previous transactions ahead of validation */
+static const int DEFAULT_PREFETCH_THREADS = 4;
+/** Maximum number of prefetch threads allowed */
+static const int MAX_PREFETCH_THREADS = 16;
 /** Default for -maxorphanblocksmib, maximum number of memory to keep orphan blocks */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 40;
+/** Default for -blockcache, megabytes of recently used blocks kept deserialized in memory */
+static const unsigned int DEFAULT_BLOCK_CACHE = 32;
+/** Default for -checkblocks, how many best chain blocks are verified after startup */
+static const int DEFAULT_CHECKBLOCKS = 500;
+/** Default for -checklevel, how thorough that verification is */
+static const int DEFAULT_CHECKLEVEL = 1;
+/** Maximum number of threads verifying the best chain after startup */
+static const int MAX_VERIFY_THREADS = 8;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
@@ -65,7 +86,10 @@ inline int64_t FutureDrift(int64_t nTime) { return nTime + 63; }
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern CBlockIndexMap mapBlockIndex;
+/** Block index entries by the file and position their block is stored at */
+typedef boost::unordered_map<std::pair<unsigned int, unsigned int>, CBlockIndex*> BlockPosMap;
+extern BlockPosMap mapBlockIndexByPos;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nStakeMinConfirmations;
@@ -79,6 +103,8 @@ extern uint256 nBestChainTrust;
 extern uint256 nBestInvalidTrust;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
+/** The main chain by height, its tip is pindexBest */
+extern CChain chainActive;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
 extern int64_t nLastCoinStakeSearchInterval;
@@ -92,12 +118,16 @@ extern bool fHaveGUI;
 
 // Settings
 extern bool fUseFastIndex;
+extern int nScriptCheckThreads;
+extern int nPrefetchThreads;
+extern int64_t nBlockCacheSize;
 extern unsigned int nDerivationMethodIndex;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
 
 class CReserveKey;
+class CScriptCheck;
 class CTxDB;
 class CTxIndex;
 class CWalletInterface;
@@ -120,16 +150,55 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock);
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fCheckedBlock = false);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
-FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
+/** Find the index entry of the block stored at nFile/nBlockPos, e.g. the one containing a transaction */
+CBlockIndex* FindBlockByPos(unsigned int nFile, unsigned int nBlockPos);
+/** Get the block of pindex from the recently used block cache, reading and
+ *  caching it when it isn't there. Returns NULL if it can't be read. */
+boost::shared_ptr<const CBlock> ReadBlockCached(const CBlockIndex* pindex);
+/** Add a block, e.g. one that was just accepted, to the block cache */
+void CacheBlock(const CBlock& block);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
+/** Import the blocks of a bootstrap file, takes ownership of fileIn */
+bool LoadExternalBlockFile(FILE* fileIn);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+/** Write the main chain blocks from nStartHeight to nEndHeight (-1 for the best
+ *  block) to a bootstrap file as -loadblock reads it, copying them from the block
+ *  files as stored, and a checksum manifest for each chunk to <path>.manifest */
+bool ExportBootstrap(const boost::filesystem::path& path, int nStartHeight, int nEndHeight, int& nBlocksRet, uint64_t& nBytesRet);
+/** Verify the last -checkblocks best chain blocks at -checklevel with a
+ *  pool of threads, then move the best chain back before the lowest bad
+ *  block if any was found */
+void ThreadVerifyChain();
+
+/** Progress of ThreadVerifyChain */
+struct CChainVerifyStatus
+{
+    bool fRunning;
+    bool fDone;
+    int nCheckLevel;
+    int nStartHeight;   // lowest block being verified
+    int nEndHeight;     // best block when the verification started
+    unsigned int nTotal;
+    unsigned int nChecked;
+    int nBadHeight;     // lowest block that failed a check, -1 if none
+    int nForkHeight;    // block the best chain was moved back to, -1 if none
+
+    CChainVerifyStatus() : fRunning(false), fDone(false), nCheckLevel(0), nStartHeight(0), nEndHeight(0),
+                           nTotal(0), nChecked(0), nBadHeight(-1), nForkHeight(-1) {}
+};
+CChainVerifyStatus GetChainVerifyStatus();
+
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
+/** Run an instance of the input prefetch thread */
+void ThreadPrefetch();
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -208,6 +277,61 @@ public:
 
 typedef std::map<uint256, std::pair<CTxIndex, CTransaction> > MapPrevTx;
 
+/** A lazily computed value that may be filled in from several threads at once.
+ *  The first thread to claim the slot stores the value, the others keep their
+ *  own result and leave the slot alone. Clear() must not race with readers,
+ *  it is meant for the owner that is modifying the object.
+ */
+template<typename T>
+class CCachedValue
+{
+private:
+    enum { EMPTY, WRITING, VALID };
+    boost::atomic<int> nState;
+    T value;
+
+public:
+    CCachedValue() : nState(EMPTY) {}
+
+    CCachedValue(const CCachedValue& other) : nState(EMPTY)
+    {
+        T valueOther;
+        if (other.Get(valueOther))
+            Set(valueOther);
+    }
+
+    CCachedValue& operator=(const CCachedValue& other)
+    {
+        T valueOther;
+        Clear();
+        if (other.Get(valueOther))
+            Set(valueOther);
+        return *this;
+    }
+
+    bool Get(T& valueRet) const
+    {
+        if (nState.load(boost::memory_order_acquire) != VALID)
+            return false;
+        valueRet = value;
+        return true;
+    }
+
+    void Set(const T& valueIn)
+    {
+        int nExpected = EMPTY;
+        if (!nState.compare_exchange_strong(nExpected, WRITING, boost::memory_order_acquire))
+            return;
+        value = valueIn;
+        nState.store(VALID, boost::memory_order_release);
+    }
+
+    void Clear()
+    {
+        nState.store(EMPTY, boost::memory_order_release);
+    }
+};
+
 /** The basic transaction that is broadcasted on the network and contained in
  * blocks.  A transaction can contain multiple inputs and outputs.
  */
@@ -225,6 +349,10 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+    // Memory only: hash and serialized size, filled in on first use
+    mutable CCachedValue<uint256> cachedHash;
+    mutable CCachedValue<unsigned int> cachedSize;
+
     CTransaction()
     {
         SetNull();
@@ -237,12 +365,26 @@ public:
 
     IMPLEMENT_SERIALIZE
     (
-        READWRITE(this->nVersion);
-        nVersion = this->nVersion;
-        READWRITE(nTime);
-        READWRITE(vin);
-        READWRITE(vout);
-        READWRITE(nLockTime);
+        // The encoding does not depend on nType or nVersion, so one size fits all
+        unsigned int nSizeCached;
+        if (fGetSize && cachedSize.Get(nSizeCached))
+            nSerSize = nSizeCached;
+        else
+        {
+            if (fRead)
+            {
+                cachedHash.Clear();
+                cachedSize.Clear();
+            }
+            READWRITE(this->nVersion);
+            nVersion = this->nVersion;
+            READWRITE(nTime);
+            READWRITE(vin);
+            READWRITE(vout);
+            READWRITE(nLockTime);
+            if (fGetSize)
+                cachedSize.Set(nSerSize);
+        }
     )
 
     void SetNull()
@@ -253,6 +395,7 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        InvalidateCache();
     }
 
     bool IsNull() const
@@ -262,7 +405,21 @@ public:
 
     uint256 GetHash() const
     {
-        return SerializeHash(*this);
+        uint256 hash;
+        if (!cachedHash.Get(hash))
+        {
+            hash = SerializeHash(*this);
+            cachedHash.Set(hash);
+        }
+        return hash;
+    }
+
+    /** Forget the cached hash and size. Anything that changes a transaction
+        after it may have been hashed or measured must call this. */
+    void InvalidateCache()
+    {
+        cachedHash.Clear();
+        cachedSize.Clear();
     }
 
     bool IsCoinBase() const
@@ -303,7 +460,22 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
-        CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
+        if (!pfileRet)
+        {
+            CBlockFileReader filein(SER_DISK, CLIENT_VERSION);
+            if (!filein.Open(pos.nFile, pos.nTxPos))
+                return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
+            try {
+                filein >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
+            return true;
+        }
+
+        // Callers that want the file pointer back get a stdio handle
+        CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, "rb+"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
 
@@ -319,12 +491,9 @@ public:
         }
 
         // Return file pointer
-        if (pfileRet)
-        {
-            if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
-                return error("CTransaction::ReadFromDisk() : second fseek failed");
-            *pfileRet = filein.release();
-        }
+        if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
+            return error("CTransaction::ReadFromDisk() : second fseek failed");
+        *pfileRet = filein.release();
         return true;
     }
 
@@ -374,10 +543,12 @@ public:
      @param[in] fMiner	True if being called by CreateNewBlock
      @param[out] inputsRet	Pointers to this transaction's inputs
      @param[out] fInvalid	returns true if transaction is invalid
+     @param[in] pmapPrefetched	Previous transactions already read by PrefetchInputs, if any
      @return	Returns true if all inputs are in txdb or mapTestPool
      */
     bool FetchInputs(CTxDB& txdb, const std::map<uint256, CTxIndex>& mapTestPool,
-                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid);
+                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid,
+                     const MapPrevTx* pmapPrefetched = NULL);
 
     /** Sanity check previous transactions, then, if all checks succeed,
         mark them as spent by this transaction.
@@ -388,11 +559,13 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	if not NULL, script checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64_t& nCoinAge) const;
 
@@ -435,6 +608,20 @@ unsigned int GetLegacySigOpCount(const CTransaction& tx);
  */
 unsigned int GetP2SHSigOpCount(const CTransaction& tx, const MapPrevTx& mapInputs);
 
+/** Read the previous transactions spent by vtx ahead of FetchInputs.
+    Index entries are looked up first, then the transactions are read from the
+    block files sorted by position, spread over the prefetch threads.
+    Inputs created in vtx itself or still in the memory pool are left out, as
+    are ones that could not be read; FetchInputs handles those as before.
+    Does nothing with -prefetchthreads=0; with 1 the validating thread
+    does all the reads itself.
+
+    @param[in] txdb	Transaction database
+    @param[in] vtx	Transactions whose inputs will be fetched
+    @param[out] mapPrefetchedRet	Index entries and transactions read
+ */
+void PrefetchInputs(CTxDB& txdb, const std::vector<const CTransaction*>& vtx, MapPrevTx& mapPrefetchedRet);
+
 /** Check for standard transaction types
     @return True if all outputs (scriptPubKeys) use only standard transaction forms
 */
@@ -442,6 +629,43 @@ bool IsStandardTx(const CTransaction& tx, std::string& reason);
 
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight = 0, int64_t nBlockTime = 0);
 
+/** Closure representing one script verification
+ *  Note that this stores references to the spending transaction */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+    int nHashType;
+    boost::shared_ptr<const CSigHashCache> pSigHashCache;
+
+public:
+    CScriptCheck() : ptxTo(0), nIn(0), nFlags(0), nHashType(0) {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSigHashCache>& pSigHashCacheIn = boost::shared_ptr<const CSigHashCache>()) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), pSigHashCache(pSigHashCacheIn) { }
+
+    bool operator()() const;
+
+    // Report a failed check with the error and DoS score ConnectInputs() gives it
+    bool Invalid() const;
+
+    const CTransaction* GetTx() const { return ptxTo; }
+    unsigned int GetIn() const { return nIn; }
+
+    void swap(CScriptCheck &check) {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+        std::swap(nHashType, check.nHashType);
+        pSigHashCache.swap(check.pSigHashCache);
+    }
+};
+
 
 
 /** A transaction with a merkle branch linking it to the block chain. */
@@ -537,7 +761,7 @@ public:
         vSpent.clear();
     }
 
-    bool IsNull()
+    bool IsNull() const
     {
         return pos.IsNull();
     }
@@ -591,6 +815,17 @@ public:
     // memory only
     mutable std::vector<uint256> vMerkleTree;
 
+    // memory only: last scrypt hash and the 80 byte header it was computed
+    // from, so a changed header is detected without explicit invalidation.
+    // Blocks are shared between threads (block cache, import), so it is
+    // filled in through CCachedValue like the transaction hash.
+    struct CPoWHashMemo
+    {
+        unsigned char pchHeader[80];
+        uint256 hash;
+    };
+    mutable CCachedValue<CPoWHashMemo> cachedPoWHash;
+
     // Denial-of-service detection:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
@@ -652,7 +887,29 @@ public:
 
     uint256 GetPoWHash() const
     {
-        return scrypt_blockhash(CVOIDBEGIN(nVersion));
+        // Blocks up to version 6 are identified by this hash, don't redo the scrypt every time
+        CPoWHashMemo memo;
+        if (cachedPoWHash.Get(memo) && memcmp(memo.pchHeader, BEGIN(nVersion), sizeof(memo.pchHeader)) == 0)
+            return memo.hash;
+        uint256 hash = scrypt_blockhash(CVOIDBEGIN(nVersion));
+        SetCachedPoWHash(hash);
+        return hash;
+    }
+
+    /** Remember hash as the scrypt hash of the current header, e.g. when it is
+        already known from the block index. The cache is keyed on the header
+        contents, so it is never used for a different header. */
+    void SetCachedPoWHash(const uint256& hash) const
+    {
+        CPoWHashMemo memo;
+        memcpy(memo.pchHeader, BEGIN(nVersion), sizeof(memo.pchHeader));
+        memo.hash = hash;
+        // A memo of another header means the owner is changing the block,
+        // nobody else may be reading it then
+        CPoWHashMemo memoOld;
+        if (cachedPoWHash.Get(memoOld) && memcmp(memoOld.pchHeader, memo.pchHeader, sizeof(memo.pchHeader)) != 0)
+            cachedPoWHash.Clear();
+        cachedPoWHash.Set(memo);
     }
 
     int64_t GetBlockTime() const
@@ -749,26 +1006,13 @@ public:
 
     bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet)
     {
-        // Open history file to append
-        CAutoFile fileout = CAutoFile(AppendBlockFile(nFileRet), SER_DISK, CLIENT_VERSION);
-        if (!fileout)
-            return error("CBlock::WriteToDisk() : AppendBlockFile failed");
-
-        // Write index header
-        unsigned int nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(Params().MessageStart()) << nSize;
-
-        // Write block
-        long fileOutPos = ftell(fileout);
-        if (fileOutPos < 0)
-            return error("CBlock::WriteToDisk() : ftell failed");
-        nBlockPosRet = fileOutPos;
-        fileout << *this;
+        CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+        ssBlock << *this;
 
-        // Flush stdio buffers and commit to disk before returning
-        fflush(fileout);
-        if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
-            FileCommit(fileout);
+        // Append to the current history file, committed to disk in groups
+        // and before the block index refers to it durably
+        if (!AppendBlockToFile((const unsigned char*)Params().MessageStart(), &ssBlock[0], ssBlock.size(), nFileRet, nBlockPosRet))
+            return error("CBlock::WriteToDisk() : AppendBlockToFile failed");
 
         return true;
     }
@@ -778,8 +1022,8 @@ public:
         SetNull();
 
         // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
+        CBlockFileReader filein(SER_DISK, CLIENT_VERSION);
+        if (!filein.Open(nFile, nBlockPos))
             return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
         if (!fReadTransactions)
             filein.nType |= SER_BLOCKHEADERONLY;
@@ -836,6 +1080,7 @@ public:
 
 private:
     bool SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew);
+    bool ConnectBlockInner(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck, CScriptCheck* pcheckFailed);
 };
 
 
@@ -843,6 +1088,18 @@ private:
 
 
 
+/** Block index fields that are rarely used. They are kept out of
+ *  CBlockIndex, loaded from the block index database on demand and only
+ *  the recently used ones stay in memory. */
+struct CBlockIndexCold
+{
+    int64_t nMint;
+    int64_t nMoneySupply;
+    uint256 hashProof;
+
+    CBlockIndexCold() : nMint(0), nMoneySupply(0), hashProof(0) {}
+};
+
 /** The block chain is a tree shaped structure starting with the
  * genesis block at the root, with each block potentially having multiple
  * candidates to be the next block.  pprev and pnext link a path through the
@@ -853,23 +1110,25 @@ private:
 class CBlockIndex
 {
 public:
-    const uint256* phashBlock;
+    const uint256* phashBlock; // points to hashBlock once the block is indexed
+    uint256 hashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
+    CBlockIndex* pskip;      // an earlier ancestor, to find ancestors quickly
+    CBlockIndex* pprevStake; // the last proof-of-stake block before this one
+    CBlockIndex* pprevWork;  // the last proof-of-work block before this one
     unsigned int nFile;
     unsigned int nBlockPos;
     uint256 nChainTrust; // ppcoin: trust score of block chain
     int nHeight;
 
-    int64_t nMint;
-    int64_t nMoneySupply;
-
     unsigned int nFlags;  // ppcoin: block index flags
     enum  
     {
         BLOCK_PROOF_OF_STAKE = (1 << 0), // is proof-of-stake block
         BLOCK_STAKE_ENTROPY  = (1 << 1), // entropy bit for stake modifier
         BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
+        BLOCK_LOW_S_SIG      = (1 << 3), // stored with a canonical low-s signature, can be sent as is
     };
 
     uint64_t nStakeModifier; // hash modifier for proof-of-stake
@@ -879,8 +1138,6 @@ public:
     COutPoint prevoutStake;
     unsigned int nStakeTime;
 
-    uint256 hashProof;
-
     // block header
     int nVersion;
     uint256 hashMerkleRoot;
@@ -891,18 +1148,19 @@ public:
     CBlockIndex()
     {
         phashBlock = NULL;
+        hashBlock = 0;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
+        pprevStake = NULL;
+        pprevWork = NULL;
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
         nChainTrust = 0;
-        nMint = 0;
-        nMoneySupply = 0;
         nFlags = 0;
         nStakeModifier = 0;
         bnStakeModifierV2 = 0;
-        hashProof = 0;
         prevoutStake.SetNull();
         nStakeTime = 0;
 
@@ -916,18 +1174,19 @@ public:
     CBlockIndex(unsigned int nFileIn, unsigned int nBlockPosIn, CBlock& block)
     {
         phashBlock = NULL;
+        hashBlock = 0;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
+        pprevStake = NULL;
+        pprevWork = NULL;
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
         nChainTrust = 0;
-        nMint = 0;
-        nMoneySupply = 0;
         nFlags = 0;
         nStakeModifier = 0;
         bnStakeModifierV2 = 0;
-        hashProof = 0;
         if (block.IsProofOfStake())
         {
             SetProofOfStake();
@@ -947,6 +1206,15 @@ public:
         nNonce         = block.nNonce;
     }
 
+    /** The cold fields, read from the block index database when they are
+     *  not in the cold field cache */
+    CBlockIndexCold GetCold() const;
+    void SetCold(const CBlockIndexCold& cold);
+
+    int64_t GetMint() const        { return GetCold().nMint; }
+    int64_t GetMoneySupply() const { return GetCold().nMoneySupply; }
+    uint256 GetProofHash() const   { return GetCold().hashProof; }
+
     CBlock GetBlockHeader() const
     {
         CBlock block;
@@ -957,6 +1225,9 @@ public:
         block.nTime          = nTime;
         block.nBits          = nBits;
         block.nNonce         = nNonce;
+        // Legacy headers are identified by their scrypt hash, which we already know
+        if (nVersion <= 6 && phashBlock)
+            block.SetCachedPoWHash(*phashBlock);
         return block;
     }
 
@@ -972,10 +1243,15 @@ public:
 
     uint256 GetBlockTrust() const;
 
-    bool IsInMainChain() const
-    {
-        return (pnext || this == pindexBest);
-    }
+    /** Set pskip, pprevStake and pprevWork once pprev, and the links of the
+     *  blocks before it, are set */
+    void BuildSkip();
+
+    /** The ancestor of this block at nHeight, found through the skip pointers */
+    CBlockIndex* GetAncestor(int nHeight);
+    const CBlockIndex* GetAncestor(int nHeight) const;
+
+    bool IsInMainChain() const;
 
     bool CheckIndex() const
     {
@@ -1051,20 +1327,208 @@ public:
             nFlags |= BLOCK_STAKE_MODIFIER;
     }
 
+    bool IsStoredLowS() const
+    {
+        return (nFlags & BLOCK_LOW_S_SIG);
+    }
+
+    void SetStoredLowS()
+    {
+        nFlags |= BLOCK_LOW_S_SIG;
+    }
+
     std::string ToString() const
     {
+        CBlockIndexCold cold = GetCold();
         return strprintf("CBlockIndex(nprev=%p, pnext=%p, nFile=%u, nBlockPos=%-6d nHeight=%d, nMint=%s, nMoneySupply=%s, nFlags=(%s)(%d)(%s), nStakeModifier=%016x, hashProof=%s, prevoutStake=(%s), nStakeTime=%d merkle=%s, hashBlock=%s)",
             pprev, pnext, nFile, nBlockPos, nHeight,
-            FormatMoney(nMint), FormatMoney(nMoneySupply),
+            FormatMoney(cold.nMint), FormatMoney(cold.nMoneySupply),
             GeneratedStakeModifier() ? "MOD" : "-", GetStakeEntropyBit(), IsProofOfStake()? "PoS" : "PoW",
             nStakeModifier,
-            hashProof.ToString(),
+            cold.hashProof.ToString(),
             prevoutStake.ToString(), nStakeTime,
             hashMerkleRoot.ToString(),
             GetBlockHash().ToString());
     }
 };
 
+/** The blocks of a chain indexed by height, kept in step with the pnext
+ *  links of the main chain so lookups by height don't walk the index.
+ *  SetTip() can move the storage, so every access needs cs_main held. */
+class CChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    /** The genesis block, or NULL if the chain is empty */
+    CBlockIndex* Genesis() const
+    {
+        AssertLockHeld(cs_main);
+        return vChain.size() > 0 ? vChain[0] : NULL;
+    }
+
+    /** The last block, or NULL if the chain is empty */
+    CBlockIndex* Tip() const
+    {
+        AssertLockHeld(cs_main);
+        return vChain.size() > 0 ? vChain[vChain.size() - 1] : NULL;
+    }
+
+    /** The block at nHeight, or NULL if the chain isn't that long */
+    CBlockIndex* operator[](int nHeight) const
+    {
+        AssertLockHeld(cs_main);
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    bool Contains(const CBlockIndex* pindex) const
+    {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    /** The block after pindex in this chain, or NULL if it is the tip or not in it */
+    CBlockIndex* Next(const CBlockIndex* pindex) const
+    {
+        return Contains(pindex) ? (*this)[pindex->nHeight + 1] : NULL;
+    }
+
+    /** Height of the tip, -1 if the chain is empty */
+    int Height() const
+    {
+        AssertLockHeld(cs_main);
+        return (int)vChain.size() - 1;
+    }
+
+    /** Make pindex the tip, replacing the blocks from where its branch forks off */
+    void SetTip(CBlockIndex* pindex);
+
+    /** The last block of the branch leading to pindex that is also in this chain */
+    CBlockIndex* FindFork(CBlockIndex* pindex) const;
+};
+
+inline bool CBlockIndex::IsInMainChain() const
+{
+    return chainActive.Contains(this);
+}
+
+/** Hash table of the block index by block hash.
+ *
+ *  Open addressing with linear probing over a power of two number of slots,
+ *  each holding a salted 64 bit digest of the hash and the entry, so a lookup
+ *  usually touches one slot and the entry itself. The hash is stored in the
+ *  entry, whose phashBlock must point to it before it is inserted. Entries
+ *  are never removed.
+ *
+ *  Mostly a drop-in for the std::map it replaces: iterators yield
+ *  (hash, entry) pairs, but by value, and operator[] doesn't insert.
+ */
+class CBlockIndexMap
+{
+protected:
+    // Protected rather than private so the unit tests can line up digests
+    struct Slot
+    {
+        uint64_t nDigest;
+        CBlockIndex* pindex;
+    };
+
+    std::vector<Slot> vSlots;
+    size_t nSize;
+    uint64_t nSalt;
+
+    uint64_t Digest(const uint256& hash) const;
+    size_t FindSlot(const uint256& hash, uint64_t nDigest) const;
+    void Resize(size_t nSlots);
+
+public:
+    typedef std::pair<uint256, CBlockIndex*> value_type;
+
+    class const_iterator
+    {
+    private:
+        const CBlockIndexMap* pmap;
+        size_t nSlot;
+
+        void SkipEmpty()
+        {
+            while (nSlot < pmap->vSlots.size() && pmap->vSlots[nSlot].pindex == NULL)
+                nSlot++;
+        }
+
+    public:
+        struct pointer
+        {
+            value_type value;
+            const value_type* operator->() const { return &value; }
+        };
+
+        const_iterator() : pmap(NULL), nSlot(0) {}
+        const_iterator(const CBlockIndexMap* pmapIn, size_t nSlotIn) : pmap(pmapIn), nSlot(nSlotIn) { SkipEmpty(); }
+
+        value_type operator*() const
+        {
+            CBlockIndex* pindex = pmap->vSlots[nSlot].pindex;
+            return value_type(*pindex->phashBlock, pindex);
+        }
+        pointer operator->() const
+        {
+            pointer p = { **this };
+            return p;
+        }
+        const_iterator& operator++()
+        {
+            nSlot++;
+            SkipEmpty();
+            return *this;
+        }
+        const_iterator operator++(int)
+        {
+            const_iterator it = *this;
+            ++*this;
+            return it;
+        }
+        bool operator==(const const_iterator& it) const { return nSlot == it.nSlot; }
+        bool operator!=(const const_iterator& it) const { return nSlot != it.nSlot; }
+    };
+    typedef const_iterator iterator;
+
+    CBlockIndexMap() : nSize(0), nSalt(0) {}
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const   { return const_iterator(this, vSlots.size()); }
+    size_t size() const          { return nSize; }
+    bool empty() const           { return nSize == 0; }
+
+    const_iterator find(const uint256& hash) const;
+    size_t count(const uint256& hash) const { return find(hash) != end(); }
+
+    /** The entry of hash, or NULL if there is none */
+    CBlockIndex* operator[](const uint256& hash) const
+    {
+        const_iterator it = find(hash);
+        return it != end() ? it->second : NULL;
+    }
+
+    /** Insert item, whose entry's phashBlock must point to item.first. If
+     *  the hash is already there, returns the existing entry and false. */
+    std::pair<const_iterator, bool> insert(const value_type& item);
+
+    /** Make room for nCount entries without growing again */
+    void reserve(size_t nCount);
+
+    /** Forget all entries, without freeing them */
+    void clear()
+    {
+        std::vector<Slot>().swap(vSlots);
+        nSize = 0;
+    }
+
+    /** Bytes used by the table itself */
+    size_t MemoryUsage() const { return vSlots.capacity() * sizeof(Slot); }
+};
 
 
 /** Used to marshal pointers into hashes for db storage. */
@@ -1077,17 +1541,40 @@ public:
     uint256 hashPrev;
     uint256 hashNext;
 
+    // Cold fields, see CBlockIndexCold
+    int64_t nMint;
+    int64_t nMoneySupply;
+    uint256 hashProof;
+
     CDiskBlockIndex()
     {
         hashPrev = 0;
         hashNext = 0;
         blockHash = 0;
+        nMint = 0;
+        nMoneySupply = 0;
+        hashProof = 0;
     }
 
     explicit CDiskBlockIndex(CBlockIndex* pindex) : CBlockIndex(*pindex)
     {
         hashPrev = (pprev ? pprev->GetBlockHash() : 0);
         hashNext = (pnext ? pnext->GetBlockHash() : 0);
+        blockHash = pindex->GetBlockHash();
+
+        CBlockIndexCold cold = pindex->GetCold();
+        nMint = cold.nMint;
+        nMoneySupply = cold.nMoneySupply;
+        hashProof = cold.hashProof;
+    }
+
+    CBlockIndexCold GetCold() const
+    {
+        CBlockIndexCold cold;
+        cold.nMint = nMint;
+        cold.nMoneySupply = nMoneySupply;
+        cold.hashProof = hashProof;
+        return cold;
     }
 
     IMPLEMENT_SERIALIZE
@@ -1184,7 +1671,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1235,7 +1722,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1254,7 +1741,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1270,7 +1757,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -33,6 +33,11 @@ static int nRewardPercents[POW_MINER_SIZE] = {50, 50};
 static CCriticalSection cs_bNtpFirst;
 static bool bNtpFirst = true;
 
+// Stake miner wake-up on a new tip or a wallet change
+static boost::mutex csStakeMinerEvent;
+static boost::condition_variable cvStakeMinerEvent;
+static unsigned int nStakeMinerEvents = 0;
+
 int static FormatHashBlocks(void* pbuffer, unsigned int len)
 {
     unsigned char* pdata = (unsigned char*)pbuffer;
@@ -182,6 +187,17 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
         // This vector will be sorted into a priority queue:
         vector<TxPriority> vecPriority;
         vecPriority.reserve(mempool.mapTx.size());
+
+        // Read the inputs of all candidates in disk order up front
+        MapPrevTx mapPrefetched;
+        {
+            vector<const CTransaction*> vpTx;
+            for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+                if (!mi->second.IsCoinBase() && !mi->second.IsCoinStake())
+                    vpTx.push_back(&mi->second);
+            PrefetchInputs(txdb, vpTx, mapPrefetched);
+        }
+
         for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
         {
             CTransaction& tx = (*mi).second;
@@ -196,7 +212,10 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
                 // Read prev transaction
                 CTransaction txPrev;
                 CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+                MapPrevTx::const_iterator mp = mapPrefetched.find(txin.prevout.hash);
+                if (mp != mapPrefetched.end() && txin.prevout.n < mp->second.second.vout.size())
+                    txPrev = mp->second.second;
+                else if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
                 {
                     // This should never happen; all transactions in the memory
                     // pool should connect to either transactions in the chain
@@ -285,7 +304,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
             map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
             MapPrevTx mapInputs;
             bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid, &mapPrefetched))
                 continue;
 
             int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
@@ -350,6 +369,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
             }
             else
                 pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(nFees);
+            pblock->vtx[0].InvalidateCache();
         }
 
         if (pFees)
@@ -381,6 +401,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
     pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+    pblock->vtx[0].InvalidateCache();
 
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
@@ -481,8 +502,11 @@ bool CheckStake(CBlock* pblock, CWallet& wallet)
         return error("CheckStake() : %s is not a proof-of-stake block", hashBlock.GetHex());
 
     // verify hash target and signature of coinstake tx
-    if (!CheckProofOfStake(mapBlockIndex[pblock->hashPrevBlock], pblock->vtx[1], pblock->nBits, proofHash, hashTarget))
-        return error("CheckStake() : proof-of-stake checking failed");
+    {
+        LOCK(cs_main);
+        if (!CheckProofOfStake(mapBlockIndex[pblock->hashPrevBlock], pblock->vtx[1], pblock->nBits, proofHash, hashTarget))
+            return error("CheckStake() : proof-of-stake checking failed");
+    }
 
     //// debug print
     LogPrintf("CheckStake() : new proof-of-stake block found  \n  hash: %s \nproofhash: %s  \ntarget: %s\n", hashBlock.GetHex(), proofHash.GetHex(), hashTarget.GetHex());
@@ -579,6 +603,39 @@ void ThreadPoWMiner(CWallet* pwallet)
     }
 }
 
+static void NotifyStakeMiner()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csStakeMinerEvent);
+        nStakeMinerEvents++;
+    }
+    cvStakeMinerEvent.notify_all();
+}
+
+static void NotifyStakeMinerBlockTip(const uint256& hashBestChain)
+{
+    NotifyStakeMiner();
+}
+
+static void NotifyStakeMinerTransactionChanged(CWallet* wallet, const uint256& hashTx, ChangeType status)
+{
+    NotifyStakeMiner();
+}
+
+// Sleep until nTime (adjusted time) or until a new tip or wallet change
+// arrives, whichever comes first
+static void WaitForStakeMinerEvent(unsigned int nEventsSeen, int64_t nTime)
+{
+    boost::unique_lock<boost::mutex> lock(csStakeMinerEvent);
+    while (nStakeMinerEvents == nEventsSeen)
+    {
+        int64_t nWait = nTime - GetAdjustedTime();
+        if (nWait <= 0)
+            break;
+        cvStakeMinerEvent.timed_wait(lock, boost::posix_time::seconds(nWait));
+    }
+}
+
 void ThreadStakeMiner(CWallet *pwallet)
 {
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
@@ -590,6 +647,16 @@ void ThreadStakeMiner(CWallet *pwallet)
 
     bool fTryToSync = true;
 
+    // Kernels only depend on the tip, the wallet's coins and the masked
+    // timestamp, so a search is only repeated when one of them changed.
+    // The connections go away with the thread, however it exits.
+    boost::signals2::scoped_connection connBlockTip(uiInterface.NotifyBlockTip.connect(&NotifyStakeMinerBlockTip));
+    boost::signals2::scoped_connection connTransactionChanged(pwallet->NotifyTransactionChanged.connect(&NotifyStakeMinerTransactionChanged));
+    unsigned int nEventsSeen = 0;
+    unsigned int nEventsSearched = 0;
+    int64_t nLastSearchTime = GetAdjustedTime(); // startup timestamp
+    bool fSearched = false;
+
     while (true)
     {
         while (pwallet->IsLocked())
@@ -630,6 +697,36 @@ void ThreadStakeMiner(CWallet *pwallet)
             }
         }
 
+        {
+            boost::unique_lock<boost::mutex> lock(csStakeMinerEvent);
+            nEventsSeen = nStakeMinerEvents;
+        }
+
+        int64_t nSearchTime = GetAdjustedTime() & ~STAKE_TIMESTAMP_MASK;
+        if (nSearchTime <= nLastSearchTime && (!fSearched || nEventsSeen == nEventsSearched))
+        {
+            // Nothing changed since the last search, wait for the next timestamp slot
+            WaitForStakeMinerEvent(nEventsSeen, nSearchTime + STAKE_TIMESTAMP_MASK + 1);
+            continue;
+        }
+
+        //
+        // Search for a kernel first, only then assemble a block
+        //
+        if (nSearchTime > nLastSearchTime)
+        {
+            nLastCoinStakeSearchInterval = nSearchTime - nLastSearchTime;
+            nLastSearchTime = nSearchTime;
+        }
+        nEventsSearched = nEventsSeen;
+        fSearched = true;
+
+        if (!pwallet->HasStakeKernel(GetNextTargetRequired(pindexBest, true), nSearchTime))
+        {
+            MilliSleep(nMinerSleep);
+            continue;
+        }
+
         //
         // Create new block
         //
@@ -644,10 +741,7 @@ void ThreadStakeMiner(CWallet *pwallet)
             SetThreadPriority(THREAD_PRIORITY_NORMAL);
             CheckStake(pblock.get(), *pwallet);
             SetThreadPriority(THREAD_PRIORITY_LOWEST);
-            MilliSleep(500);
         }
-        else
-            MilliSleep(nMinerSleep);
     }
 }
 
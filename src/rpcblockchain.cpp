@@ -46,17 +46,32 @@ double GetDifficulty(const CBlockIndex* blockindex)
 
 double GetPoWMHashPS()
 {
+    LOCK(cs_main);
+
     if (pindexBest->nHeight >= Params().LastPOWBlock())
         return 0;
 
     int nPoWInterval = 72;
-    int64_t nTargetSpacingWorkMin = 30, nTargetSpacingWork = 30;
-
-    CBlockIndex* pindex = pindexGenesisBlock;
-    CBlockIndex* pindexPrevWork = pindexGenesisBlock;
+    int64_t nTargetSpacingWorkMin = 30;
+
+    // The average spacing only depends on the chain up to a block, so carry
+    // on from where the last call left off while that block is still in the
+    // main chain
+    static const CBlockIndex* pindexLast = NULL;
+    static const CBlockIndex* pindexPrevWork = NULL;
+    static int64_t nTargetSpacingWork = 30;
+    int nHeight = 0;
+    if (pindexLast && chainActive.Contains(pindexLast) && chainActive.Contains(pindexPrevWork))
+        nHeight = pindexLast->nHeight + 1;
+    else
+    {
+        pindexPrevWork = chainActive.Genesis();
+        nTargetSpacingWork = 30;
+    }
 
-    while (pindex)
+    for (; nHeight <= chainActive.Height(); nHeight++)
     {
+        const CBlockIndex* pindex = chainActive[nHeight];
         if (pindex->IsProofOfWork())
         {
             int64_t nActualSpacingWork = pindex->GetBlockTime() - pindexPrevWork->GetBlockTime();
@@ -64,9 +79,8 @@ double GetPoWMHashPS()
             nTargetSpacingWork = max(nTargetSpacingWork, nTargetSpacingWorkMin);
             pindexPrevWork = pindex;
         }
-
-        pindex = pindex->pnext;
     }
+    pindexLast = chainActive.Tip();
 
     return GetDifficulty() * 4294.967296 / nTargetSpacingWork;
 }
@@ -119,7 +133,7 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPri
     result.push_back(Pair("height", blockindex->nHeight));
     result.push_back(Pair("version", block.nVersion));
     result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    result.push_back(Pair("mint", ValueFromAmount(blockindex->nMint)));
+    result.push_back(Pair("mint", ValueFromAmount(blockindex->GetMint())));
     result.push_back(Pair("time", (int64_t)block.GetBlockTime()));
     result.push_back(Pair("nonce", (uint64_t)block.nNonce));
     result.push_back(Pair("bits", strprintf("%08x", block.nBits)));
@@ -132,7 +146,7 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPri
         result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
 
     result.push_back(Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": "")));
-    result.push_back(Pair("proofhash", blockindex->hashProof.GetHex()));
+    result.push_back(Pair("proofhash", blockindex->GetProofHash().GetHex()));
     result.push_back(Pair("entropybit", (int)blockindex->GetStakeEntropyBit()));
     result.push_back(Pair("modifier", strprintf("%016x", blockindex->nStakeModifier)));
     result.push_back(Pair("modifierv2", blockindex->bnStakeModifierV2.GetHex()));
@@ -255,10 +269,11 @@ Value getblock(const Array& params, bool fHelp)
     if (mapBlockIndex.count(hash) == 0)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
-    if(!block.ReadFromDisk(pblockindex, true))
+    boost::shared_ptr<const CBlock> pblock = ReadBlockCached(pblockindex);
+    if (!pblock)
         throw JSONRPCError(RPC_MISC_ERROR, "Can't read block from disk");
+    const CBlock& block = *pblock;
 
     if (verbosity <= 0)
     {
@@ -293,17 +308,39 @@ Value getblockbynumber(const Array& params, bool fHelp)
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
 
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    boost::shared_ptr<const CBlock> pblock = ReadBlockCached(pblockindex);
+    if (!pblock)
+        throw JSONRPCError(RPC_MISC_ERROR, "Can't read block from disk");
+
+    return blockToJSON(*pblock, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
+}
+
+Value exportbootstrap(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "exportbootstrap <path> [start] [end]\n"
+            "Write the main chain blocks from height start (default: 0) to end (default: the best block)\n"
+            "to a bootstrap.dat file at path, and a checksum for each chunk of it to <path>.manifest.");
 
-    uint256 hash = *pblockindex->phashBlock;
+    boost::filesystem::path path = params[0].get_str();
+    int nStartHeight = params.size() > 1 ? params[1].get_int() : 0;
+    int nEndHeight = params.size() > 2 ? params[2].get_int() : -1;
+    if (nStartHeight < 0 || (nEndHeight >= 0 && nEndHeight < nStartHeight))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Block number out of range.");
 
-    pblockindex = mapBlockIndex[hash];
-    block.ReadFromDisk(pblockindex, true);
+    int nBlocks = 0;
+    uint64_t nBytes = 0;
+    if (!ExportBootstrap(path, nStartHeight, nEndHeight, nBlocks, nBytes))
+        throw JSONRPCError(RPC_MISC_ERROR, "Export failed, see debug.log for details");
 
-    return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
+    Object result;
+    result.push_back(Pair("path", path.string()));
+    result.push_back(Pair("manifest", path.string() + ".manifest"));
+    result.push_back(Pair("blocks", nBlocks));
+    result.push_back(Pair("bytes", (int64_t)nBytes));
+    return result;
 }
 
 // ppcoin: get information of sync-checkpoint
@@ -339,6 +376,18 @@ Value getblockchaininfo(const Array& params, bool fHelp)
             "  \"headers\": xxxxxx,        (numeric) the current number of headers we have validated\n"
             "  \"bestblockhash\": \"...\", (string) the hash of the currently best block\n"
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
+            "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
+            "  \"startupverification\": {    (object) the check of the last -checkblocks blocks after startup\n"
+            "    \"running\": true|false,    (boolean) whether it is still going on\n"
+            "    \"level\": n,               (numeric) the -checklevel it runs at\n"
+            "    \"startheight\": n,         (numeric) the lowest block being checked\n"
+            "    \"endheight\": n,           (numeric) the best block when it started\n"
+            "    \"checked\": n,             (numeric) blocks checked so far\n"
+            "    \"total\": n,               (numeric) blocks to check\n"
+            "    \"progress\": x.xxx,        (numeric) checked / total\n"
+            "    \"badheight\": n,           (numeric, optional) the lowest block that failed a check\n"
+            "    \"forkheight\": n           (numeric, optional) the block the best chain was moved back to\n"
+            "  }\n"
             "}\n"
         );
 
@@ -359,6 +408,24 @@ Value getblockchaininfo(const Array& params, bool fHelp)
     obj.push_back(Pair("difficulty",            diff));
     obj.push_back(Pair("verificationprogress",  Checkpoints::GetVerificationProcess()));
 
+    CChainVerifyStatus status = GetChainVerifyStatus();
+    if (status.fRunning || status.fDone)
+    {
+        Object verify;
+        verify.push_back(Pair("running",        status.fRunning));
+        verify.push_back(Pair("level",          status.nCheckLevel));
+        verify.push_back(Pair("startheight",    status.nStartHeight));
+        verify.push_back(Pair("endheight",      status.nEndHeight));
+        verify.push_back(Pair("checked",        (int)status.nChecked));
+        verify.push_back(Pair("total",          (int)status.nTotal));
+        verify.push_back(Pair("progress",       status.nTotal ? (double)status.nChecked / status.nTotal : 1.0));
+        if (status.nBadHeight != -1)
+            verify.push_back(Pair("badheight",  status.nBadHeight));
+        if (status.nForkHeight != -1)
+            verify.push_back(Pair("forkheight", status.nForkHeight));
+        obj.push_back(Pair("startupverification", verify));
+    }
+
     return obj;
 }
 
@@ -391,22 +458,25 @@ Value getblockhashes(const Array& params, bool fHelp)
     if(high < 0 || low < 0 || low > high)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter");
 
-    int nMaxHeight = nBestHeight;
-    CBlockIndex* pBlockIndex = mapBlockIndex[hashBestChain];
-    while(pBlockIndex->nHeight > nMaxHeight)
-        pBlockIndex = pBlockIndex->pprev;
-
-    Array resultInfo;
-    for(int i = nMaxHeight; i >= 0; i--)
+    // Find the blocks with cs_main held, but read them without it. Block
+    // index entries are never freed.
+    vector<CBlockIndex*> vBlocks;
     {
-        if(pBlockIndex->nTime < low)
-            break;
-        if(pBlockIndex->nTime > high)
+        LOCK(cs_main);
+        for(int i = chainActive.Height(); i >= 0; i--)
         {
-            pBlockIndex = pBlockIndex->pprev;
-            continue;
+            CBlockIndex* pBlockIndex = chainActive[i];
+            if(pBlockIndex->nTime < low)
+                break;
+            if(pBlockIndex->nTime > high)
+                continue;
+            vBlocks.push_back(pBlockIndex);
         }
-        
+    }
+
+    Array resultInfo;
+    BOOST_FOREACH(CBlockIndex* pBlockIndex, vBlocks)
+    {
         CBlock block;
         if(!block.ReadFromDisk(pBlockIndex, true))
             throw JSONRPCError(RPC_MISC_ERROR, "Can't read block from disk");
@@ -418,8 +488,6 @@ Value getblockhashes(const Array& params, bool fHelp)
         entry.push_back(Pair("txLength", (int)block.vtx.size()));
         entry.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
         resultInfo.push_back(entry);
-
-        pBlockIndex = pBlockIndex->pprev;
     }
     
     Object result;
@@ -490,21 +558,15 @@ Value getallblockhash(const Array& params, bool fHelp)
 
     int nStart = params[0].get_int();
     int nEnd = params[1].get_int();
-    if(nStart < 0 || nEnd > nBestHeight)
-        throw runtime_error("Block number out of range.");
-    
-    CBlockIndex* pBlockIndex = mapBlockIndex[hashBestChain];
-    while(pBlockIndex->nHeight > nEnd)
-        pBlockIndex = pBlockIndex->pprev;
 
     vector<uint256> vHash;
-    for(int i = nEnd; i >= nStart; i--)
     {
-        CBlock block;
-        if(!block.ReadFromDisk(pBlockIndex, true))
-            throw JSONRPCError(RPC_MISC_ERROR, "Can't read block from disk");
-        vHash.push_back(block.GetHash());
-        pBlockIndex = pBlockIndex->pprev;
+        LOCK(cs_main);
+        if(nStart < 0 || nEnd > chainActive.Height())
+            throw runtime_error("Block number out of range.");
+
+        for(int i = nEnd; i >= nStart; i--)
+            vHash.push_back(chainActive[i]->GetBlockHash());
     }
 
     Array resultInfo;
@@ -123,6 +123,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "getblockhash", 0 },
     { "getblockhashes", 0 },
     { "getblockhashes", 1 },
+    { "exportbootstrap", 1 },
+    { "exportbootstrap", 2 },
     { "getallblockhash", 0},
     { "getallblockhash", 1},
     { "move", 2 },
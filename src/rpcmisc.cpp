@@ -51,7 +51,7 @@ Value getinfo(const Array& params, bool fHelp)
 #endif
     obj.push_back(Pair("blocks",        (int)nBestHeight));
     obj.push_back(Pair("timeoffset",    (int64_t)GetTimeOffset()));
-    obj.push_back(Pair("moneysupply",   ValueFromAmount(pindexBest->nMoneySupply)));
+    obj.push_back(Pair("moneysupply",   ValueFromAmount(pindexBest->GetMoneySupply())));
     obj.push_back(Pair("connections",   (int)vNodes.size()));
     obj.push_back(Pair("proxy",         (proxy.IsValid() ? proxy.ToStringIPPort() : string())));
     obj.push_back(Pair("ip",            GetLocalAddress(NULL).ToStringIP()));
@@ -75,6 +75,25 @@ Value getinfo(const Array& params, bool fHelp)
     return obj;
 }
 
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns an object containing signature cache usage.");
+
+    uint64_t nSize, nEntries, nHits, nMisses;
+    GetSignatureCacheStats(nSize, nEntries, nHits, nMisses);
+
+    Object obj;
+    obj.push_back(Pair("bytes",         nSize));
+    obj.push_back(Pair("slots",         nSize / 32));
+    obj.push_back(Pair("entries",       nEntries));
+    obj.push_back(Pair("hits",          nHits));
+    obj.push_back(Pair("misses",        nMisses));
+    return obj;
+}
+
 #ifdef ENABLE_WALLET
 class DescribeAddressVisitor : public boost::static_visitor<Object>
 {
@@ -3,9 +3,8 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <boost/atomic.hpp>
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 using namespace std;
 using namespace boost;
@@ -18,7 +17,7 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSigHashCache* pcache);
 
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
@@ -396,7 +395,7 @@ static bool CheckLockTime(const CTransaction& txTo, unsigned int nIn, const CBig
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSigHashCache* pcache)
 {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
@@ -1135,7 +1134,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         return false;
 
                     bool fSuccess = CheckSignatureEncoding(vchSig, flags) && CheckPubKeyEncoding(vchPubKey) &&
-                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pcache);
 
                     popstack(stack);
                     popstack(stack);
@@ -1199,7 +1198,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                         // Check signature
                         bool fOk = CheckSignatureEncoding(vchSig, flags) && CheckPubKeyEncoding(vchPubKey) &&
-                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pcache);
 
                         if (fOk)
                         {
@@ -1272,62 +1271,140 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
 
 
-uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+/** Serializes the view of a transaction that SignatureHash() commits to:
+ *  other inputs' scriptSigs blanked and the outputs and sequence numbers
+ *  the hash type leaves out removed or nulled. It writes straight to the
+ *  hasher instead of building a modified copy of the transaction.
+ */
+class CTransactionSignatureSerializer
 {
-    if (nIn >= txTo.vin.size())
+private:
+    const CTransaction& txTo;
+    const CScript& scriptCode;
+    const unsigned int nIn;
+    const bool fAnyoneCanPay;
+    const bool fHashSingle;
+    const bool fHashNone;
+
+public:
+    CTransactionSignatureSerializer(const CTransaction& txToIn, const CScript& scriptCodeIn, unsigned int nInIn, int nHashTypeIn) :
+        txTo(txToIn), scriptCode(scriptCodeIn), nIn(nInIn),
+        fAnyoneCanPay(!!(nHashTypeIn & SIGHASH_ANYONECANPAY)),
+        fHashSingle((nHashTypeIn & 0x1f) == SIGHASH_SINGLE),
+        fHashNone((nHashTypeIn & 0x1f) == SIGHASH_NONE) {}
+
+    template<typename S>
+    void SerializeInput(S& s, unsigned int nInput, int nType, int nVersion) const
     {
-        LogPrintf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
-        return 1;
+        // With SIGHASH_ANYONECANPAY only the input being signed is serialized
+        if (fAnyoneCanPay)
+            nInput = nIn;
+        ::Serialize(s, txTo.vin[nInput].prevout, nType, nVersion);
+        // Blank out other inputs' signatures
+        if (nInput != nIn)
+            ::Serialize(s, CScript(), nType, nVersion);
+        else
+            ::Serialize(s, scriptCode, nType, nVersion);
+        // Let the others update at will
+        if (nInput != nIn && (fHashSingle || fHashNone))
+            ::Serialize(s, (unsigned int)0, nType, nVersion);
+        else
+            ::Serialize(s, txTo.vin[nInput].nSequence, nType, nVersion);
     }
-    CTransaction txTmp(txTo);
 
-    // In case concatenating two scripts ends up with two codeseparators,
-    // or an extra one at the end, this prevents all those possible incompatibilities.
-    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+    template<typename S>
+    void SerializeOutput(S& s, unsigned int nOutput, int nType, int nVersion) const
+    {
+        // With SIGHASH_SINGLE only the output at the same index is locked in
+        if (fHashSingle && nOutput != nIn)
+            ::Serialize(s, CTxOut(), nType, nVersion);
+        else
+            ::Serialize(s, txTo.vout[nOutput], nType, nVersion);
+    }
+
+    template<typename S>
+    void Serialize(S& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, txTo.nVersion, nType, nVersion);
+        ::Serialize(s, txTo.nTime, nType, nVersion);
+        unsigned int nInputs = fAnyoneCanPay ? 1 : txTo.vin.size();
+        WriteCompactSize(s, nInputs);
+        for (unsigned int nInput = 0; nInput < nInputs; nInput++)
+            SerializeInput(s, nInput, nType, nVersion);
+        // SIGHASH_NONE is a wildcard payee
+        unsigned int nOutputs = fHashNone ? 0 : (fHashSingle ? nIn + 1 : txTo.vout.size());
+        WriteCompactSize(s, nOutputs);
+        for (unsigned int nOutput = 0; nOutput < nOutputs; nOutput++)
+            SerializeOutput(s, nOutput, nType, nVersion);
+        ::Serialize(s, txTo.nLockTime, nType, nVersion);
+    }
+};
+
+CSigHashCache::CSigHashCache(const CTransaction& txTo)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTo.nVersion << txTo.nTime;
+    WriteCompactSize(ss, txTo.vin.size());
 
-    // Blank out other inputs' signatures
-    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-        txTmp.vin[i].scriptSig = CScript();
-    txTmp.vin[nIn].scriptSig = scriptCode;
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &ss[0], ss.size());
 
-    // Blank out some of the outputs
-    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    vPrefix.resize(txTo.vin.size());
+    vchInputs.reserve(txTo.vin.size() * BLANK_INPUT_SIZE);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
     {
-        // Wildcard payee
-        txTmp.vout.clear();
+        vPrefix[i] = ctx;
+        ss.clear();
+        ss << txTo.vin[i].prevout << CScript() << txTo.vin[i].nSequence;
+        assert(ss.size() == BLANK_INPUT_SIZE);
+        SHA256_Update(&ctx, &ss[0], ss.size());
+        vchInputs.insert(vchInputs.end(), ss.begin(), ss.end());
+    }
 
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+    ss.clear();
+    ss << txTo.vout << txTo.nLockTime;
+    vchOutputs.assign(ss.begin(), ss.end());
+}
+
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSigHashCache* pcache)
+{
+    if (nIn >= txTo.vin.size())
+    {
+        LogPrintf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
+        return 1;
     }
-    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+
+    // Check for invalid use of SIGHASH_SINGLE
+    if ((nHashType & 0x1f) == SIGHASH_SINGLE)
     {
-        // Only lock-in the txout payee at same index as txin
-        unsigned int nOut = nIn;
-        if (nOut >= txTmp.vout.size())
+        if (nIn >= txTo.vout.size())
         {
-            LogPrintf("ERROR: SignatureHash() : nOut=%d out of range\n", nOut);
+            LogPrintf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
             return 1;
         }
-        txTmp.vout.resize(nOut+1);
-        for (unsigned int i = 0; i < nOut; i++)
-            txTmp.vout[i].SetNull();
-
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
     }
 
-    // Blank out other inputs completely, not recommended for open transactions
-    if (nHashType & SIGHASH_ANYONECANPAY)
+    // In case concatenating two scripts ends up with two codeseparators,
+    // or an extra one at the end, this prevents all those possible incompatibilities.
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    // Plain SIGHASH_ALL: only this input differs from what the cache holds
+    if (pcache && (nHashType & 0x1f) != SIGHASH_NONE && (nHashType & 0x1f) != SIGHASH_SINGLE && !(nHashType & SIGHASH_ANYONECANPAY))
     {
-        txTmp.vin[0] = txTmp.vin[nIn];
-        txTmp.vin.resize(1);
+        assert(pcache->vPrefix.size() == txTo.vin.size());
+        CHashWriter ss(SER_GETHASH, 0, pcache->vPrefix[nIn]);
+        ss << txTo.vin[nIn].prevout << scriptCode << txTo.vin[nIn].nSequence;
+        unsigned int nAfter = (nIn + 1) * CSigHashCache::BLANK_INPUT_SIZE;
+        if (nAfter < pcache->vchInputs.size())
+            ss.write((const char*)&pcache->vchInputs[nAfter], pcache->vchInputs.size() - nAfter);
+        ss.write((const char*)&pcache->vchOutputs[0], pcache->vchOutputs.size());
+        ss << nHashType;
+        return ss.GetHash();
     }
 
     // Serialize and hash
+    CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
     CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
     return ss.GetHash();
@@ -1338,62 +1415,166 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
 
+//
+// Entries are a salted SHA256 of (signature hash, signature, public key) kept
+// in a fixed-size table of small buckets. Slots are made of atomic words, so
+// neither lookups nor inserts ever take a lock. The random salt keeps attackers
+// from aiming signatures at a given bucket. A reader racing with a writer can
+// see a half written slot, which only ever makes it miss.
+//
+// The table is allocated zeroed and never written up front, so the operating
+// system only backs the pages that entries have actually landed in.
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    static const unsigned int BUCKET_SIZE = 4;
+
+    struct CSlot
+    {
+        boost::atomic<uint64_t> nWords[4];
+    };
+
+    SHA256_CTX ctxSalted;
+    CSlot* pslots;
+    size_t nBuckets;
+    boost::atomic<uint64_t> nHits;
+    boost::atomic<uint64_t> nMisses;
+
+    // Size of the table in bytes. -sigcachesize is in megabytes; the older
+    // -maxsigcachesize counted entries and is converted, as configs still
+    // carry values like 50000 meant that way.
+    static int64_t GetMaxCacheSize()
+    {
+        if (mapArgs.count("-sigcachesize") || !mapArgs.count("-maxsigcachesize"))
+            return std::min(GetArg("-sigcachesize", DEFAULT_SIG_CACHE_SIZE), (int64_t)MAX_SIG_CACHE_SIZE) << 20;
+        int64_t nEntries = GetArg("-maxsigcachesize", 0);
+        LogPrintf("-maxsigcachesize counts entries and is deprecated, use -sigcachesize in megabytes\n");
+        return std::min(nEntries, ((int64_t)MAX_SIG_CACHE_SIZE << 20) / (int64_t)sizeof(CSlot)) * sizeof(CSlot);
+    }
+
+    void GetEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey, uint64_t* pnEntry) const
+    {
+        SHA256_CTX ctx = ctxSalted;
+        SHA256_Update(&ctx, (const unsigned char*)&hash, sizeof(hash));
+        SHA256_Update(&ctx, vchSig.empty() ? NULL : &vchSig[0], vchSig.size());
+        SHA256_Update(&ctx, pubKey.begin(), pubKey.size());
+        SHA256_Final((unsigned char*)pnEntry, &ctx);
+    }
+
+    bool Match(const CSlot& slot, const uint64_t* pnEntry) const
+    {
+        for (unsigned int i = 0; i < 4; i++)
+            if (slot.nWords[i].load(boost::memory_order_relaxed) != pnEntry[i])
+                return false;
+        return true;
+    }
 
 public:
+    CSignatureCache() : pslots(NULL), nBuckets(0), nHits(0), nMisses(0)
+    {
+        uint256 salt = GetRandHash();
+        SHA256_Init(&ctxSalted);
+        SHA256_Update(&ctxSalted, salt.begin(), salt.size());
+
+        // DoS prevention: the table never grows beyond -sigcachesize
+        // megabytes. At 32 bytes per entry the default holds ~260,000
+        // signatures, plenty for the 20,000 signature operations of a block
+        // and a busy memory pool.
+        int64_t nMaxCacheSize = GetMaxCacheSize();
+        nBuckets = std::max((int64_t)0, nMaxCacheSize) / (sizeof(CSlot) * BUCKET_SIZE);
+        if (nBuckets == 0)
+            return;
+
+        // All zero words are an empty slot
+        BOOST_STATIC_ASSERT(sizeof(CSlot) == 4 * sizeof(uint64_t));
+        pslots = (CSlot*)calloc(nBuckets * BUCKET_SIZE, sizeof(CSlot));
+        if (!pslots)
+            nBuckets = 0;
+    }
+
+    ~CSignatureCache()
+    {
+        free(pslots);
+    }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        if (nBuckets == 0)
+            return false;
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        uint64_t nEntry[4];
+        GetEntry(hash, vchSig, pubKey, nEntry);
+
+        const CSlot* pbucket = &pslots[(nEntry[0] % nBuckets) * BUCKET_SIZE];
+        for (unsigned int i = 0; i < BUCKET_SIZE; i++)
+        {
+            if (Match(pbucket[i], nEntry))
+            {
+                nHits.fetch_add(1, boost::memory_order_relaxed);
+                return true;
+            }
+        }
+        nMisses.fetch_add(1, boost::memory_order_relaxed);
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        if (nBuckets == 0)
+            return;
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        uint64_t nEntry[4];
+        GetEntry(hash, vchSig, pubKey, nEntry);
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        CSlot* pbucket = &pslots[(nEntry[0] % nBuckets) * BUCKET_SIZE];
+
+        // Take an empty slot if there is one, else evict a slot picked by the
+        // (salted, so unpredictable) entry itself
+        CSlot* pslot = &pbucket[nEntry[1] % BUCKET_SIZE];
+        for (unsigned int i = 0; i < BUCKET_SIZE; i++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            if (pbucket[i].nWords[0].load(boost::memory_order_relaxed) == 0)
+            {
+                pslot = &pbucket[i];
+                break;
+            }
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        // Invalidate the slot before overwriting it, then publish the first word last
+        pslot->nWords[0].store(0, boost::memory_order_release);
+        for (unsigned int i = 1; i < 4; i++)
+            pslot->nWords[i].store(nEntry[i], boost::memory_order_relaxed);
+        pslot->nWords[0].store(nEntry[0], boost::memory_order_release);
+    }
+
+    void GetStats(uint64_t& nSizeRet, uint64_t& nEntriesRet, uint64_t& nHitsRet, uint64_t& nMissesRet) const
+    {
+        nSizeRet = nBuckets * BUCKET_SIZE * sizeof(CSlot);
+        nEntriesRet = 0;
+        for (size_t n = 0; n < nBuckets * BUCKET_SIZE; n++)
+            if (pslots[n].nWords[0].load(boost::memory_order_relaxed) != 0)
+                nEntriesRet++;
+        nHitsRet = nHits.load(boost::memory_order_relaxed);
+        nMissesRet = nMisses.load(boost::memory_order_relaxed);
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+static CSignatureCache& GetSignatureCache()
 {
     static CSignatureCache signatureCache;
+    return signatureCache;
+}
+
+void GetSignatureCacheStats(uint64_t& nSizeRet, uint64_t& nEntriesRet, uint64_t& nHitsRet, uint64_t& nMissesRet)
+{
+    GetSignatureCache().GetStats(nSizeRet, nEntriesRet, nHitsRet, nMissesRet);
+}
+
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSigHashCache* pcache)
+{
+    CSignatureCache& signatureCache = GetSignatureCache();
 
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
@@ -1408,7 +1589,7 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType, pcache);
 
     if (signatureCache.Get(sighash, vchSig, pubkey))
         return true;
@@ -1837,15 +2018,15 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSigHashCache* pcache)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, pcache))
         return false;
 
     stackCopy = stack;
 
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, pcache))
         return false;
     if (stack.empty())
         return false;
@@ -1863,7 +2044,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, pcache))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1884,7 +2065,10 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
 
     txnouttype whichType;
-    if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
+    bool fSolved = Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType);
+    // scriptSig is set now, a hash or size cached before is stale
+    txTo.InvalidateCache();
+    if (!fSolved)
         return false;
 
     if (whichType == TX_SCRIPTHASH)
@@ -1898,10 +2082,11 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
 
         txnouttype subType;
-        bool fSolved =
+        fSolved =
             Solver(keystore, subscript, hash2, nHashType, txin.scriptSig, subType) && subType != TX_SCRIPTHASH;
         // Append serialized subscript whether or not it is completely signed:
         txin.scriptSig << static_cast<valtype>(subscript);
+        txTo.InvalidateCache();
         if (!fSolved) return false;
     }
 
@@ -1920,7 +2105,7 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
     return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
 }
 
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSigHashCache* pcache)
 {
     assert(nIn < txTo.vin.size());
     const CTxIn& txin = txTo.vin[nIn];
@@ -1931,7 +2116,7 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
     if (txin.prevout.hash != txFrom.GetHash())
         return false;
 
-    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, flags, nHashType);
+    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, flags, nHashType, pcache);
 }
 
 static CScript PushAll(const vector<valtype>& values)
@@ -1972,7 +2157,7 @@ static CScript CombineMultisig(CScript scriptPubKey, const CTransaction& txTo, u
             if (sigs.count(pubkey))
                 continue; // Already got a sig for this pubkey
 
-            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0, 0))
+            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0, 0, NULL))
             {
                 sigs[pubkey] = sig;
                 break;
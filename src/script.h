@@ -13,6 +13,7 @@
 
 #include <boost/foreach.hpp>
 #include <boost/variant.hpp>
+#include <openssl/sha.h>
 
 #include "keystore.h"
 #include "bignum.h"
@@ -81,6 +82,11 @@ static const unsigned int STANDARD_SCRIPT_VERIFY_FLAGS = MANDATORY_SCRIPT_VERIFY
 // For convenience, standard but not mandatory verify flags.
 static const unsigned int STANDARD_NOT_MANDATORY_VERIFY_FLAGS = STANDARD_SCRIPT_VERIFY_FLAGS & ~MANDATORY_SCRIPT_VERIFY_FLAGS;
 
+/** Default for -sigcachesize, signature cache size in megabytes */
+static const unsigned int DEFAULT_SIG_CACHE_SIZE = 8;
+/** Upper bound for -sigcachesize */
+static const unsigned int MAX_SIG_CACHE_SIZE = 1024;
+
 enum txnouttype
 {
     TX_NONSTANDARD,
@@ -710,10 +716,31 @@ public:
 };
 
 
+/** Parts of the SignatureHash() preimage that all inputs of a transaction
+ *  share under SIGHASH_ALL, computed once per transaction so that hashing
+ *  every input of a large transaction doesn't serialize all of it each time.
+ */
+class CSigHashCache
+{
+public:
+    // Serialized size of an input with an empty scriptSig
+    static const unsigned int BLANK_INPUT_SIZE = 41;
+
+    // Hash states over version, time, input count and the blanked inputs in front of each input
+    std::vector<SHA256_CTX> vPrefix;
+    // Blanked inputs: prevout, empty scriptSig, nSequence
+    std::vector<unsigned char> vchInputs;
+    // Outputs and lock time
+    std::vector<unsigned char> vchOutputs;
+
+    CSigHashCache(const CTransaction& txTo);
+};
+
 bool IsDERSignature(const valtype &vchSig, bool haveHashType = true);
 bool IsLowDERSignature(const valtype &vchSig, bool haveHashType = true);
 bool IsCompressedOrUncompressedPubKey(const valtype &vchPubKey);
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSigHashCache* pcache = NULL);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSigHashCache* pcache = NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType);
@@ -725,8 +752,10 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                   unsigned int flags, int nHashType);
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+                   unsigned int flags, int nHashType, const CSigHashCache* pcache = NULL);
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSigHashCache* pcache = NULL);
+// Signature cache usage, sizes in bytes
+void GetSignatureCacheStats(uint64_t& nSizeRet, uint64_t& nEntriesRet, uint64_t& nHitsRet, uint64_t& nMissesRet);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
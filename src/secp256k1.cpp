@@ -0,0 +1,721 @@
+// Copyright (c) 2017 The Mokacoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "secp256k1.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include <boost/thread/once.hpp>
+
+// The limb loops below have small constant trip counts and gain a lot from
+// being unrolled, which -O2 alone doesn't do
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("unroll-loops")
+#endif
+
+//
+// 256 bit integers are arrays of limbs, least significant first. Where the
+// compiler has a 128 bit type the limbs are 64 bits wide, otherwise 32 bits
+// so that every product still fits a native type. Constants are written as
+// 32 bit words and packed by LIMB_WORDS.
+//
+#ifdef __SIZEOF_INT128__
+typedef uint64_t limb_t;
+__extension__ typedef unsigned __int128 dlimb_t;
+#define LIMB_WORDS(lo, hi) (((uint64_t)(hi) << 32) | (lo))
+#else
+typedef uint32_t limb_t;
+typedef uint64_t dlimb_t;
+#define LIMB_WORDS(lo, hi) (lo), (hi)
+#endif
+
+static const int LIMB_BITS = 8 * sizeof(limb_t);
+static const int LIMBS = 256 / LIMB_BITS;
+static const int NIBBLES_PER_LIMB = LIMB_BITS / 4;
+
+// Field prime p = 2^256 - 2^32 - 977, and FIELD_C = 2^256 - p
+static const limb_t FIELD_P[LIMBS] = {LIMB_WORDS(0xFFFFFC2F, 0xFFFFFFFE), LIMB_WORDS(0xFFFFFFFF, 0xFFFFFFFF), LIMB_WORDS(0xFFFFFFFF, 0xFFFFFFFF), LIMB_WORDS(0xFFFFFFFF, 0xFFFFFFFF)};
+static const limb_t FIELD_P_MINUS_2[LIMBS] = {LIMB_WORDS(0xFFFFFC2D, 0xFFFFFFFE), LIMB_WORDS(0xFFFFFFFF, 0xFFFFFFFF), LIMB_WORDS(0xFFFFFFFF, 0xFFFFFFFF), LIMB_WORDS(0xFFFFFFFF, 0xFFFFFFFF)};
+static const limb_t FIELD_SQRT_EXP[LIMBS] = {LIMB_WORDS(0xBFFFFF0C, 0xFFFFFFFF), LIMB_WORDS(0xFFFFFFFF, 0xFFFFFFFF), LIMB_WORDS(0xFFFFFFFF, 0xFFFFFFFF), LIMB_WORDS(0xFFFFFFFF, 0x3FFFFFFF)};
+static const limb_t FIELD_C[] = {LIMB_WORDS(0x000003D1, 0x00000001)};
+static const int FIELD_C_LIMBS = sizeof(FIELD_C) / sizeof(limb_t);
+
+// Group order n, and ORDER_C = 2^256 - n
+static const limb_t ORDER_N[LIMBS] = {LIMB_WORDS(0xD0364141, 0xBFD25E8C), LIMB_WORDS(0xAF48A03B, 0xBAAEDCE6), LIMB_WORDS(0xFFFFFFFE, 0xFFFFFFFF), LIMB_WORDS(0xFFFFFFFF, 0xFFFFFFFF)};
+static const limb_t ORDER_N_MINUS_2[LIMBS] = {LIMB_WORDS(0xD036413F, 0xBFD25E8C), LIMB_WORDS(0xAF48A03B, 0xBAAEDCE6), LIMB_WORDS(0xFFFFFFFE, 0xFFFFFFFF), LIMB_WORDS(0xFFFFFFFF, 0xFFFFFFFF)};
+static const limb_t ORDER_C[] = {LIMB_WORDS(0x2FC9BEBF, 0x402DA173), LIMB_WORDS(0x50B75FC4, 0x45512319), LIMB_WORDS(0x00000001, 0x00000000)};
+static const int ORDER_C_LIMBS = sizeof(ORDER_C) / sizeof(limb_t);
+
+// Generator
+static const limb_t GENERATOR_X[LIMBS] = {LIMB_WORDS(0x16F81798, 0x59F2815B), LIMB_WORDS(0x2DCE28D9, 0x029BFCDB), LIMB_WORDS(0xCE870B07, 0x55A06295), LIMB_WORDS(0xF9DCBBAC, 0x79BE667E)};
+static const limb_t GENERATOR_Y[LIMBS] = {LIMB_WORDS(0xFB10D4B8, 0x9C47D08F), LIMB_WORDS(0xA6855419, 0xFD17B448), LIMB_WORDS(0x0E1108A8, 0x5DA4FBFC), LIMB_WORDS(0x26A3C465, 0x483ADA77)};
+
+// Big endian bytes to limbs
+static void SetBytes(limb_t* r, const unsigned char* pch)
+{
+    memset(r, 0, LIMBS * sizeof(limb_t));
+    for (int i = 0; i < 32; i++)
+        r[i / sizeof(limb_t)] |= (limb_t)pch[31 - i] << (8 * (i % sizeof(limb_t)));
+}
+
+static bool IsZero(const limb_t* a)
+{
+    for (int i = 0; i < LIMBS; i++)
+        if (a[i])
+            return false;
+    return true;
+}
+
+static int Compare(const limb_t* a, const limb_t* b)
+{
+    for (int i = LIMBS - 1; i >= 0; i--)
+    {
+        if (a[i] < b[i])
+            return -1;
+        if (a[i] > b[i])
+            return 1;
+    }
+    return 0;
+}
+
+// r = a + b, returns the carry
+static limb_t Add(limb_t* r, const limb_t* a, const limb_t* b)
+{
+    dlimb_t c = 0;
+    for (int i = 0; i < LIMBS; i++)
+    {
+        c += (dlimb_t)a[i] + b[i];
+        r[i] = (limb_t)c;
+        c >>= LIMB_BITS;
+    }
+    return (limb_t)c;
+}
+
+// r = a - b, returns the borrow
+static limb_t Sub(limb_t* r, const limb_t* a, const limb_t* b)
+{
+    limb_t nBorrow = 0;
+    for (int i = 0; i < LIMBS; i++)
+    {
+        dlimb_t d = (dlimb_t)a[i] - b[i] - nBorrow;
+        r[i] = (limb_t)d;
+        nBorrow = (limb_t)(d >> LIMB_BITS) & 1;
+    }
+    return nBorrow;
+}
+
+// t[0..2*LIMBS) = a * b
+static void MulWide(limb_t* t, const limb_t* a, const limb_t* b)
+{
+    memset(t, 0, 2 * LIMBS * sizeof(limb_t));
+    for (int i = 0; i < LIMBS; i++)
+    {
+        dlimb_t c = 0;
+        for (int j = 0; j < LIMBS; j++)
+        {
+            c += (dlimb_t)a[i] * b[j] + t[i + j];
+            t[i + j] = (limb_t)c;
+            c >>= LIMB_BITS;
+        }
+        t[i + LIMBS] = (limb_t)c;
+    }
+}
+
+
+//
+// Field arithmetic modulo p. Elements are kept fully reduced, so equality is
+// word equality.
+//
+struct CFieldElem
+{
+    limb_t n[LIMBS];
+};
+
+static void FieldSetInt(CFieldElem& r, limb_t v)
+{
+    memset(r.n, 0, sizeof(r.n));
+    r.n[0] = v;
+}
+
+static bool FieldEqual(const CFieldElem& a, const CFieldElem& b)
+{
+    return memcmp(a.n, b.n, sizeof(a.n)) == 0;
+}
+
+// r = r + nCarry * 2^256 (mod p), using 2^256 = FIELD_C (mod p). nCarry
+// must stay below 2^34.
+static void FieldFold(limb_t* r, dlimb_t nCarry)
+{
+    while (nCarry)
+    {
+        dlimb_t c = 0;
+        for (int i = 0; i < LIMBS; i++)
+        {
+            c += r[i];
+            if (i < FIELD_C_LIMBS)
+                c += nCarry * FIELD_C[i];
+            r[i] = (limb_t)c;
+            c >>= LIMB_BITS;
+        }
+        nCarry = c;
+    }
+    if (Compare(r, FIELD_P) >= 0)
+        Sub(r, r, FIELD_P);
+}
+
+static void FieldAdd(CFieldElem& r, const CFieldElem& a, const CFieldElem& b)
+{
+    limb_t nCarry = Add(r.n, a.n, b.n);
+    FieldFold(r.n, nCarry);
+}
+
+static void FieldSub(CFieldElem& r, const CFieldElem& a, const CFieldElem& b)
+{
+    if (Sub(r.n, a.n, b.n))
+        Add(r.n, r.n, FIELD_P);
+}
+
+static void FieldNegate(CFieldElem& r, const CFieldElem& a)
+{
+    if (IsZero(a.n))
+        r = a;
+    else
+        Sub(r.n, FIELD_P, a.n);
+}
+
+static void FieldMul(CFieldElem& r, const CFieldElem& a, const CFieldElem& b)
+{
+    limb_t t[2 * LIMBS];
+    MulWide(t, a.n, b.n);
+
+    // Fold the high half in as hi * FIELD_C
+    dlimb_t c = 0;
+    for (int i = 0; i < LIMBS; i++)
+    {
+        c += t[i];
+        for (int j = 0; j < FIELD_C_LIMBS && j <= i; j++)
+            c += (dlimb_t)t[LIMBS + i - j] * FIELD_C[j];
+        r.n[i] = (limb_t)c;
+        c >>= LIMB_BITS;
+    }
+    if (FIELD_C_LIMBS > 1)
+        c += (dlimb_t)t[2 * LIMBS - 1] * FIELD_C[FIELD_C_LIMBS - 1];
+    FieldFold(r.n, c);
+}
+
+static void FieldSqr(CFieldElem& r, const CFieldElem& a)
+{
+    FieldMul(r, a, a);
+}
+
+// r = a^e, with a 4 bit fixed window
+static void FieldPow(CFieldElem& r, const CFieldElem& a, const limb_t* e)
+{
+    CFieldElem table[16];
+    FieldSetInt(table[0], 1);
+    table[1] = a;
+    for (int i = 2; i < 16; i++)
+        FieldMul(table[i], table[i - 1], a);
+
+    CFieldElem x = table[0];
+    for (int i = 63; i >= 0; i--)
+    {
+        for (int j = 0; j < 4; j++)
+            FieldSqr(x, x);
+        unsigned int nNibble = (e[i / NIBBLES_PER_LIMB] >> (4 * (i % NIBBLES_PER_LIMB))) & 15;
+        if (nNibble)
+            FieldMul(x, x, table[nNibble]);
+    }
+    r = x;
+}
+
+static void FieldInverse(CFieldElem& r, const CFieldElem& a)
+{
+    FieldPow(r, a, FIELD_P_MINUS_2);
+}
+
+// Returns false if a is not a square
+static bool FieldSqrt(CFieldElem& r, const CFieldElem& a)
+{
+    // p = 3 (mod 4), so a^((p+1)/4) is a root if there is one
+    CFieldElem x, x2;
+    FieldPow(x, a, FIELD_SQRT_EXP);
+    FieldSqr(x2, x);
+    if (!FieldEqual(x2, a))
+        return false;
+    r = x;
+    return true;
+}
+
+
+//
+// Scalar arithmetic modulo n
+//
+
+// r = t mod n, for a value of up to 2*LIMBS limbs
+static void ScalarReduce(limb_t* r, const limb_t* t)
+{
+    static const int SIZE = 2 * LIMBS + 1;
+    limb_t a[SIZE];
+    memcpy(a, t, 2 * LIMBS * sizeof(limb_t));
+    a[2 * LIMBS] = 0;
+    int nLen = 2 * LIMBS;
+    while (nLen > LIMBS && a[nLen - 1] == 0)
+        nLen--;
+
+    // Fold the limbs above 2^256 in using 2^256 = ORDER_C (mod n)
+    while (nLen > LIMBS)
+    {
+        limb_t b[SIZE];
+        memset(b, 0, sizeof(b));
+        memcpy(b, a, LIMBS * sizeof(limb_t));
+        for (int i = 0; i < nLen - LIMBS; i++)
+        {
+            dlimb_t c = 0;
+            int j;
+            for (j = 0; j < ORDER_C_LIMBS; j++)
+            {
+                c += (dlimb_t)a[LIMBS + i] * ORDER_C[j] + b[i + j];
+                b[i + j] = (limb_t)c;
+                c >>= LIMB_BITS;
+            }
+            for (j = i + ORDER_C_LIMBS; c && j < SIZE; j++)
+            {
+                c += b[j];
+                b[j] = (limb_t)c;
+                c >>= LIMB_BITS;
+            }
+        }
+        memcpy(a, b, sizeof(a));
+        nLen = SIZE;
+        while (nLen > LIMBS && a[nLen - 1] == 0)
+            nLen--;
+    }
+    if (Compare(a, ORDER_N) >= 0)
+        Sub(a, a, ORDER_N);
+    memcpy(r, a, LIMBS * sizeof(limb_t));
+}
+
+static void ScalarMul(limb_t* r, const limb_t* a, const limb_t* b)
+{
+    limb_t t[2 * LIMBS];
+    MulWide(t, a, b);
+    ScalarReduce(r, t);
+}
+
+static void ScalarInverse(limb_t* r, const limb_t* a)
+{
+    limb_t table[16][LIMBS];
+    memset(table[0], 0, sizeof(table[0]));
+    table[0][0] = 1;
+    memcpy(table[1], a, sizeof(table[1]));
+    for (int i = 2; i < 16; i++)
+        ScalarMul(table[i], table[i - 1], a);
+
+    limb_t x[LIMBS];
+    memcpy(x, table[0], sizeof(x));
+    for (int i = 63; i >= 0; i--)
+    {
+        for (int j = 0; j < 4; j++)
+            ScalarMul(x, x, x);
+        unsigned int nNibble = (ORDER_N_MINUS_2[i / NIBBLES_PER_LIMB] >> (4 * (i % NIBBLES_PER_LIMB))) & 15;
+        if (nNibble)
+            ScalarMul(x, x, table[nNibble]);
+    }
+    memcpy(r, x, sizeof(x));
+}
+
+
+//
+// Curve points, y^2 = x^3 + 7
+//
+struct CPointAffine
+{
+    CFieldElem x, y;
+};
+
+// Jacobian coordinates, (X, Y, Z) is the affine point (X/Z^2, Y/Z^3)
+struct CPointJacobian
+{
+    CFieldElem x, y, z;
+    bool fInfinity;
+};
+
+static void PointSetAffine(CPointJacobian& r, const CPointAffine& a)
+{
+    r.x = a.x;
+    r.y = a.y;
+    FieldSetInt(r.z, 1);
+    r.fInfinity = false;
+}
+
+static void PointDouble(CPointJacobian& r, const CPointJacobian& a)
+{
+    // There is no point with y = 0 since the group order is odd
+    if (a.fInfinity)
+    {
+        r = a;
+        return;
+    }
+
+    CFieldElem A, B, C, D, E, F, t;
+    FieldSqr(A, a.x);
+    FieldSqr(B, a.y);
+    FieldSqr(C, B);
+    FieldAdd(t, a.x, B);
+    FieldSqr(D, t);
+    FieldSub(D, D, A);
+    FieldSub(D, D, C);
+    FieldAdd(D, D, D);
+    FieldAdd(E, A, A);
+    FieldAdd(E, E, A);
+    FieldSqr(F, E);
+
+    // Z3 = 2*Y1*Z1, before r.y may be overwritten
+    FieldMul(r.z, a.y, a.z);
+    FieldAdd(r.z, r.z, r.z);
+
+    // X3 = F - 2*D
+    FieldAdd(t, D, D);
+    FieldSub(r.x, F, t);
+
+    // Y3 = E*(D - X3) - 8*C
+    FieldSub(t, D, r.x);
+    FieldMul(t, E, t);
+    FieldAdd(C, C, C);
+    FieldAdd(C, C, C);
+    FieldAdd(C, C, C);
+    FieldSub(r.y, t, C);
+    r.fInfinity = false;
+}
+
+// r = a + b, for b with Z = 1
+static void PointAddAffine(CPointJacobian& r, const CPointJacobian& a, const CPointAffine& b)
+{
+    if (a.fInfinity)
+    {
+        PointSetAffine(r, b);
+        return;
+    }
+
+    CFieldElem Z1Z1, U2, S2, H, R, HH, HHH, V, t;
+    FieldSqr(Z1Z1, a.z);
+    FieldMul(U2, b.x, Z1Z1);
+    FieldMul(S2, b.y, a.z);
+    FieldMul(S2, S2, Z1Z1);
+    FieldSub(H, U2, a.x);
+    FieldSub(R, S2, a.y);
+    if (IsZero(H.n))
+    {
+        if (IsZero(R.n))
+            PointDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+
+    FieldSqr(HH, H);
+    FieldMul(HHH, H, HH);
+    FieldMul(V, a.x, HH);
+
+    CFieldElem X3, Y3;
+    FieldSqr(X3, R);
+    FieldSub(X3, X3, HHH);
+    FieldSub(X3, X3, V);
+    FieldSub(X3, X3, V);
+    FieldSub(t, V, X3);
+    FieldMul(Y3, R, t);
+    FieldMul(t, a.y, HHH);
+    FieldSub(Y3, Y3, t);
+    FieldMul(r.z, a.z, H);
+    r.x = X3;
+    r.y = Y3;
+    r.fInfinity = false;
+}
+
+static void PointAdd(CPointJacobian& r, const CPointJacobian& a, const CPointJacobian& b)
+{
+    if (a.fInfinity)
+    {
+        r = b;
+        return;
+    }
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+
+    CFieldElem Z1Z1, Z2Z2, U1, U2, S1, S2, H, R, HH, HHH, V, t;
+    FieldSqr(Z1Z1, a.z);
+    FieldSqr(Z2Z2, b.z);
+    FieldMul(U1, a.x, Z2Z2);
+    FieldMul(U2, b.x, Z1Z1);
+    FieldMul(S1, a.y, b.z);
+    FieldMul(S1, S1, Z2Z2);
+    FieldMul(S2, b.y, a.z);
+    FieldMul(S2, S2, Z1Z1);
+    FieldSub(H, U2, U1);
+    FieldSub(R, S2, S1);
+    if (IsZero(H.n))
+    {
+        if (IsZero(R.n))
+            PointDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+
+    FieldSqr(HH, H);
+    FieldMul(HHH, H, HH);
+    FieldMul(V, U1, HH);
+
+    CFieldElem X3, Y3;
+    FieldSqr(X3, R);
+    FieldSub(X3, X3, HHH);
+    FieldSub(X3, X3, V);
+    FieldSub(X3, X3, V);
+    FieldSub(t, V, X3);
+    FieldMul(Y3, R, t);
+    FieldMul(t, S1, HHH);
+    FieldSub(Y3, Y3, t);
+    FieldMul(r.z, a.z, b.z);
+    FieldMul(r.z, r.z, H);
+    r.x = X3;
+    r.y = Y3;
+    r.fInfinity = false;
+}
+
+static bool IsOnCurve(const CPointAffine& a)
+{
+    CFieldElem y2, x3, seven;
+    FieldSqr(y2, a.y);
+    FieldSqr(x3, a.x);
+    FieldMul(x3, x3, a.x);
+    FieldSetInt(seven, 7);
+    FieldAdd(x3, x3, seven);
+    return FieldEqual(y2, x3);
+}
+
+
+//
+// Multiples of the generator: table[i][j] = j * 16^i * G, so that k*G is the
+// sum of at most 64 table entries and takes no doublings at all.
+//
+static CPointAffine generatorTable[64][16];
+static boost::once_flag generatorTableOnce = BOOST_ONCE_INIT;
+
+static void InitGeneratorTable()
+{
+    CPointAffine g;
+    memcpy(g.x.n, GENERATOR_X, sizeof(g.x.n));
+    memcpy(g.y.n, GENERATOR_Y, sizeof(g.y.n));
+
+    std::vector<CPointJacobian> vPoints(64 * 15);
+    CPointJacobian base;
+    PointSetAffine(base, g);
+    for (int i = 0; i < 64; i++)
+    {
+        vPoints[i * 15] = base;
+        for (int j = 1; j < 15; j++)
+            PointAdd(vPoints[i * 15 + j], vPoints[i * 15 + j - 1], base);
+        for (int j = 0; j < 4; j++)
+            PointDouble(base, base);
+    }
+
+    // Convert to affine with a single inversion: invert the product of all
+    // Z coordinates, then peel the individual inverses off back to front
+    std::vector<CFieldElem> vProducts(vPoints.size());
+    vProducts[0] = vPoints[0].z;
+    for (unsigned int i = 1; i < vPoints.size(); i++)
+        FieldMul(vProducts[i], vProducts[i - 1], vPoints[i].z);
+    CFieldElem inv;
+    FieldInverse(inv, vProducts.back());
+    for (int i = vPoints.size() - 1; i >= 0; i--)
+    {
+        CFieldElem zinv, zinv2, zinv3;
+        if (i > 0)
+        {
+            FieldMul(zinv, inv, vProducts[i - 1]);
+            FieldMul(inv, inv, vPoints[i].z);
+        }
+        else
+            zinv = inv;
+        FieldSqr(zinv2, zinv);
+        FieldMul(zinv3, zinv2, zinv);
+        CPointAffine& entry = generatorTable[i / 15][i % 15 + 1];
+        FieldMul(entry.x, vPoints[i].x, zinv2);
+        FieldMul(entry.y, vPoints[i].y, zinv3);
+    }
+}
+
+// r = k*G
+static void MulGenerator(CPointJacobian& r, const limb_t* k)
+{
+    boost::call_once(InitGeneratorTable, generatorTableOnce);
+
+    r.fInfinity = true;
+    for (int i = 0; i < 64; i++)
+    {
+        unsigned int nNibble = (k[i / NIBBLES_PER_LIMB] >> (4 * (i % NIBBLES_PER_LIMB))) & 15;
+        if (nNibble)
+            PointAddAffine(r, r, generatorTable[i][nNibble]);
+    }
+}
+
+// Width 5 non-adjacent form of k: odd digits in [-15, 15], at least four
+// zeros between nonzero digits. Returns the number of digits.
+static int GetWNAF(int* pnDigits, const limb_t* k)
+{
+    limb_t a[LIMBS + 1];
+    memcpy(a, k, LIMBS * sizeof(limb_t));
+    a[LIMBS] = 0;
+
+    int nLen = 0;
+    while (!IsZero(a) || a[LIMBS])
+    {
+        int nDigit = 0;
+        if (a[0] & 1)
+        {
+            nDigit = a[0] & 31;
+            if (nDigit >= 16)
+                nDigit -= 32;
+
+            // a -= nDigit, which clears the low five bits
+            if (nDigit > 0)
+                a[0] -= nDigit;
+            else
+            {
+                dlimb_t c = -nDigit;
+                for (int i = 0; i <= LIMBS && c; i++)
+                {
+                    c += a[i];
+                    a[i] = (limb_t)c;
+                    c >>= LIMB_BITS;
+                }
+            }
+        }
+        pnDigits[nLen++] = nDigit;
+
+        for (int i = 0; i < LIMBS; i++)
+            a[i] = (a[i] >> 1) | (a[i + 1] << (LIMB_BITS - 1));
+        a[LIMBS] >>= 1;
+    }
+    return nLen;
+}
+
+// r = k*p
+static void MulPoint(CPointJacobian& r, const CPointAffine& p, const limb_t* k)
+{
+    // Odd multiples p, 3p, ..., 15p
+    CPointJacobian vPre[8], p2;
+    PointSetAffine(vPre[0], p);
+    PointDouble(p2, vPre[0]);
+    for (int i = 1; i < 8; i++)
+        PointAdd(vPre[i], vPre[i - 1], p2);
+
+    int vDigits[258];
+    int nLen = GetWNAF(vDigits, k);
+
+    r.fInfinity = true;
+    for (int i = nLen - 1; i >= 0; i--)
+    {
+        PointDouble(r, r);
+        int nDigit = vDigits[i];
+        if (nDigit > 0)
+            PointAdd(r, r, vPre[(nDigit - 1) / 2]);
+        else if (nDigit < 0)
+        {
+            CPointJacobian neg = vPre[(-nDigit - 1) / 2];
+            FieldNegate(neg.y, neg.y);
+            PointAdd(r, r, neg);
+        }
+    }
+}
+
+static bool ParsePubKey(CPointAffine& r, const unsigned char* pch, size_t nLen)
+{
+    if (nLen == 33 && (pch[0] == 0x02 || pch[0] == 0x03))
+    {
+        SetBytes(r.x.n, pch + 1);
+        if (Compare(r.x.n, FIELD_P) >= 0)
+            return false;
+        CFieldElem y2, seven;
+        FieldSqr(y2, r.x);
+        FieldMul(y2, y2, r.x);
+        FieldSetInt(seven, 7);
+        FieldAdd(y2, y2, seven);
+        if (!FieldSqrt(r.y, y2))
+            return false;
+        if ((r.y.n[0] & 1) != (pch[0] & 1))
+            FieldNegate(r.y, r.y);
+        return true;
+    }
+    if (nLen == 65 && (pch[0] == 0x04 || pch[0] == 0x06 || pch[0] == 0x07))
+    {
+        SetBytes(r.x.n, pch + 1);
+        SetBytes(r.y.n, pch + 33);
+        if (Compare(r.x.n, FIELD_P) >= 0 || Compare(r.y.n, FIELD_P) >= 0)
+            return false;
+        // Hybrid encodings carry the parity of y in the header as well
+        if (pch[0] != 0x04 && (r.y.n[0] & 1) != (pch[0] & 1))
+            return false;
+        return IsOnCurve(r);
+    }
+    return false;
+}
+
+bool Secp256k1CheckPubKey(const unsigned char* pchPubKey, size_t nPubKeyLen)
+{
+    CPointAffine p;
+    return ParsePubKey(p, pchPubKey, nPubKeyLen);
+}
+
+bool Secp256k1Verify(const unsigned char* pchPubKey, size_t nPubKeyLen, const unsigned char pchHash[32],
+                     const unsigned char pchR[32], const unsigned char pchS[32])
+{
+    CPointAffine p;
+    if (!ParsePubKey(p, pchPubKey, nPubKeyLen))
+        return false;
+
+    limb_t r[LIMBS], s[LIMBS], e[LIMBS];
+    SetBytes(r, pchR);
+    SetBytes(s, pchS);
+    if (IsZero(r) || Compare(r, ORDER_N) >= 0 || IsZero(s) || Compare(s, ORDER_N) >= 0)
+        return false;
+    SetBytes(e, pchHash);
+    if (Compare(e, ORDER_N) >= 0)
+        Sub(e, e, ORDER_N);
+
+    // R = (e/s)*G + (r/s)*P
+    limb_t w[LIMBS], u1[LIMBS], u2[LIMBS];
+    ScalarInverse(w, s);
+    ScalarMul(u1, e, w);
+    ScalarMul(u2, r, w);
+
+    CPointJacobian R, Q;
+    MulGenerator(R, u1);
+    MulPoint(Q, p, u2);
+    PointAdd(R, R, Q);
+    if (R.fInfinity)
+        return false;
+
+    // The signature is good if x(R) = r (mod n). x(R) = X/Z^2 is below p < 2n,
+    // so it is either r itself or r + n, compared as X = x * Z^2.
+    CFieldElem zz, x, xzz;
+    FieldSqr(zz, R.z);
+    memcpy(x.n, r, sizeof(x.n));
+    FieldMul(xzz, x, zz);
+    if (FieldEqual(xzz, R.x))
+        return true;
+    if (Add(x.n, r, ORDER_N) == 0 && Compare(x.n, FIELD_P) < 0)
+    {
+        FieldMul(xzz, x, zz);
+        if (FieldEqual(xzz, R.x))
+            return true;
+    }
+    return false;
+}
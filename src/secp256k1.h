@@ -0,0 +1,28 @@
+// Copyright (c) 2017 The Mokacoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SECP256K1_H
+#define BITCOIN_SECP256K1_H
+
+#include <stddef.h>
+
+/** In-tree secp256k1 ECDSA verification, used by CPubKey::Verify when built
+ *  with USE_SECP256K1 instead of going through OpenSSL's EC_KEY/ECDSA_verify.
+ *
+ *  Only verification is implemented: it works on public data exclusively, so
+ *  the code is plain variable-time arithmetic. Signing stays with OpenSSL.
+ */
+
+/** Check an ECDSA signature (r, s), given as 32 byte big endian integers,
+ *  over the 32 byte message digest pchHash.
+ *  The public key is accepted in the same encodings as OpenSSL accepts them:
+ *  compressed (02/03), uncompressed (04) and hybrid (06/07).
+ *  r and s must be in [1, n-1], the digest is reduced modulo the group order.
+ */
+bool Secp256k1Verify(const unsigned char* pchPubKey, size_t nPubKeyLen, const unsigned char pchHash[32],
+                     const unsigned char pchR[32], const unsigned char pchS[32]);
+
+/** Check that a public key encoding decodes to a point on the curve */
+bool Secp256k1CheckPubKey(const unsigned char* pchPubKey, size_t nPubKeyLen);
+
+#endif
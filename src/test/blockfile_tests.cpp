@@ -0,0 +1,148 @@
+#include <boost/test/unit_test.hpp>
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "blockfile.h"
+#include "test_mokacoin.h"
+#include "util.h"
+#include "version.h"
+
+using namespace std;
+
+static const unsigned int TEST_BLOCKFILE = 9001;
+
+// Append obj to the test block file and return the position it was written at
+template<typename T>
+static unsigned int Append(const T& obj)
+{
+    FILE* file = fopen(GetBlockFilePath(TEST_BLOCKFILE).string().c_str(), "ab");
+    BOOST_REQUIRE(file != NULL);
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    fseek(fileout, 0, SEEK_END);
+    unsigned int nPos = ftell(fileout);
+    fileout << obj;
+    fflush(fileout);
+    return nPos;
+}
+
+BOOST_FIXTURE_TEST_SUITE(blockfile_tests, TempDataDirSetup)
+
+BOOST_AUTO_TEST_CASE(blockfile_read_mapped_and_appended)
+{
+    vector<unsigned int> vPos;
+    vector<string> vStr;
+    for (int i = 0; i < 100; i++)
+    {
+        vStr.push_back(strprintf("object %d", i));
+        vPos.push_back(Append(vStr.back()));
+    }
+    // Larger than the pread buffer
+    vector<unsigned char> vchLarge(200000);
+    for (unsigned int i = 0; i < vchLarge.size(); i++)
+        vchLarge[i] = i * 7;
+    unsigned int nLargePos = Append(vchLarge);
+
+    for (int i = 99; i >= 0; i--)
+    {
+        CBlockFileReader filein(SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(filein.Open(TEST_BLOCKFILE, vPos[i]));
+        string str;
+        filein >> str;
+        BOOST_CHECK_EQUAL(str, vStr[i]);
+    }
+
+    // Written after the handle was mapped, read through pread
+    vector<unsigned int> vTailPos;
+    for (int i = 0; i < 100; i++)
+        vTailPos.push_back(Append(vStr[i]));
+    unsigned int nLargeTailPos = Append(vchLarge);
+
+    CBlockFileReader filein(SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(filein.Open(TEST_BLOCKFILE, vTailPos[0]));
+    for (int i = 0; i < 100; i++)
+    {
+        string str;
+        filein >> str;
+        BOOST_CHECK_EQUAL(str, vStr[i]);
+    }
+    BOOST_CHECK_EQUAL(filein.GetPos(), nLargeTailPos);
+
+    vector<unsigned char> vch;
+    filein.Seek(nLargePos);
+    filein >> vch;
+    BOOST_CHECK(vch == vchLarge);
+    filein.Seek(nLargeTailPos);
+    filein >> vch;
+    BOOST_CHECK(vch == vchLarge);
+
+    // Nothing left
+    unsigned char ch;
+    BOOST_CHECK_THROW(filein >> ch, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(blockfile_uncached_and_missing)
+{
+    int nOldHandles = nBlockFileHandles;
+    nBlockFileHandles = 0;
+
+    unsigned int nPos = Append(string("uncached"));
+    CBlockFileReader filein(SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(filein.Open(TEST_BLOCKFILE, nPos));
+    string str;
+    filein >> str;
+    BOOST_CHECK_EQUAL(str, "uncached");
+
+    CBlockFileReader fileMissing(SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(!fileMissing.Open(TEST_BLOCKFILE + 1, 0));
+    BOOST_CHECK(!fileMissing);
+    BOOST_CHECK(!fileMissing.Open(0, 0));
+
+    nBlockFileHandles = nOldHandles;
+}
+
+BOOST_AUTO_TEST_CASE(blockfile_append)
+{
+    const unsigned char pchMessageStart[4] = { 0xf9, 0xbe, 0xb4, 0xd9 };
+    vector<unsigned int> vFile, vPos;
+    vector<string> vStr;
+    for (int i = 0; i < 50; i++)
+    {
+        vStr.push_back(string(100 + i * 1000, 'a' + i % 26));
+        unsigned int nFile, nPos;
+        BOOST_REQUIRE(AppendBlockToFile(pchMessageStart, vStr.back().data(), vStr.back().size(), nFile, nPos));
+        BOOST_CHECK(nFile > 0);
+        if (!vPos.empty())
+            BOOST_CHECK_EQUAL(nPos, vPos.back() + vStr[i - 1].size() + 8);
+        vFile.push_back(nFile);
+        vPos.push_back(nPos);
+    }
+    BOOST_CHECK(SyncBlockFiles());
+
+    for (int i = 0; i < 50; i++)
+    {
+        CBlockFileReader filein(SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(filein.Open(vFile[i], vPos[i] - 8));
+        unsigned char pchStart[4];
+        unsigned int nSize;
+        filein >> FLATDATA(pchStart) >> nSize;
+        BOOST_CHECK(memcmp(pchStart, pchMessageStart, 4) == 0);
+        BOOST_CHECK_EQUAL(nSize, vStr[i].size());
+        string str(nSize, 0);
+        filein.read(&str[0], nSize);
+        BOOST_CHECK(str == vStr[i]);
+    }
+
+    // Preallocated space doesn't count towards the file size
+    CloseBlockFiles();
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(GetBlockFilePath(vFile.back())), vPos.back() + vStr.back().size());
+
+    // Appending continues at the end of the existing data
+    unsigned int nFile, nPos;
+    BOOST_REQUIRE(AppendBlockToFile(pchMessageStart, vStr[0].data(), vStr[0].size(), nFile, nPos));
+    BOOST_CHECK_EQUAL(nFile, vFile.back());
+    BOOST_CHECK_EQUAL(nPos, vPos.back() + vStr.back().size() + 8);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,197 @@
+#include <boost/test/unit_test.hpp>
+
+#include <set>
+#include <string.h>
+#include <vector>
+
+#include "main.h"
+
+using namespace std;
+
+// Reaches into the table to make two hashes share a digest
+class CBlockIndexMapTest : public CBlockIndexMap
+{
+public:
+    uint64_t GetDigest(const uint256& hash) const { return Digest(hash); }
+
+    // A hash other than hash with the same salted digest: flip bits of the
+    // first word, then pick the last so the state going into the last round
+    // matches. Each nonzero nFlip gives a different hash.
+    uint256 Collide(const uint256& hash, uint64_t nFlip) const
+    {
+        uint64_t pn[4];
+        memcpy(pn, const_cast<uint256&>(hash).begin(), sizeof(pn));
+        uint64_t pnOther[4] = { pn[0] ^ nFlip, pn[1], pn[2], pn[3] };
+        uint64_t h = nSalt, hOther = nSalt;
+        for (int i = 0; i < 3; i++)
+        {
+            h = Round(h, pn[i]);
+            hOther = Round(hOther, pnOther[i]);
+        }
+        pnOther[3] = pn[3] ^ h ^ hOther;
+        uint256 other;
+        memcpy(other.begin(), pnOther, sizeof(pnOther));
+        return other;
+    }
+
+private:
+    static uint64_t Round(uint64_t h, uint64_t n)
+    {
+        h ^= n;
+        h *= 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+        return h;
+    }
+};
+
+// nCount entries with distinct hashes, phashBlock pointing at each
+static void MakeEntries(vector<CBlockIndex>& vEntries, size_t nCount)
+{
+    vEntries.resize(nCount);
+    for (size_t i = 0; i < nCount; i++)
+    {
+        vEntries[i].hashBlock = GetRandHash();
+        vEntries[i].phashBlock = &vEntries[i].hashBlock;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(blockindexmap_tests)
+
+BOOST_AUTO_TEST_CASE(blockindexmap_insert_find)
+{
+    vector<CBlockIndex> vEntries;
+    MakeEntries(vEntries, 2);
+
+    CBlockIndexMap map;
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.find(vEntries[0].hashBlock) == map.end());
+    BOOST_CHECK(map[vEntries[0].hashBlock] == NULL);
+
+    pair<CBlockIndexMap::iterator, bool> ret = map.insert(make_pair(vEntries[0].hashBlock, &vEntries[0]));
+    BOOST_CHECK(ret.second);
+    BOOST_CHECK(ret.first->first == vEntries[0].hashBlock);
+    BOOST_CHECK(ret.first->second == &vEntries[0]);
+    BOOST_CHECK_EQUAL(map.size(), 1U);
+    BOOST_CHECK_EQUAL(map.count(vEntries[0].hashBlock), 1U);
+    BOOST_CHECK_EQUAL(map.count(vEntries[1].hashBlock), 0U);
+    BOOST_CHECK(map[vEntries[0].hashBlock] == &vEntries[0]);
+    BOOST_CHECK(map[vEntries[1].hashBlock] == NULL);
+
+    // A second entry with the same hash is refused, the first one stays
+    CBlockIndex duplicate;
+    duplicate.hashBlock = vEntries[0].hashBlock;
+    duplicate.phashBlock = &duplicate.hashBlock;
+    ret = map.insert(make_pair(duplicate.hashBlock, &duplicate));
+    BOOST_CHECK(!ret.second);
+    BOOST_CHECK(ret.first->second == &vEntries[0]);
+    BOOST_CHECK_EQUAL(map.size(), 1U);
+    BOOST_CHECK(map[duplicate.hashBlock] == &vEntries[0]);
+
+    map.clear();
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.begin() == map.end());
+    BOOST_CHECK(map[vEntries[0].hashBlock] == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(blockindexmap_growth)
+{
+    // Enough to rehash several times from the initial 16 slots
+    vector<CBlockIndex> vEntries;
+    MakeEntries(vEntries, 5000);
+
+    CBlockIndexMap map;
+    for (size_t i = 0; i < vEntries.size(); i++)
+    {
+        BOOST_CHECK(map.insert(make_pair(vEntries[i].hashBlock, &vEntries[i])).second);
+        BOOST_CHECK(map[vEntries[i].hashBlock] == &vEntries[i]);
+    }
+    BOOST_CHECK_EQUAL(map.size(), vEntries.size());
+
+    // Everything inserted before a rehash can still be found after it
+    for (size_t i = 0; i < vEntries.size(); i++)
+        BOOST_CHECK(map[vEntries[i].hashBlock] == &vEntries[i]);
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(map[GetRandHash()] == NULL);
+
+    // Reserving what is already there doesn't rehash or lose anything
+    size_t nUsage = map.MemoryUsage();
+    map.reserve(vEntries.size());
+    BOOST_CHECK_EQUAL(map.MemoryUsage(), nUsage);
+    BOOST_CHECK_EQUAL(map.size(), vEntries.size());
+
+    // Reserving up front means inserting doesn't grow the table
+    CBlockIndexMap mapReserved;
+    mapReserved.reserve(vEntries.size());
+    nUsage = mapReserved.MemoryUsage();
+    for (size_t i = 0; i < vEntries.size(); i++)
+        mapReserved.insert(make_pair(vEntries[i].hashBlock, &vEntries[i]));
+    BOOST_CHECK_EQUAL(mapReserved.MemoryUsage(), nUsage);
+    BOOST_CHECK_EQUAL(mapReserved.size(), vEntries.size());
+}
+
+BOOST_AUTO_TEST_CASE(blockindexmap_iterate)
+{
+    vector<CBlockIndex> vEntries;
+    MakeEntries(vEntries, 300);
+
+    CBlockIndexMap map;
+    BOOST_CHECK(map.begin() == map.end());
+    for (size_t i = 0; i < vEntries.size(); i++)
+        map.insert(make_pair(vEntries[i].hashBlock, &vEntries[i]));
+
+    // Every entry comes up exactly once, with its own hash
+    set<CBlockIndex*> setSeen;
+    for (CBlockIndexMap::iterator it = map.begin(); it != map.end(); it++)
+    {
+        BOOST_CHECK(it->first == *it->second->phashBlock);
+        BOOST_CHECK(setSeen.insert(it->second).second);
+    }
+    BOOST_CHECK_EQUAL(setSeen.size(), vEntries.size());
+    for (size_t i = 0; i < vEntries.size(); i++)
+        BOOST_CHECK(setSeen.count(&vEntries[i]));
+}
+
+BOOST_AUTO_TEST_CASE(blockindexmap_digest_collision)
+{
+    CBlockIndexMapTest map;
+    map.reserve(100); // picks the salt
+
+    // Groups of four entries that share a digest, and so a slot and a probe chain
+    vector<CBlockIndex> vEntries(40);
+    for (size_t i = 0; i < vEntries.size(); i++)
+    {
+        const uint256& hashFirst = vEntries[i - i % 4].hashBlock;
+        vEntries[i].hashBlock = i % 4 == 0 ? GetRandHash() : map.Collide(hashFirst, i % 4);
+        vEntries[i].phashBlock = &vEntries[i].hashBlock;
+        if (i % 4 != 0)
+        {
+            BOOST_CHECK(vEntries[i].hashBlock != hashFirst);
+            BOOST_CHECK_EQUAL(map.GetDigest(vEntries[i].hashBlock), map.GetDigest(hashFirst));
+        }
+    }
+
+    for (size_t i = 0; i < vEntries.size(); i++)
+    {
+        // Not found before it is there, even though its digest is
+        BOOST_CHECK(map[vEntries[i].hashBlock] == NULL);
+        BOOST_CHECK(map.insert(make_pair(vEntries[i].hashBlock, &vEntries[i])).second);
+    }
+    BOOST_CHECK_EQUAL(map.size(), vEntries.size());
+    for (size_t i = 0; i < vEntries.size(); i++)
+        BOOST_CHECK(map[vEntries[i].hashBlock] == &vEntries[i]);
+
+    // Colliding hashes that were never inserted are still missing
+    for (size_t i = 0; i < vEntries.size(); i += 4)
+        BOOST_CHECK(map[map.Collide(vEntries[i].hashBlock, 4)] == NULL);
+
+    // Growing keeps the salt, so the collisions move together
+    vector<CBlockIndex> vMore;
+    MakeEntries(vMore, 1000);
+    for (size_t i = 0; i < vMore.size(); i++)
+        map.insert(make_pair(vMore[i].hashBlock, &vMore[i]));
+    for (size_t i = 0; i < vEntries.size(); i++)
+        BOOST_CHECK(map[vEntries[i].hashBlock] == &vEntries[i]);
+    BOOST_CHECK_EQUAL(map.size(), vEntries.size() + vMore.size());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,130 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "main.h"
+
+using namespace std;
+
+// Build a branch of nLength blocks on top of pindexFork (NULL for a new chain)
+static void MakeBranch(vector<CBlockIndex>& vBlocks, CBlockIndex* pindexFork, int nLength)
+{
+    vBlocks.resize(nLength);
+    for (int i = 0; i < nLength; i++)
+    {
+        vBlocks[i].pprev = i > 0 ? &vBlocks[i - 1] : pindexFork;
+        vBlocks[i].nHeight = vBlocks[i].pprev ? vBlocks[i].pprev->nHeight + 1 : 0;
+        vBlocks[i].BuildSkip();
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(chain_tests)
+
+BOOST_AUTO_TEST_CASE(chain_set_tip)
+{
+    vector<CBlockIndex> vMain, vFork;
+    MakeBranch(vMain, NULL, 100);
+    MakeBranch(vFork, &vMain[49], 80);
+
+    LOCK(cs_main); // CChain accessors assert it
+    CChain chain;
+    BOOST_CHECK(chain.Tip() == NULL);
+    BOOST_CHECK(chain.Genesis() == NULL);
+    BOOST_CHECK_EQUAL(chain.Height(), -1);
+    BOOST_CHECK(chain[0] == NULL);
+
+    chain.SetTip(&vMain.back());
+    BOOST_CHECK_EQUAL(chain.Height(), 99);
+    BOOST_CHECK(chain.Genesis() == &vMain[0]);
+    BOOST_CHECK(chain.Tip() == &vMain[99]);
+    for (int i = 0; i < 100; i++)
+    {
+        BOOST_CHECK(chain[i] == &vMain[i]);
+        BOOST_CHECK(chain.Contains(&vMain[i]));
+    }
+    BOOST_CHECK(chain[100] == NULL);
+    BOOST_CHECK(chain[-1] == NULL);
+    BOOST_CHECK(chain.Next(&vMain[10]) == &vMain[11]);
+    BOOST_CHECK(chain.Next(&vMain[99]) == NULL);
+    BOOST_CHECK(!chain.Contains(&vFork[0]));
+    BOOST_CHECK(chain.Next(&vFork[0]) == NULL);
+
+    // Fork point of a block on a side branch, above and below the tip
+    BOOST_CHECK(chain.FindFork(&vFork[10]) == &vMain[49]);
+    BOOST_CHECK(chain.FindFork(&vFork[79]) == &vMain[49]);
+    BOOST_CHECK(chain.FindFork(&vMain[20]) == &vMain[20]);
+
+    // Switch to the longer branch
+    chain.SetTip(&vFork.back());
+    BOOST_CHECK_EQUAL(chain.Height(), 129);
+    BOOST_CHECK(chain.Contains(&vMain[49]));
+    BOOST_CHECK(!chain.Contains(&vMain[50]));
+    BOOST_CHECK(!chain.Contains(&vMain[99]));
+    for (int i = 0; i < 80; i++)
+        BOOST_CHECK(chain[50 + i] == &vFork[i]);
+    BOOST_CHECK(chain.FindFork(&vMain[99]) == &vMain[49]);
+
+    // And back to a shorter one
+    chain.SetTip(&vMain[60]);
+    BOOST_CHECK_EQUAL(chain.Height(), 60);
+    BOOST_CHECK(chain.Tip() == &vMain[60]);
+    BOOST_CHECK(!chain.Contains(&vFork[0]));
+    BOOST_CHECK(chain.FindFork(&vFork[79]) == &vMain[49]);
+
+    chain.SetTip(NULL);
+    BOOST_CHECK_EQUAL(chain.Height(), -1);
+}
+
+BOOST_AUTO_TEST_CASE(chain_get_ancestor)
+{
+    vector<CBlockIndex> vBlocks;
+    MakeBranch(vBlocks, NULL, 20000);
+
+    for (int i = 1; i < 20000; i++)
+    {
+        BOOST_CHECK(vBlocks[i].pskip != NULL);
+        BOOST_CHECK(vBlocks[i].pskip->nHeight < i);
+    }
+    for (int i = 0; i < 1000; i++)
+    {
+        int nFrom = insecure_rand() % 20000;
+        int nTo = insecure_rand() % (nFrom + 1);
+        BOOST_CHECK(vBlocks[nFrom].GetAncestor(nTo) == &vBlocks[nTo]);
+        BOOST_CHECK(vBlocks[nFrom].GetAncestor(nFrom) == &vBlocks[nFrom]);
+        BOOST_CHECK(vBlocks[nFrom].GetAncestor(0) == &vBlocks[0]);
+    }
+    BOOST_CHECK(vBlocks[100].GetAncestor(101) == NULL);
+    BOOST_CHECK(vBlocks[100].GetAncestor(-1) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(chain_last_block_index)
+{
+    // Proof-of-work up to height 100, then every third block is proof-of-work
+    vector<CBlockIndex> vBlocks(300);
+    for (int i = 0; i < 300; i++)
+    {
+        vBlocks[i].pprev = i > 0 ? &vBlocks[i - 1] : NULL;
+        vBlocks[i].nHeight = i;
+        if (i > 100 && i % 3 != 0)
+            vBlocks[i].SetProofOfStake();
+        vBlocks[i].BuildSkip();
+    }
+
+    for (int i = 0; i < 300; i++)
+    {
+        for (int f = 0; f < 2; f++)
+        {
+            bool fProofOfStake = f;
+            const CBlockIndex* pindex = &vBlocks[i];
+            while (pindex->pprev && pindex->IsProofOfStake() != fProofOfStake)
+                pindex = pindex->pprev;
+            BOOST_CHECK(GetLastBlockIndex(&vBlocks[i], fProofOfStake) == pindex);
+        }
+    }
+    BOOST_CHECK(GetLastBlockIndex(&vBlocks[100], true) == &vBlocks[0]);
+    BOOST_CHECK(GetLastBlockIndex(&vBlocks[105], true) == &vBlocks[104]);
+    BOOST_CHECK(GetLastBlockIndex(&vBlocks[299], false) == &vBlocks[297]);
+    BOOST_CHECK(GetLastBlockIndex(NULL, false) == NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,164 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+#include "checkqueue.h"
+#include "keystore.h"
+#include "main.h"
+#include "script.h"
+
+using namespace std;
+
+// Run checks on a queue with nThreads worker threads plus the calling thread
+static bool RunParallel(vector<CScriptCheck> vChecks, int nThreads, CScriptCheck* pcheckFailed = NULL)
+{
+    CCheckQueue<CScriptCheck> queue(16);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CScriptCheck>::Thread, &queue));
+
+    bool fRet;
+    {
+        CCheckQueueControl<CScriptCheck> control(&queue, pcheckFailed);
+        // Hand the checks over in several batches, the way ConnectBlock does per transaction
+        while (!vChecks.empty())
+        {
+            size_t nBatch = min(vChecks.size(), (size_t)7);
+            vector<CScriptCheck> vBatch(vChecks.end() - nBatch, vChecks.end());
+            vChecks.resize(vChecks.size() - nBatch);
+            control.Add(vBatch);
+        }
+        fRet = control.Wait();
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    return fRet;
+}
+
+// Five transactions of ten inputs each, all spending txFrom and correctly signed
+static void SignedTransactions(CTransaction& txFrom, vector<CTransaction>& vtx)
+{
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+
+    txFrom.vout.resize(50);
+    for (unsigned int i = 0; i < txFrom.vout.size(); i++)
+    {
+        txFrom.vout[i].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+        txFrom.vout[i].nValue = COIN;
+    }
+
+    vtx.assign(5, CTransaction());
+    for (unsigned int t = 0; t < vtx.size(); t++)
+    {
+        vtx[t].vin.resize(10);
+        vtx[t].vout.resize(1);
+        vtx[t].vout[0].nValue = COIN;
+        for (unsigned int i = 0; i < vtx[t].vin.size(); i++)
+        {
+            vtx[t].vin[i].prevout.hash = txFrom.GetHash();
+            vtx[t].vin[i].prevout.n = t * 10 + i;
+            BOOST_CHECK(SignSignature(keystore, txFrom, vtx[t], i));
+        }
+    }
+}
+
+static vector<int> GetDoS(const vector<CTransaction>& vtx)
+{
+    vector<int> vDoS;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        vDoS.push_back(tx.nDoS);
+    return vDoS;
+}
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+BOOST_AUTO_TEST_CASE(checkqueue_matches_serial)
+{
+    // Several spending transactions, with one bad signature in the last one
+    CTransaction txFrom;
+    vector<CTransaction> vtx;
+    SignedTransactions(txFrom, vtx);
+
+    for (int nBad = 0; nBad < 2; nBad++)
+    {
+        if (nBad)
+            vtx[4].vin[3].scriptSig = vtx[4].vin[2].scriptSig;
+
+        vector<CScriptCheck> vChecks;
+        bool fSerial = true;
+        BOOST_FOREACH(const CTransaction& tx, vtx)
+        {
+            for (unsigned int i = 0; i < tx.vin.size(); i++)
+            {
+                bool fOk = VerifySignature(txFrom, tx, i, STANDARD_SCRIPT_VERIFY_FLAGS | SCRIPT_VERIFY_NOCACHE, 0);
+                CScriptCheck check(txFrom, tx, i, STANDARD_SCRIPT_VERIFY_FLAGS | SCRIPT_VERIFY_NOCACHE, 0);
+                BOOST_CHECK_EQUAL(check(), fOk);
+                fSerial &= fOk;
+                vChecks.push_back(check);
+            }
+        }
+        BOOST_CHECK_EQUAL(fSerial, nBad == 0);
+
+        for (int nThreads = 0; nThreads <= 4; nThreads++)
+            BOOST_CHECK_EQUAL(RunParallel(vChecks, nThreads), fSerial);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_reports_first_failure)
+{
+    CTransaction txFrom;
+    vector<CTransaction> vtx;
+    SignedTransactions(txFrom, vtx);
+
+    // Bad signatures in the second and the last transaction, more of them
+    // in the last one so a worker is likely to find one of those first
+    vtx[1].vin[6].scriptSig = vtx[1].vin[5].scriptSig;
+    for (unsigned int i = 1; i < vtx[4].vin.size(); i++)
+        vtx[4].vin[i].scriptSig = vtx[4].vin[0].scriptSig;
+
+    unsigned int flags = MANDATORY_SCRIPT_VERIFY_FLAGS | SCRIPT_VERIFY_NOCACHE;
+    vector<CScriptCheck> vChecks;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+            vChecks.push_back(CScriptCheck(txFrom, tx, i, flags, 0));
+
+    // Serial validation stops at the first failure and scores it
+    vector<CScriptCheck>::const_iterator itSerial = vChecks.begin();
+    while (itSerial != vChecks.end() && (*itSerial)())
+        ++itSerial;
+    BOOST_REQUIRE(itSerial != vChecks.end());
+    BOOST_CHECK(itSerial->GetTx() == &vtx[1]);
+    BOOST_CHECK_EQUAL(itSerial->GetIn(), 6U);
+    BOOST_CHECK(!itSerial->Invalid());
+    vector<int> vDoSSerial = GetDoS(vtx);
+    BOOST_CHECK_EQUAL(vDoSSerial[1], 100);
+
+    for (int nThreads = 0; nThreads <= 4; nThreads++)
+    {
+        for (int nRun = 0; nRun < 10; nRun++)
+        {
+            BOOST_FOREACH(CTransaction& tx, vtx)
+                tx.nDoS = 0;
+
+            CScriptCheck checkFailed;
+            BOOST_CHECK(!RunParallel(vChecks, nThreads, &checkFailed));
+            BOOST_REQUIRE(checkFailed.GetTx() != NULL);
+            BOOST_CHECK(checkFailed.GetTx() == itSerial->GetTx());
+            BOOST_CHECK_EQUAL(checkFailed.GetIn(), itSerial->GetIn());
+            BOOST_CHECK(!checkFailed.Invalid());
+            BOOST_CHECK(GetDoS(vtx) == vDoSSerial);
+        }
+    }
+
+    // Nothing is reported back when all checks pass
+    vChecks.erase(vChecks.begin() + 10, vChecks.end());
+    CScriptCheck checkFailed;
+    BOOST_CHECK(RunParallel(vChecks, 2, &checkFailed));
+    BOOST_CHECK(checkFailed.GetTx() == NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
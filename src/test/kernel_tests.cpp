@@ -0,0 +1,103 @@
+#include <boost/test/unit_test.hpp>
+
+#include <limits>
+#include <vector>
+
+#include "kernel.h"
+#include "main.h"
+
+using namespace std;
+
+// What SearchStakeKernels() should find for candidate, trying one timestamp
+// at a time through CheckStakeKernelHash()
+static int64_t SearchStakeKernelSlow(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, int64_t nSearchInterval, const CStakeCandidate& candidate)
+{
+    if (candidate.IsNull())
+        return 0;
+
+    CBlock blockFrom;
+    blockFrom.nTime = candidate.nBlockTime;
+    CTransaction txPrev;
+    txPrev.nTime = candidate.nTimeTxPrev;
+    txPrev.vout.resize(candidate.prevout.n + 1);
+    txPrev.vout[candidate.prevout.n].nValue = candidate.nValue;
+
+    for (int64_t n = 0; n < nSearchInterval; n++)
+    {
+        unsigned int nTimeTx = nTime - n;
+        if (nTimeTx < candidate.nTimeTxPrev)
+            break;
+        uint256 hashProofOfStake, targetProofOfStake;
+        if (CheckStakeKernelHash(pindexPrev, nBits, blockFrom, 0, txPrev, candidate.prevout, nTimeTx, hashProofOfStake, targetProofOfStake))
+            return nTimeTx;
+    }
+    return 0;
+}
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+BOOST_AUTO_TEST_CASE(search_stake_kernels_matches_check)
+{
+    static const int64_t nSearchInterval = 60;
+
+    // More candidates than one thread takes, so the search is split up
+    int nOldStakeThreads = nStakeThreads;
+    nStakeThreads = 4;
+
+    CBlockIndex indexPrev;
+    indexPrev.nHeight = 10000;
+    indexPrev.nTime = 1500000000;
+
+    int nFound = 0, nNotFound = 0, nSaturated = 0;
+    for (int nRound = 0; nRound < 8; nRound++)
+    {
+        indexPrev.bnStakeModifierV2 = GetRandHash();
+        indexPrev.nStakeModifier = GetRand(std::numeric_limits<uint64_t>::max());
+
+        // Targets from hopeless to more than 256 bits once weighted
+        unsigned int nBits = ((0x19 + nRound) << 24) | (0x008000 + GetRand(0x7f8000));
+        int64_t nTime = indexPrev.nTime + 60 + GetRand(1000);
+
+        vector<CStakeCandidate> vCandidates(300);
+        for (unsigned int i = 0; i < vCandidates.size(); i++)
+        {
+            // Some stay null and are skipped
+            if (i % 50 == 7)
+                continue;
+            CStakeCandidate& candidate = vCandidates[i];
+            candidate.prevout = COutPoint(GetRandHash(), GetRand(3));
+            // Some are younger than part of the interval
+            candidate.nTimeTxPrev = nTime - GetRand(2 * nSearchInterval);
+            candidate.nBlockTime = candidate.nTimeTxPrev;
+            candidate.nHeight = GetRand(9000);
+            candidate.hashBlockFrom = GetRandHash();
+            // A few with nearly all the money, enough to saturate any target
+            candidate.nValue = i % 40 == 3 ? MAX_MONEY : 1 + GetRand(1000000 * COIN);
+        }
+
+        vector<int64_t> vTime;
+        SearchStakeKernels(&indexPrev, nBits, nTime, nSearchInterval, vCandidates, vTime);
+        BOOST_REQUIRE_EQUAL(vTime.size(), vCandidates.size());
+
+        CBigNum bnTargetPerCoin;
+        bnTargetPerCoin.SetCompact(nBits);
+        for (unsigned int i = 0; i < vCandidates.size(); i++)
+        {
+            int64_t nTimeExpected = SearchStakeKernelSlow(&indexPrev, nBits, nTime, nSearchInterval, vCandidates[i]);
+            BOOST_CHECK_EQUAL(vTime[i], nTimeExpected);
+            if (nTimeExpected != 0)
+                nFound++;
+            else
+                nNotFound++;
+            if (!vCandidates[i].IsNull() && (bnTargetPerCoin * CBigNum(vCandidates[i].nValue)).bitSize() > 256)
+                nSaturated++;
+        }
+    }
+    BOOST_CHECK(nFound > 0);
+    BOOST_CHECK(nNotFound > 0);
+    BOOST_CHECK(nSaturated > 0);
+
+    nStakeThreads = nOldStakeThreads;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,159 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+#include "json/json_spirit_utils.h"
+
+#include <string>
+#include <vector>
+
+#include "bignum.h"
+#include "key.h"
+#include "secp256k1.h"
+#include "uint256.h"
+#include "util.h"
+
+using namespace std;
+using namespace json_spirit;
+
+extern Array read_json(const std::string& filename);
+
+// Both implementations must agree on every signature, valid or not
+static void CheckBoth(const CPubKey& pubkey, const uint256& hash, const vector<unsigned char>& vchSig, bool fExpected)
+{
+    bool fOpenSSL = pubkey.VerifyOpenSSL(hash, vchSig);
+    bool fSecp256k1 = pubkey.VerifySecp256k1(hash, vchSig);
+    BOOST_CHECK_EQUAL(fOpenSSL, fExpected);
+    BOOST_CHECK_EQUAL(fSecp256k1, fOpenSSL);
+}
+
+static void CheckKey(const CKey& key)
+{
+    CPubKey pubkey = key.GetPubKey();
+    BOOST_CHECK(Secp256k1CheckPubKey(pubkey.begin(), pubkey.size()));
+
+    for (int i = 0; i < 4; i++)
+    {
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        CheckBoth(pubkey, hash, vchSig, true);
+
+        // Other message
+        uint256 hashOther = hash;
+        *hashOther.begin() ^= 1 << i;
+        CheckBoth(pubkey, hashOther, vchSig, false);
+
+        // Damaged r or s
+        vector<unsigned char> vchBad(vchSig);
+        vchBad[vchBad.size() - 1 - 8 * i] ^= 0x10;
+        CheckBoth(pubkey, hash, vchBad, false);
+
+        // High S is still valid to both
+        vector<unsigned char> vchHighS;
+        unsigned int nLenR = vchSig[3];
+        unsigned int nLenS = vchSig[5 + nLenR];
+        CBigNum bnOrder;
+        bnOrder.SetHex("FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEBAAEDCE6AF48A03BBFD25E8CD0364141");
+        vector<unsigned char> vchS(vchSig.begin() + 6 + nLenR, vchSig.begin() + 6 + nLenR + nLenS);
+        reverse(vchS.begin(), vchS.end());
+        CBigNum bnS;
+        bnS.setvch(vchS);
+        vector<unsigned char> vchHigh = (bnOrder - bnS).getvch();
+        reverse(vchHigh.begin(), vchHigh.end());
+        vchHighS.insert(vchHighS.end(), vchSig.begin(), vchSig.begin() + 4 + nLenR);
+        vchHighS.push_back(0x02);
+        vchHighS.push_back(vchHigh.size());
+        vchHighS.insert(vchHighS.end(), vchHigh.begin(), vchHigh.end());
+        vchHighS[1] = vchHighS.size() - 2;
+        CheckBoth(pubkey, hash, vchHighS, true);
+
+        // Trailing garbage and truncation
+        vector<unsigned char> vchLong(vchSig);
+        vchLong.push_back(0);
+        CheckBoth(pubkey, hash, vchLong, false);
+        vector<unsigned char> vchShort(vchSig.begin(), vchSig.end() - 1);
+        CheckBoth(pubkey, hash, vchShort, false);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(secp256k1_tests)
+
+BOOST_AUTO_TEST_CASE(secp256k1_vectors)
+{
+    // Sign with the private keys of the base58 vectors, in both encodings
+    Array tests = read_json("base58_keys_valid.json");
+    BOOST_FOREACH(Value& tv, tests)
+    {
+        Array test = tv.get_array();
+        if (test.size() < 3)
+            continue;
+        const Object &metadata = test[2].get_obj();
+        if (!find_value(metadata, "isPrivkey").get_bool())
+            continue;
+        vector<unsigned char> vchSecret = ParseHex(test[1].get_str());
+        for (int nCompressed = 0; nCompressed < 2; nCompressed++)
+        {
+            CKey key;
+            key.Set(vchSecret.begin(), vchSecret.end(), nCompressed == 1);
+            BOOST_CHECK(key.IsValid());
+            CheckKey(key);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_random)
+{
+    for (int i = 0; i < 64; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        CheckKey(key);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_pubkey_encodings)
+{
+    CKey key;
+    key.MakeNewKey(false);
+    uint256 hash = GetRandHash();
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+
+    CPubKey pubkey = key.GetPubKey();
+    vector<unsigned char> vch(pubkey.begin(), pubkey.end());
+    bool fOdd = vch[64] & 1;
+
+    // Hybrid encoding, with the right and the wrong parity in the header
+    vch[0] = fOdd ? 0x07 : 0x06;
+    CheckBoth(CPubKey(vch), hash, vchSig, true);
+    vch[0] = fOdd ? 0x06 : 0x07;
+    CheckBoth(CPubKey(vch), hash, vchSig, false);
+    BOOST_CHECK(!Secp256k1CheckPubKey(&vch[0], vch.size()));
+
+    // Off the curve
+    vch[0] = 0x04;
+    vch[64] ^= 1;
+    CheckBoth(CPubKey(vch), hash, vchSig, false);
+    BOOST_CHECK(!Secp256k1CheckPubKey(&vch[0], vch.size()));
+
+    // x = p - 1 has no point on the curve, x = p is out of range
+    vector<unsigned char> vchCompressed = ParseHex("02FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEFFFFFC2E");
+    BOOST_CHECK(!Secp256k1CheckPubKey(&vchCompressed[0], vchCompressed.size()));
+    BOOST_CHECK(!CPubKey(vchCompressed).IsFullyValid());
+    vchCompressed = ParseHex("02FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEFFFFFC2F");
+    BOOST_CHECK(!Secp256k1CheckPubKey(&vchCompressed[0], vchCompressed.size()));
+
+    // Zero and out of range r and s
+    unsigned char zero[32], order[32], one[32];
+    memset(zero, 0, sizeof(zero));
+    memset(one, 0, sizeof(one));
+    one[31] = 1;
+    vector<unsigned char> vchOrder = ParseHex("FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEBAAEDCE6AF48A03BBFD25E8CD0364141");
+    memcpy(order, &vchOrder[0], sizeof(order));
+    pubkey = key.GetPubKey();
+    BOOST_CHECK(!Secp256k1Verify(pubkey.begin(), pubkey.size(), (const unsigned char*)&hash, zero, one));
+    BOOST_CHECK(!Secp256k1Verify(pubkey.begin(), pubkey.size(), (const unsigned char*)&hash, one, zero));
+    BOOST_CHECK(!Secp256k1Verify(pubkey.begin(), pubkey.size(), (const unsigned char*)&hash, order, one));
+    BOOST_CHECK(!Secp256k1Verify(pubkey.begin(), pubkey.size(), (const unsigned char*)&hash, one, order));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,135 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "main.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+// Old script.cpp SignatureHash function, copying and modifying the transaction
+static uint256 SignatureHashOld(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    if (nIn >= txTo.vin.size())
+        return 1;
+    CTransaction txTmp(txTo);
+
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+        txTmp.vin[i].scriptSig = CScript();
+    txTmp.vin[nIn].scriptSig = scriptCode;
+
+    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    {
+        txTmp.vout.clear();
+        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    {
+        unsigned int nOut = nIn;
+        if (nOut >= txTmp.vout.size())
+            return 1;
+        txTmp.vout.resize(nOut+1);
+        for (unsigned int i = 0; i < nOut; i++)
+            txTmp.vout[i].SetNull();
+        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+
+    if (nHashType & SIGHASH_ANYONECANPAY)
+    {
+        txTmp.vin[0] = txTmp.vin[nIn];
+        txTmp.vin.resize(1);
+    }
+
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTmp << nHashType;
+    return ss.GetHash();
+}
+
+static void RandomScript(CScript &script)
+{
+    static const opcodetype oplist[] = {OP_FALSE, OP_1, OP_2, OP_3, OP_CHECKSIG, OP_IF, OP_VERIF, OP_RETURN, OP_CODESEPARATOR};
+    script = CScript();
+    int ops = GetRand(10);
+    for (int i = 0; i < ops; i++)
+        script << oplist[GetRand(sizeof(oplist)/sizeof(oplist[0]))];
+}
+
+static void RandomTransaction(CTransaction &tx, bool fSingle)
+{
+    tx.nVersion = GetRand(2) + 1;
+    tx.nTime = GetRand(0x7fffffff);
+    tx.vin.clear();
+    tx.vout.clear();
+    tx.nLockTime = GetRand(2) ? GetRand(0xffffffff) : 0;
+    int ins = GetRand(12) + 1;
+    int outs = fSingle ? ins : GetRand(4) + 1;
+    for (int in = 0; in < ins; in++)
+    {
+        tx.vin.push_back(CTxIn());
+        CTxIn &txin = tx.vin.back();
+        txin.prevout.hash = GetRandHash();
+        txin.prevout.n = GetRand(4);
+        RandomScript(txin.scriptSig);
+        txin.nSequence = GetRand(2) ? GetRand(0xffffffff) : (unsigned int)-1;
+    }
+    for (int out = 0; out < outs; out++)
+    {
+        tx.vout.push_back(CTxOut());
+        CTxOut &txout = tx.vout.back();
+        txout.nValue = GetRand(100000000);
+        RandomScript(txout.scriptPubKey);
+        txout.nUnlockHeight = GetRand(2) ? GetRand(1000000) : 0;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(sighash_tests)
+
+BOOST_AUTO_TEST_CASE(sighash_test)
+{
+    static const int vHashTypes[] = {0, SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE, 4,
+                                     SIGHASH_ALL | SIGHASH_ANYONECANPAY, SIGHASH_NONE | SIGHASH_ANYONECANPAY,
+                                     SIGHASH_SINGLE | SIGHASH_ANYONECANPAY};
+
+    for (int i = 0; i < 500; i++)
+    {
+        CTransaction txTo;
+        RandomTransaction(txTo, (i % 4) == 0);
+        CSigHashCache cache(txTo);
+
+        for (unsigned int nIn = 0; nIn < txTo.vin.size(); nIn++)
+        {
+            CScript scriptCode;
+            RandomScript(scriptCode);
+            BOOST_FOREACH(int nHashType, vHashTypes)
+            {
+                uint256 sho = SignatureHashOld(scriptCode, txTo, nIn, nHashType);
+                BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashType) == sho);
+                BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashType, &cache) == sho);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sighash_cache_ignores_scriptsigs)
+{
+    // Signing fills in scriptSigs, which the cache never looks at
+    CTransaction txTo;
+    RandomTransaction(txTo, false);
+    CSigHashCache cache(txTo);
+    for (unsigned int nIn = 0; nIn < txTo.vin.size(); nIn++)
+    {
+        RandomScript(txTo.vin[nIn].scriptSig);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+        BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, SIGHASH_ALL, &cache) == SignatureHashOld(scriptCode, txTo, nIn, SIGHASH_ALL));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
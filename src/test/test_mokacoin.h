@@ -0,0 +1,43 @@
+#ifndef BITCOIN_TEST_TEST_MOKACOIN_H
+#define BITCOIN_TEST_TEST_MOKACOIN_H
+
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+#include "blockfile.h"
+#include "util.h"
+
+// Point the data directory at a fresh temporary directory for the test, and
+// remove it afterwards
+struct TempDataDirSetup
+{
+    boost::filesystem::path pathTemp;
+    std::string strOldDataDir;
+    bool fHadDataDir;
+
+    TempDataDirSetup()
+    {
+        fHadDataDir = mapArgs.count("-datadir");
+        if (fHadDataDir)
+            strOldDataDir = mapArgs["-datadir"];
+        pathTemp = boost::filesystem::temp_directory_path() / strprintf("test_mokacoin_%lu_%d", (unsigned long)GetTime(), (int)GetRand(100000));
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+        ClearDatadirCache();
+        CloseBlockFiles();
+    }
+
+    ~TempDataDirSetup()
+    {
+        CloseBlockFiles();
+        if (fHadDataDir)
+            mapArgs["-datadir"] = strOldDataDir;
+        else
+            mapArgs.erase("-datadir");
+        ClearDatadirCache();
+        boost::filesystem::remove_all(pathTemp);
+    }
+};
+
+#endif // BITCOIN_TEST_TEST_MOKACOIN_H
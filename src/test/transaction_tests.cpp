@@ -0,0 +1,105 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+static CTransaction RandomTransaction(int nIns, int nOuts)
+{
+    CTransaction tx;
+    tx.nTime = GetRand(0x7fffffff);
+    for (int i = 0; i < nIns; i++)
+    {
+        CTxIn txin(GetRandHash(), GetRand(4));
+        txin.scriptSig << vector<unsigned char>(72, 0x30) << vector<unsigned char>(33, 0x02);
+        tx.vin.push_back(txin);
+    }
+    for (int i = 0; i < nOuts; i++)
+    {
+        CScript script;
+        script << OP_DUP << OP_HASH160 << vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+        tx.vout.push_back(CTxOut(GetRand(100000000), script, 0));
+    }
+    return tx;
+}
+
+static uint256 UncachedHash(const CTransaction& tx)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << tx.nVersion << tx.nTime << tx.vin << tx.vout << tx.nLockTime;
+    return ss.GetHash();
+}
+
+BOOST_AUTO_TEST_SUITE(transaction_tests)
+
+BOOST_AUTO_TEST_CASE(transaction_cache)
+{
+    CTransaction tx = RandomTransaction(3, 2);
+    uint256 hash = tx.GetHash();
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(hash == UncachedHash(tx));
+
+    // Copies carry the cache along, and agree with a fresh computation
+    CTransaction txCopy(tx);
+    BOOST_CHECK(txCopy.GetHash() == hash);
+    BOOST_CHECK_EQUAL(::GetSerializeSize(txCopy, SER_DISK, CLIENT_VERSION), nSize);
+
+    // A change is not seen until the cache is invalidated
+    txCopy.vin[0].scriptSig << OP_1;
+    BOOST_CHECK(txCopy.GetHash() == hash);
+    txCopy.InvalidateCache();
+    BOOST_CHECK(txCopy.GetHash() != hash);
+    BOOST_CHECK(txCopy.GetHash() == UncachedHash(txCopy));
+    BOOST_CHECK_EQUAL(::GetSerializeSize(txCopy, SER_NETWORK, PROTOCOL_VERSION), nSize + 1);
+
+    // Assignment and deserialization replace the cached values
+    txCopy = tx;
+    BOOST_CHECK(txCopy.GetHash() == hash);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    BOOST_CHECK_EQUAL(ss.size(), nSize);
+    txCopy.vout[0].nValue++;
+    txCopy.InvalidateCache();
+    ss << txCopy;
+    CTransaction txRead;
+    ss >> txRead;
+    BOOST_CHECK(txRead.GetHash() == hash);
+    ss >> txRead;
+    BOOST_CHECK(txRead.GetHash() == UncachedHash(txCopy));
+
+    txRead.SetNull();
+    BOOST_CHECK(txRead.GetHash() == UncachedHash(txRead));
+}
+
+BOOST_AUTO_TEST_CASE(transaction_cache_bench)
+{
+    // Block connection asks for every hash several times: merkle root,
+    // duplicate check, inputs, index update and the wallet notification.
+    static const int nHashesPerTx = 5;
+    vector<CTransaction> vtx;
+    for (int i = 0; i < 500; i++)
+        vtx.push_back(RandomTransaction(1 + GetRand(4), 1 + GetRand(3)));
+
+    int64_t nStart = GetTimeMicros();
+    uint256 hashUncached = 0;
+    for (int n = 0; n < nHashesPerTx; n++)
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            hashUncached ^= UncachedHash(vtx[i]);
+    int64_t nUncached = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    uint256 hashCached = 0;
+    for (int n = 0; n < nHashesPerTx; n++)
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            hashCached ^= vtx[i].GetHash();
+    int64_t nCached = GetTimeMicros() - nStart;
+
+    BOOST_CHECK(hashCached == hashUncached);
+    BOOST_TEST_MESSAGE(strprintf("%u transactions, %d hashes each: %dus uncached, %dus cached",
+                                 vtx.size(), nHashesPerTx, nUncached, nCached));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
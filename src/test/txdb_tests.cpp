@@ -0,0 +1,433 @@
+#include <boost/test/unit_test.hpp>
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "blockfile.h"
+#include "chainparams.h"
+#include "main.h"
+#include "test_mokacoin.h"
+#include "txdb.h"
+#include "util.h"
+
+using namespace std;
+
+// Old CTxDB::ScanBatch, walking the whole batch for every lookup
+class CBatchScanner : public leveldb::WriteBatch::Handler {
+public:
+    std::string needle;
+    bool *deleted;
+    std::string *foundValue;
+    bool foundEntry;
+
+    CBatchScanner() : foundEntry(false) {}
+
+    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
+        if (key.ToString() == needle) {
+            foundEntry = true;
+            *deleted = false;
+            *foundValue = value.ToString();
+        }
+    }
+
+    virtual void Delete(const leveldb::Slice& key) {
+        if (key.ToString() == needle) {
+            foundEntry = true;
+            *deleted = true;
+        }
+    }
+};
+
+static bool ScanBatchOld(const leveldb::WriteBatch& batch, const string& key, string* value, bool* deleted)
+{
+    *deleted = false;
+    CBatchScanner scanner;
+    scanner.needle = key;
+    scanner.deleted = deleted;
+    scanner.foundValue = value;
+    BOOST_CHECK(batch.Iterate(&scanner).ok());
+    return scanner.foundEntry;
+}
+
+static string TxIndexKey(const uint256& hash)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << make_pair(string("tx"), hash);
+    return ssKey.str();
+}
+
+// Also forgets the block index and closes the database in the temporary
+// directory before it is removed
+struct BlockIndexTestSetup : public TempDataDirSetup
+{
+    ~BlockIndexTestSetup();
+};
+
+// Forget the block index in memory, as a restart would. Entries made by the
+// test are owned by it, loaded ones by the loader.
+static void UnloadBlockIndex()
+{
+    LOCK(cs_main);
+    chainActive.SetTip(NULL);
+    mapBlockIndex.clear();
+    mapBlockIndexByPos.clear();
+    setStakeSeen.clear();
+    pindexGenesisBlock = NULL;
+    pindexBest = NULL;
+    hashBestChain = 0;
+    nBestHeight = 0;
+    nBestChainTrust = 0;
+}
+
+BlockIndexTestSetup::~BlockIndexTestSetup()
+{
+    UnloadBlockIndex();
+    CTxDB("r").Close();
+}
+
+// Add a block index entry on top of pindexPrev, stored at position nPos of
+// block file 1, to memory and to the database
+static CBlockIndex* AddTestBlockIndex(CTxDB& txdb, list<CBlockIndex>& lBlocks, CBlockIndex* pindexPrev, unsigned int nPos)
+{
+    CBlock block;
+    block.nVersion = 7;
+    block.hashPrevBlock = pindexPrev ? pindexPrev->GetBlockHash() : 0;
+    block.nTime = 1400000000 + nPos;
+    block.nBits = 0x1e0fffff;
+    block.nNonce = nPos;
+    lBlocks.push_back(CBlockIndex(1, nPos, block));
+    CBlockIndex* pindex = &lBlocks.back();
+    pindex->hashBlock = block.GetHash();
+    pindex->phashBlock = &pindex->hashBlock;
+    pindex->pprev = pindexPrev;
+    pindex->nHeight = pindexPrev ? pindexPrev->nHeight + 1 : 0;
+    pindex->nChainTrust = (pindexPrev ? pindexPrev->nChainTrust : 0) + pindex->GetBlockTrust();
+    pindex->BuildSkip();
+    {
+        LOCK(cs_main);
+        mapBlockIndex.insert(make_pair(pindex->hashBlock, pindex));
+        mapBlockIndexByPos[make_pair(pindex->nFile, pindex->nBlockPos)] = pindex;
+    }
+
+    BOOST_REQUIRE(txdb.TxnBegin());
+    BOOST_REQUIRE(txdb.AddBlockIndex(CDiskBlockIndex(pindex)));
+    BOOST_REQUIRE(txdb.TxnCommit());
+    return pindex;
+}
+
+static void SetTestBestChain(CTxDB& txdb, CBlockIndex* pindex)
+{
+    BOOST_REQUIRE(txdb.WriteHashBestChain(pindex->GetBlockHash()));
+    LOCK(cs_main);
+    hashBestChain = pindex->GetBlockHash();
+    pindexBest = pindex;
+    nBestHeight = pindex->nHeight;
+    nBestChainTrust = pindex->nChainTrust;
+}
+
+static void ReloadBlockIndex(CTxDB& txdb)
+{
+    UnloadBlockIndex();
+    LOCK(cs_main);
+    BOOST_REQUIRE(txdb.LoadBlockIndex());
+}
+
+// Mine a proof-of-work block on the best chain and process it, returns the
+// hash of its coinbase
+static uint256 MineTestBlock()
+{
+    LOCK(cs_main);
+    CBlock block;
+    block.nVersion = CBlock::CURRENT_VERSION;
+    block.hashPrevBlock = hashBestChain;
+    block.nTime = pindexBest->GetPastTimeLimit() + 1;
+    block.nBits = GetNextTargetRequired(pindexBest, false);
+
+    CTransaction txCoinBase;
+    txCoinBase.nTime = block.nTime;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vin[0].scriptSig = CScript() << (nBestHeight + 1) << OP_0;
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    txCoinBase.vout[0].nValue = GetProofOfWorkReward(0);
+    block.vtx.push_back(txCoinBase);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    while (!CheckProofOfWork(block.GetPoWHash(), block.nBits))
+        block.nNonce++;
+    BOOST_REQUIRE(ProcessBlock(NULL, &block));
+    BOOST_REQUIRE(hashBestChain == block.GetHash());
+    return txCoinBase.GetHash();
+}
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+BOOST_AUTO_TEST_CASE(batch_overlay_matches_scan)
+{
+    leveldb::WriteBatch batch;
+    CBatchOverlay overlay;
+    vector<string> vKeys;
+    for (int i = 0; i < 50; i++)
+        vKeys.push_back(TxIndexKey(GetRandHash()));
+
+    for (int n = 0; n < 2000; n++)
+    {
+        const string& key = vKeys[GetRand(vKeys.size())];
+        if (GetRand(3) == 0)
+        {
+            batch.Delete(key);
+            overlay.Delete(key);
+        }
+        else
+        {
+            string value = strprintf("%d", n);
+            batch.Put(key, value);
+            overlay.Put(key, value);
+        }
+
+        // Every key, including ones never written, must look the same both ways
+        if (n % 100 == 0)
+        {
+            BOOST_FOREACH(const string& keyCheck, vKeys)
+            {
+                string valueOld, valueNew;
+                bool fDeletedOld, fDeletedNew = false;
+                bool fFoundOld = ScanBatchOld(batch, keyCheck, &valueOld, &fDeletedOld);
+                bool fFoundNew = overlay.Find(keyCheck, &valueNew, &fDeletedNew);
+                BOOST_CHECK_EQUAL(fFoundOld, fFoundNew);
+                if (fFoundOld && fFoundNew)
+                {
+                    BOOST_CHECK_EQUAL(fDeletedOld, fDeletedNew);
+                    if (!fDeletedOld)
+                        BOOST_CHECK_EQUAL(valueOld, valueNew);
+                }
+            }
+        }
+    }
+
+    overlay.Clear();
+    string value;
+    bool fDeleted;
+    BOOST_CHECK(!overlay.Find(vKeys[0], &value, &fDeleted));
+}
+
+BOOST_AUTO_TEST_CASE(batch_overlay_reorg_bench)
+{
+    // A reorganization disconnects and connects blocks in one transaction:
+    // every block updates the spent flags of its inputs (read, then write) and
+    // writes or erases the index entry of each of its transactions.
+    static const int nBlocks = 500;
+    static const int nTxPerBlock = 10;
+    static const int nInPerTx = 2;
+
+    vector<string> vKeys;
+    for (int i = 0; i < nBlocks * nTxPerBlock; i++)
+        vKeys.push_back(TxIndexKey(GetRandHash()));
+    string value(80, 'x');
+
+    for (int fOverlay = 0; fOverlay < 2; fOverlay++)
+    {
+        leveldb::WriteBatch batch;
+        CBatchOverlay overlay;
+        int64_t nStart = GetTimeMicros();
+        unsigned int nFound = 0;
+        for (int nBlock = 0; nBlock < nBlocks; nBlock++)
+        {
+            for (int nTx = 0; nTx < nTxPerBlock; nTx++)
+            {
+                int nKey = nBlock * nTxPerBlock + nTx;
+                for (int nIn = 0; nIn < nInPerTx && nKey > 0; nIn++)
+                {
+                    const string& keyPrev = vKeys[GetRand(nKey)];
+                    string valuePrev;
+                    bool fDeleted;
+                    if (fOverlay ? overlay.Find(keyPrev, &valuePrev, &fDeleted) : ScanBatchOld(batch, keyPrev, &valuePrev, &fDeleted))
+                        nFound++;
+                    batch.Put(keyPrev, value);
+                    if (fOverlay)
+                        overlay.Put(keyPrev, value);
+                }
+                batch.Put(vKeys[nKey], value);
+                if (fOverlay)
+                    overlay.Put(vKeys[nKey], value);
+            }
+        }
+        int64_t nElapsed = GetTimeMicros() - nStart;
+        BOOST_CHECK(nFound > 0);
+        BOOST_TEST_MESSAGE(strprintf("%d block reorganization, %d reads in one batch: %dms %s",
+                                     nBlocks, nBlocks * nTxPerBlock * nInPerTx, nElapsed / 1000,
+                                     fOverlay ? "with overlay" : "scanning the batch"));
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(blockindex_snapshot_keeps_side_branches, BlockIndexTestSetup)
+{
+    CTxDB txdb("cr+");
+    list<CBlockIndex> lBlocks;
+
+    // A best chain of five blocks, saved in a snapshot
+    vector<uint256> vMain;
+    CBlockIndex* pindex = NULL;
+    for (unsigned int i = 0; i < 5; i++)
+    {
+        pindex = AddTestBlockIndex(txdb, lBlocks, pindex, 100 + i);
+        vMain.push_back(pindex->GetBlockHash());
+    }
+    SetTestBestChain(txdb, pindex);
+    BOOST_REQUIRE(WriteBlockIndexSnapshot());
+
+    // A block connected afterwards is found by walking back the best chain
+    pindex = AddTestBlockIndex(txdb, lBlocks, pindex, 105);
+    vMain.push_back(pindex->GetBlockHash());
+    SetTestBestChain(txdb, pindex);
+    ReloadBlockIndex(txdb);
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), 6U);
+    BOOST_CHECK(hashBestChain == vMain[5]);
+    for (unsigned int i = 0; i < vMain.size(); i++)
+    {
+        BOOST_REQUIRE(mapBlockIndex.count(vMain[i]));
+        BOOST_CHECK_EQUAL(mapBlockIndex[vMain[i]]->nHeight, (int)i);
+    }
+
+    // A block on a side branch isn't, the database has to be read instead
+    pindex = AddTestBlockIndex(txdb, lBlocks, mapBlockIndex[vMain[2]], 200);
+    uint256 hashFork = pindex->GetBlockHash();
+    ReloadBlockIndex(txdb);
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), 7U);
+    BOOST_CHECK(hashBestChain == vMain[5]);
+    BOOST_REQUIRE(mapBlockIndex.count(hashFork));
+    BOOST_CHECK(mapBlockIndex[hashFork]->pprev == mapBlockIndex[vMain[2]]);
+    BOOST_CHECK(mapBlockIndex[hashFork]->pnext == NULL);
+    BOOST_CHECK(FindBlockByPos(1, 200) == mapBlockIndex[hashFork]);
+
+    // Once a snapshot has it, it comes back from the snapshot too
+    BOOST_REQUIRE(WriteBlockIndexSnapshot());
+    ReloadBlockIndex(txdb);
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), 7U);
+    BOOST_REQUIRE(mapBlockIndex.count(hashFork));
+    BOOST_CHECK(mapBlockIndex[hashFork]->pprev == mapBlockIndex[vMain[2]]);
+    BOOST_CHECK(FindBlockByPos(1, 200) == mapBlockIndex[hashFork]);
+    BOOST_CHECK(mapBlockIndex[vMain[2]]->pnext == mapBlockIndex[vMain[3]]);
+}
+
+BOOST_FIXTURE_TEST_CASE(txindex_cache_caught_up_after_crash, BlockIndexTestSetup)
+{
+    SelectParams(CChainParams::REGTEST);
+    int64_t nOldCacheSize = nTxIndexCacheSize;
+    nTxIndexCacheSize = DEFAULT_TXINDEX_CACHE * 1048576;
+    BOOST_REQUIRE(LoadBlockIndex(true));
+
+    vector<uint256> vCoinBase;
+    for (int i = 0; i < 3; i++)
+        vCoinBase.push_back(MineTestBlock());
+    uint256 hashTip = hashBestChain;
+
+    // Nothing flushed yet: the entries are read from the cache, the
+    // transaction index on disk is still at the genesis block
+    {
+        CTxDB txdb("r");
+        CTxIndex txindex;
+        BOOST_FOREACH(const uint256& hash, vCoinBase)
+            BOOST_CHECK(txdb.ReadTxIndex(hash, txindex));
+        uint256 hashTxIndexBest;
+        BOOST_REQUIRE(txdb.ReadHashTxIndexBest(hashTxIndexBest));
+        BOOST_CHECK(hashTxIndexBest == 0);
+    }
+
+    // Crash: the cache is lost, the best chain in the database is not
+    DiscardTxIndexCache();
+    {
+        CTxDB txdb("r");
+        CTxIndex txindex;
+        BOOST_CHECK(!txdb.ReadTxIndex(vCoinBase[0], txindex));
+    }
+
+    // Loading again connects the three blocks to rebuild their entries
+    UnloadBlockIndex();
+    BOOST_REQUIRE(LoadBlockIndex(false));
+    BOOST_CHECK(hashBestChain == hashTip);
+    BOOST_CHECK_EQUAL(nBestHeight, 3);
+    {
+        CTxDB txdb("r");
+        CTxIndex txindex;
+        BOOST_FOREACH(const uint256& hash, vCoinBase)
+            BOOST_CHECK(txdb.ReadTxIndex(hash, txindex));
+        uint256 hashTxIndexBest;
+        BOOST_REQUIRE(txdb.ReadHashTxIndexBest(hashTxIndexBest));
+        BOOST_CHECK(hashTxIndexBest == hashTip);
+    }
+
+    // Still there once the cache is gone, it was flushed during the load
+    DiscardTxIndexCache();
+    {
+        CTxDB txdb("r");
+        CTxIndex txindex;
+        BOOST_FOREACH(const uint256& hash, vCoinBase)
+            BOOST_CHECK(txdb.ReadTxIndex(hash, txindex));
+    }
+
+    nTxIndexCacheSize = nOldCacheSize;
+    SelectParams(CChainParams::MAIN);
+}
+
+BOOST_FIXTURE_TEST_CASE(import_skips_truncated_record, BlockIndexTestSetup)
+{
+    SelectParams(CChainParams::REGTEST);
+    BOOST_REQUIRE(LoadBlockIndex(true));
+
+    vector<CBlock> vBlocks;
+    for (int i = 0; i < 3; i++)
+    {
+        MineTestBlock();
+        LOCK(cs_main);
+        vBlocks.push_back(CBlock());
+        BOOST_REQUIRE(vBlocks.back().ReadFromDisk(pindexBest));
+    }
+    uint256 hashTip = hashBestChain;
+
+    // Start over with only the genesis block
+    UnloadBlockIndex();
+    CTxDB("r").Close();
+    CloseBlockFiles();
+    boost::filesystem::remove_all(GetDataDir());
+    ClearDatadirCache();
+    BOOST_REQUIRE(LoadBlockIndex(true));
+    BOOST_CHECK_EQUAL(nBestHeight, 0);
+
+    // The second block is written twice, the first time cut off halfway
+    // with its full size in the header, so that record runs on into the
+    // complete copy
+    boost::filesystem::path pathBootstrap = pathTemp / "bootstrap.dat";
+    {
+        FILE* file = fopen(pathBootstrap.string().c_str(), "wb");
+        BOOST_REQUIRE(file != NULL);
+        CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+        for (unsigned int i = 0; i < vBlocks.size(); i++)
+        {
+            CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+            ssBlock << vBlocks[i];
+            unsigned int nSize = ssBlock.size();
+            fileout << FLATDATA(Params().MessageStart()) << nSize;
+            if (i == 1)
+            {
+                fileout.write(&ssBlock[0], nSize / 2);
+                fileout << FLATDATA(Params().MessageStart()) << nSize;
+            }
+            fileout.write(&ssBlock[0], nSize);
+        }
+    }
+
+    // The bad record is skipped by its message start only, the blocks
+    // inside it are still found
+    BOOST_REQUIRE(LoadExternalBlockFile(fopen(pathBootstrap.string().c_str(), "rb")));
+    BOOST_CHECK(hashBestChain == hashTip);
+    BOOST_CHECK_EQUAL(nBestHeight, 3);
+
+    SelectParams(CChainParams::MAIN);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -14,6 +14,11 @@
 #include <leveldb/filter_policy.h>
 #include <memenv/memenv.h>
 
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#include "blockfile.h"
 #include "kernel.h"
 #include "txdb.h"
 #include "util.h"
@@ -25,6 +30,149 @@ using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+int64_t nTxIndexCacheSize = DEFAULT_TXINDEX_CACHE * 1048576;
+
+// Write-back cache of the transaction index, shared by all CTxDB instances.
+//
+// With the cache enabled the txindex updates of a committed database
+// transaction become dirty cache entries, while the rest of it (block index,
+// hashBestChain) is written to LevelDB right away. A flush writes the dirty
+// entries in one batch together with hashTxIndexBest, the best chain the
+// transaction index on disk is in step with. After a crash hashBestChain can
+// be ahead of it, LoadBlockIndex() then connects the missing blocks again.
+struct CTxIndexCacheEntry
+{
+    CTxIndex txindex; // null if the transaction is not in the index
+    bool fDirty;
+};
+
+static CCriticalSection cs_txindexcache;
+static map<uint256, CTxIndexCacheEntry> mapTxIndexCache;
+static int64_t nTxIndexCacheUsage = 0;
+static bool fTxIndexCacheDirty = false;
+static int64_t nLastTxIndexCacheFlush = 0;
+static unsigned int nTxIndexCacheEvictions = 0; // bumped whenever entries are dropped
+
+// Block index entries in the database. The count is stored along with them,
+// so loading a snapshot can tell whether entries were added that walking back
+// the best chain doesn't find. Only changed with cs_main held, by commits
+// that added entries.
+static unsigned int nBlockIndexCount = 0;
+
+static int64_t TxIndexCacheUsage(const CTxIndex& txindex)
+{
+    return sizeof(uint256) + sizeof(CTxIndexCacheEntry) + 4 * sizeof(void*) + txindex.vSpent.capacity() * sizeof(CDiskTxPos);
+}
+
+static void SetTxIndexCacheEntry(const uint256& hash, const CTxIndex& txindex, bool fDirty)
+{
+    AssertLockHeld(cs_txindexcache);
+    map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxIndexCache.find(hash);
+    if (mi == mapTxIndexCache.end())
+        mi = mapTxIndexCache.insert(make_pair(hash, CTxIndexCacheEntry())).first;
+    else
+        nTxIndexCacheUsage -= TxIndexCacheUsage(mi->second.txindex);
+    mi->second.txindex = txindex;
+    mi->second.fDirty = fDirty;
+    nTxIndexCacheUsage += TxIndexCacheUsage(mi->second.txindex);
+    fTxIndexCacheDirty |= fDirty;
+}
+
+// Drop clean entries until the cache is down to nTarget bytes. Hashes are
+// random, so going through the map in order evicts random entries.
+static void TrimTxIndexCache(int64_t nTarget)
+{
+    AssertLockHeld(cs_txindexcache);
+    map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxIndexCache.begin();
+    if (nTxIndexCacheUsage > nTarget)
+        nTxIndexCacheEvictions++;
+    while (nTxIndexCacheUsage > nTarget && mi != mapTxIndexCache.end())
+    {
+        if (mi->second.fDirty)
+        {
+            ++mi;
+            continue;
+        }
+        nTxIndexCacheUsage -= TxIndexCacheUsage(mi->second.txindex);
+        mapTxIndexCache.erase(mi++);
+    }
+}
+
+static bool WriteTxIndexCache(leveldb::DB* pdb)
+{
+    AssertLockHeld(cs_txindexcache);
+    if (fTxIndexCacheDirty)
+    {
+        int64_t nStart = GetTimeMicros();
+        leveldb::WriteBatch batch;
+        unsigned int nWritten = 0;
+        for (map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxIndexCache.begin(); mi != mapTxIndexCache.end(); ++mi)
+        {
+            if (!mi->second.fDirty)
+                continue;
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey << make_pair(string("tx"), mi->first);
+            if (mi->second.txindex.IsNull())
+                batch.Delete(ssKey.str());
+            else
+            {
+                CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+                ssValue << mi->second.txindex;
+                batch.Put(ssKey.str(), ssValue.str());
+            }
+            nWritten++;
+        }
+
+        // Commits write their batch with cs_txindexcache held, so the
+        // cache now holds the transaction index for the hashBestChain on disk
+        CDataStream ssKeyBest(SER_DISK, CLIENT_VERSION);
+        ssKeyBest << string("hashBestChain");
+        string strBest;
+        leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKeyBest.str(), &strBest);
+        if (status.ok())
+        {
+            CDataStream ssKeyTxIndexBest(SER_DISK, CLIENT_VERSION);
+            ssKeyTxIndexBest << string("hashTxIndexBest");
+            batch.Put(ssKeyTxIndexBest.str(), strBest);
+        }
+        else if (!status.IsNotFound())
+            return error("WriteTxIndexCache() : LevelDB read failure: %s", status.ToString());
+
+        // The entries point into block data, which must be durable first
+        if (!SyncBlockFiles())
+            return error("WriteTxIndexCache() : SyncBlockFiles failed");
+
+        leveldb::WriteOptions options;
+        options.sync = true;
+        status = pdb->Write(options, &batch);
+        if (!status.ok())
+            return error("WriteTxIndexCache() : LevelDB write failure: %s", status.ToString());
+
+        for (map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxIndexCache.begin(); mi != mapTxIndexCache.end(); ++mi)
+            mi->second.fDirty = false;
+        LogPrint("txdb", "WriteTxIndexCache() : wrote %u txindex entries in %dms\n",
+                 nWritten, (GetTimeMicros() - nStart) / 1000);
+        fTxIndexCacheDirty = false;
+    }
+    nLastTxIndexCacheFlush = GetTime();
+    return true;
+}
+
+// Flush when the cache is full or has been dirty for too long
+static bool CheckTxIndexCache(leveldb::DB* pdb)
+{
+    AssertLockHeld(cs_txindexcache);
+    if (nLastTxIndexCacheFlush == 0)
+        nLastTxIndexCacheFlush = GetTime();
+    if (nTxIndexCacheUsage <= nTxIndexCacheSize &&
+        GetTime() - nLastTxIndexCacheFlush < TXINDEX_CACHE_FLUSH_INTERVAL)
+        return true;
+    if (!WriteTxIndexCache(pdb))
+        return false;
+    TrimTxIndexCache(nTxIndexCacheSize * 3 / 4);
+    return true;
+}
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
     int nCacheSizeMB = GetArg("-dbcache", 25);
@@ -74,6 +222,7 @@ CTxDB::CTxDB(const char* pszMode)
 {
     assert(pszMode);
     activeBatch = NULL;
+    nBlockIndexAddedTxn = 0;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
 
     if (txdb) {
@@ -127,6 +276,14 @@ CTxDB::CTxDB(const char* pszMode)
 
 void CTxDB::Close()
 {
+    if (pdb)
+    {
+        LOCK(cs_txindexcache);
+        WriteTxIndexCache(pdb);
+        mapTxIndexCache.clear();
+        nTxIndexCacheUsage = 0;
+        nTxIndexCacheEvictions++;
+    }
     delete txdb;
     txdb = pdb = NULL;
     delete options.filter_policy;
@@ -135,81 +292,164 @@ void CTxDB::Close()
     options.block_cache = NULL;
     delete activeBatch;
     activeBatch = NULL;
+    batchOverlay.Clear();
+    mapTxIndexTxn.clear();
+    nBlockIndexAddedTxn = 0;
+}
+
+bool FlushTxIndexCache()
+{
+    if (!txdb)
+        return true;
+    LOCK(cs_txindexcache);
+    return WriteTxIndexCache(txdb);
+}
+
+void DiscardTxIndexCache()
+{
+    LOCK(cs_txindexcache);
+    mapTxIndexCache.clear();
+    nTxIndexCacheUsage = 0;
+    fTxIndexCacheDirty = false;
+    nTxIndexCacheEvictions++;
 }
 
 bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
     activeBatch = new leveldb::WriteBatch();
+    batchOverlay.Clear();
+    mapTxIndexTxn.clear();
+    nBlockIndexAddedTxn = 0;
     return true;
 }
 
 bool CTxDB::TxnCommit()
 {
     assert(activeBatch);
+    // Not synced, like the block files it refers to: those are synced as a
+    // group by AppendBlockToFile, and again before a txindex cache flush
+    if (nTxIndexCacheSize > 0)
+    {
+        // The txindex updates wait in the cache for the next flush, the rest
+        // goes to disk now. Both with the lock held, so a flush never sees one
+        // without the other.
+        LOCK(cs_txindexcache);
+        leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
+        if (!status.ok())
+        {
+            TxnAbort();
+            return error("CTxDB::TxnCommit() : LevelDB batch commit failure: %s", status.ToString());
+        }
+        for (map<uint256, CTxIndex>::iterator mi = mapTxIndexTxn.begin(); mi != mapTxIndexTxn.end(); ++mi)
+            SetTxIndexCacheEntry(mi->first, mi->second, true);
+        if (nBlockIndexAddedTxn)
+            nBlockIndexCount += nBlockIndexAddedTxn;
+        TxnAbort();
+        return CheckTxIndexCache(pdb);
+    }
+
     leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
     delete activeBatch;
     activeBatch = NULL;
+    batchOverlay.Clear();
     if (!status.ok()) {
+        nBlockIndexAddedTxn = 0;
         LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
         return false;
     }
+    if (nBlockIndexAddedTxn)
+        nBlockIndexCount += nBlockIndexAddedTxn;
+    nBlockIndexAddedTxn = 0;
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
-        }
-    }
-
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
-        }
-    }
-};
-
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it. The overlay keeps
+// this a lookup instead of a walk over the whole batch.
 bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
     assert(activeBatch);
     *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
-    }
-    return scanner.foundEntry;
+    return batchOverlay.Find(key.str(), value, deleted);
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+    if (nTxIndexCacheSize <= 0)
+        return Read(make_pair(string("tx"), hash), txindex);
+
+    if (activeBatch)
+    {
+        map<uint256, CTxIndex>::iterator mi = mapTxIndexTxn.find(hash);
+        if (mi != mapTxIndexTxn.end())
+        {
+            txindex = mi->second;
+            return !txindex.IsNull();
+        }
+    }
+
+    unsigned int nEvictions;
+    {
+        LOCK(cs_txindexcache);
+        map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxIndexCache.find(hash);
+        if (mi != mapTxIndexCache.end())
+        {
+            txindex = mi->second.txindex;
+            return !txindex.IsNull();
+        }
+        nEvictions = nTxIndexCacheEvictions;
+    }
+
+    // Read without the lock, so readers don't wait for each other's disk reads
+    if (!Read(make_pair(string("tx"), hash), txindex))
+        txindex.SetNull();
+
+    LOCK(cs_txindexcache);
+    map<uint256, CTxIndexCacheEntry>::iterator mi = mapTxIndexCache.find(hash);
+    if (mi != mapTxIndexCache.end())
+    {
+        // Committed meanwhile
+        txindex = mi->second.txindex;
+        return !txindex.IsNull();
+    }
+    // If entries were dropped meanwhile, one of them may have been a newer
+    // version of this one, flushed after the read; don't cache what was read
+    if (nTxIndexCacheEvictions == nEvictions)
+    {
+        SetTxIndexCacheEntry(hash, txindex, false);
+        if (nTxIndexCacheUsage > nTxIndexCacheSize)
+            TrimTxIndexCache(nTxIndexCacheSize * 3 / 4);
+    }
+    return !txindex.IsNull();
+}
+
+// A null txindex erases the entry
+bool CTxDB::WriteTxIndex(const uint256& hash, const CTxIndex& txindex)
+{
+    if (nTxIndexCacheSize <= 0)
+    {
+        if (txindex.IsNull())
+            return Erase(make_pair(string("tx"), hash));
+        return Write(make_pair(string("tx"), hash), txindex);
+    }
+
+    if (fReadOnly)
+        assert(!"Write called on database in read-only mode");
+    if (activeBatch)
+    {
+        mapTxIndexTxn[hash] = txindex;
+        return true;
+    }
+    LOCK(cs_txindexcache);
+    SetTxIndexCacheEntry(hash, txindex, true);
+    return CheckTxIndexCache(pdb);
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
-    return Write(make_pair(string("tx"), hash), txindex);
+    return WriteTxIndex(hash, txindex);
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
@@ -217,18 +457,25 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    return WriteTxIndex(hash, txindex);
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
 {
     uint256 hash = tx.GetHash();
 
-    return Erase(make_pair(string("tx"), hash));
+    CTxIndex txindexNull;
+    txindexNull.SetNull();
+    return WriteTxIndex(hash, txindexNull);
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
+    if (nTxIndexCacheSize > 0)
+    {
+        CTxIndex txindex;
+        return ReadTxIndex(hash, txindex);
+    }
     return Exists(make_pair(string("tx"), hash));
 }
 
@@ -257,11 +504,50 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
     return ReadDiskTx(outpoint.hash, tx, txindex);
 }
 
+bool CTxDB::ReadBlockIndex(uint256 hash, CDiskBlockIndex& blockindex)
+{
+    return Read(make_pair(string("blockindex"), hash), blockindex);
+}
+
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
 }
 
+bool CTxDB::AddBlockIndex(const CDiskBlockIndex& blockindex)
+{
+    // Counted in the same transaction, see nBlockIndexCount
+    assert(activeBatch);
+    nBlockIndexAddedTxn++;
+    return WriteBlockIndex(blockindex) && Write(string("blockindexcount"), nBlockIndexCount + nBlockIndexAddedTxn);
+}
+
+bool CTxDB::ReadBlockIndexCount(unsigned int& nCount)
+{
+    return Read(string("blockindexcount"), nCount);
+}
+
+bool CTxDB::ReadBlockIndexSnapshotHash(uint256& hash)
+{
+    return Read(string("blockindexsnapshot"), hash);
+}
+
+bool CTxDB::WriteBlockIndexSnapshotHash(uint256 hash)
+{
+    // Straight to disk rather than through a transaction, the snapshot it
+    // names is already there
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << string("blockindexsnapshot");
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << hash;
+    leveldb::WriteOptions options;
+    options.sync = true;
+    leveldb::Status status = pdb->Put(options, ssKey.str(), ssValue.str());
+    if (!status.ok())
+        return error("CTxDB::WriteBlockIndexSnapshotHash() : LevelDB write failure: %s", status.ToString());
+    return true;
+}
+
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 {
     return Read(string("hashBestChain"), hashBestChain);
@@ -272,6 +558,31 @@ bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
     return Write(string("hashBestChain"), hashBestChain);
 }
 
+bool CTxDB::ReadHashTxIndexBest(uint256& hashTxIndexBest)
+{
+    return Read(string("hashTxIndexBest"), hashTxIndexBest);
+}
+
+// Normally written by the txindex cache flush, see WriteTxIndexCache()
+bool CTxDB::WriteHashTxIndexBest(uint256 hashTxIndexBest)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << string("hashTxIndexBest");
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << hashTxIndexBest;
+    leveldb::WriteOptions options;
+    options.sync = true;
+    leveldb::Status status = pdb->Put(options, ssKey.str(), ssValue.str());
+    if (!status.ok())
+        return error("CTxDB::WriteHashTxIndexBest() : LevelDB write failure: %s", status.ToString());
+    return true;
+}
+
+bool CTxDB::EraseHashTxIndexBest()
+{
+    return Erase(string("hashTxIndexBest"));
+}
+
 bool CTxDB::ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust)
 {
     return Read(string("bnBestInvalidTrust"), bnBestInvalidTrust);
@@ -282,13 +593,87 @@ bool CTxDB::WriteBestInvalidTrust(CBigNum bnBestInvalidTrust)
     return Write(string("bnBestInvalidTrust"), bnBestInvalidTrust);
 }
 
+// Most threads decoding the block index at startup
+static const int MAX_BLOCKINDEX_LOAD_THREADS = 8;
+
+// Block index entries loaded at startup, one contiguous arena per key range.
+// Entries are never freed, so the arenas live until the process exits.
+static vector<vector<CBlockIndex> > vBlockIndexArena;
+
+// What an entry refers to by hash, until the linking pass resolves it
+struct CBlockIndexLinks
+{
+    uint256 hashPrev;
+    uint256 hashNext;
+};
+
+// Decode the block index entries whose hash starts with a byte in
+// [nBegin, nEnd) into vIndex, computing their hashes and trust
+static void LoadBlockIndexRange(leveldb::DB* pdb, int nBegin, int nEnd, vector<CBlockIndex>* pvIndex,
+                                vector<CBlockIndexLinks>* pvLinks, volatile bool* pfAbort, volatile bool* pfError)
+{
+    // Keys are "blockindex" followed by the hash, which is serialized least
+    // significant byte first, so its first byte picks the key range
+    uint256 hashBegin = 0, hashEnd = 0;
+    *hashBegin.begin() = (unsigned char)nBegin;
+    *hashEnd.begin() = (unsigned char)nEnd;
+    CDataStream ssBeginKey(SER_DISK, CLIENT_VERSION);
+    ssBeginKey << make_pair(string("blockindex"), hashBegin);
+    string strBeginKey = ssBeginKey.str();
+    CDataStream ssEndKey(SER_DISK, CLIENT_VERSION);
+    ssEndKey << make_pair(string("blockindex"), hashEnd);
+    string strEndKey = ssEndKey.str();
+    // What all keys of the range start with
+    string strPrefix = strBeginKey.substr(0, strBeginKey.size() - sizeof(uint256));
+
+    leveldb::ReadOptions options;
+    options.fill_cache = false;
+    leveldb::Iterator *iterator = pdb->NewIterator(options);
+    try {
+        for (iterator->Seek(strBeginKey); iterator->Valid(); iterator->Next())
+        {
+            if (*pfAbort)
+                break;
+            leveldb::Slice key = iterator->key();
+            if (!key.starts_with(strPrefix) || (nEnd < 256 && key.compare(strEndKey) >= 0))
+                break;
+
+            leveldb::Slice value = iterator->value();
+            CDataStream ssValue(value.data(), value.data() + value.size(), SER_DISK, CLIENT_VERSION);
+            CDiskBlockIndex diskindex;
+            ssValue >> diskindex;
+
+            CBlockIndexLinks links;
+            links.hashPrev = diskindex.hashPrev;
+            links.hashNext = diskindex.hashNext;
+            pvLinks->push_back(links);
+
+            // Copies the block index part only, the links are resolved later.
+            // The cold fields are left behind, they are read again when needed.
+            pvIndex->push_back(diskindex);
+            CBlockIndex& index = pvIndex->back();
+            index.hashBlock = diskindex.GetBlockHash();
+            index.phashBlock = NULL;
+            index.pprev = NULL;
+            index.pnext = NULL;
+            // The trust of this block alone until the chain trust is summed up
+            index.nChainTrust = index.GetBlockTrust();
+        }
+    }
+    catch (std::exception &e) {
+        LogPrintf("LoadBlockIndexRange() : deserialize error: %s\n", e.what());
+        *pfError = true;
+    }
+    delete iterator;
+}
+
 static CBlockIndex *InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
@@ -296,100 +681,543 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
     CBlockIndex* pindexNew = new CBlockIndex();
     if (!pindexNew)
         throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
-    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
+    pindexNew->hashBlock = hash;
+    pindexNew->phashBlock = &pindexNew->hashBlock;
+    mapBlockIndex.insert(make_pair(hash, pindexNew));
 
     return pindexNew;
 }
 
-bool CTxDB::LoadBlockIndex()
+// Add a loaded entry to the lookups that are built along with mapBlockIndex
+static bool AddLoadedBlockIndex(CBlockIndex* pindexNew)
 {
-    if (mapBlockIndex.size() > 0) {
-        // Already loaded once in this session. It can happen during migration
-        // from BDB.
-        return true;
+    // Look up blocks by their position on disk
+    mapBlockIndexByPos[make_pair(pindexNew->nFile, pindexNew->nBlockPos)] = pindexNew;
+
+    // Watch for genesis block
+    if (pindexGenesisBlock == NULL && pindexNew->GetBlockHash() == Params().HashGenesisBlock())
+        pindexGenesisBlock = pindexNew;
+
+    if (!pindexNew->CheckIndex())
+        return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+
+    // NovaCoin: build setStakeSeen
+    if (pindexNew->IsProofOfStake())
+        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    return true;
+}
+
+// Read the whole block index out of the database
+static bool LoadBlockIndexScan(leveldb::DB* pdb)
+{
+    // Phase one decodes the entries in parallel, each thread taking a range of
+    // keys, into arenas of block index entries. Phase two then inserts them
+    // into mapBlockIndex and resolves the links between them in one pass.
+    int64_t nStart = GetTimeMillis();
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_BLOCKINDEX_LOAD_THREADS));
+    vBlockIndexArena.resize(nThreads);
+    vector<vector<CBlockIndexLinks> > vLinks(nThreads);
+    volatile bool fAbort = false;
+    volatile bool fError = false;
+    {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&LoadBlockIndexRange, pdb, i * 256 / nThreads, (i + 1) * 256 / nThreads,
+                                                  &vBlockIndexArena[i], &vLinks[i], &fAbort, &fError));
+        try {
+            threadGroup.join_all();
+        }
+        catch (boost::thread_interrupted&) {
+            // Don't leave the threads running on our stack
+            fAbort = true;
+            threadGroup.join_all();
+            throw;
+        }
     }
-    // The block index is an in-memory structure that maps hashes to on-disk
-    // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
+    if (fError)
+        return error("LoadBlockIndex() : failed to read the block index");
+    int64_t nDecoded = GetTimeMillis();
+
+    boost::this_thread::interruption_point();
+
+    // Phase two: index the entries by hash, then link them up
+    unsigned int nEntries = 0;
+    for (int i = 0; i < nThreads; i++)
+        nEntries += vBlockIndexArena[i].size();
+    mapBlockIndex.reserve(nEntries);
+    mapBlockIndexByPos.reserve(nEntries);
+    for (int i = 0; i < nThreads; i++)
     {
-        boost::this_thread::interruption_point();
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->bnStakeModifierV2 = diskindex.bnStakeModifierV2;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProof      = diskindex.hashProof;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+        vector<CBlockIndex>& vIndex = vBlockIndexArena[i];
+        for (unsigned int j = 0; j < vIndex.size(); j++)
+        {
+            CBlockIndex* pindexNew = &vIndex[j];
+            pindexNew->phashBlock = &pindexNew->hashBlock;
+            if (!mapBlockIndex.insert(make_pair(pindexNew->hashBlock, pindexNew)).second)
+                return error("LoadBlockIndex() : duplicate block index entry %s", pindexNew->hashBlock.ToString());
         }
+    }
 
-        // NovaCoin: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    int nMaxHeight = 0;
+    for (int i = 0; i < nThreads; i++)
+    {
+        vector<CBlockIndex>& vIndex = vBlockIndexArena[i];
+        for (unsigned int j = 0; j < vIndex.size(); j++)
+        {
+            CBlockIndex* pindexNew = &vIndex[j];
+            pindexNew->pprev = InsertBlockIndex(vLinks[i][j].hashPrev);
+            pindexNew->pnext = InsertBlockIndex(vLinks[i][j].hashNext);
 
-        iterator->Next();
+            if (!AddLoadedBlockIndex(pindexNew))
+                return false;
+
+            nMaxHeight = std::max(nMaxHeight, pindexNew->nHeight);
+        }
+        vector<CBlockIndexLinks>().swap(vLinks[i]);
     }
-    delete iterator;
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    // Calculate nChainTrust and build the skip pointers, visiting the blocks
+    // by height (counting sort). Entries only referred to by a link and not
+    // stored themselves were created by InsertBlockIndex and are left out,
+    // as they have no trust and no ancestors.
+    vector<unsigned int> vHeightStart(nMaxHeight + 2, 0);
+    for (int i = 0; i < nThreads; i++)
+        BOOST_FOREACH(const CBlockIndex& index, vBlockIndexArena[i])
+            vHeightStart[index.nHeight + 1]++;
+    for (int nHeight = 0; nHeight <= nMaxHeight; nHeight++)
+        vHeightStart[nHeight + 1] += vHeightStart[nHeight];
+    vector<CBlockIndex*> vSortedByHeight(nEntries);
+    for (int i = 0; i < nThreads; i++)
+        BOOST_FOREACH(CBlockIndex& index, vBlockIndexArena[i])
+            vSortedByHeight[vHeightStart[index.nHeight]++] = &index;
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
+    {
+        if (pindex->pprev)
+            pindex->nChainTrust += pindex->pprev->nChainTrust;
+        pindex->BuildSkip();
+    }
+
+    nBlockIndexCount = nEntries;
+
+    int64_t nLoaded = GetTimeMillis();
+    LogPrintf("LoadBlockIndex(): %u entries in %dms (%.0f entries/s), decoding %dms with %d threads, linking %dms\n",
+      nEntries, nLoaded - nStart, nEntries * 1000.0 / std::max((int64_t)1, nLoaded - nStart),
+      nDecoded - nStart, nThreads, nLoaded - nDecoded);
+    return true;
+}
+
+// One block index entry in the snapshot file. Only what CBlockIndex keeps in
+// memory is stored, the cold fields are read from the database when needed.
+// Every entry has the same size, so the file can be decoded in chunks.
+class CBlockIndexSnapshotEntry
+{
+public:
+    uint256 hashPrev;
+    CBlockIndex index;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(index.hashBlock);
+        READWRITE(hashPrev);
+        READWRITE(index.nFile);
+        READWRITE(index.nBlockPos);
+        READWRITE(index.nHeight);
+        READWRITE(index.nFlags);
+        READWRITE(index.nStakeModifier);
+        READWRITE(index.bnStakeModifierV2);
+        READWRITE(index.prevoutStake);
+        READWRITE(index.nStakeTime);
+        READWRITE(index.nVersion);
+        READWRITE(index.hashMerkleRoot);
+        READWRITE(index.nTime);
+        READWRITE(index.nBits);
+        READWRITE(index.nNonce);
+    )
+};
+
+static const unsigned char pchBlockIndexSnapshotMagic[4] = { 'm', 'b', 'i', 's' };
+
+// Version of the snapshot file format
+static const int BLOCKINDEX_SNAPSHOT_VERSION = 2;
+
+// Entries decoded per chunk when loading a snapshot
+static const unsigned int BLOCKINDEX_SNAPSHOT_CHUNK = 8192;
+
+// Most blocks the database may have gained since the snapshot was written
+// before the snapshot is not worth patching up
+static const unsigned int MAX_BLOCKINDEX_SNAPSHOT_CATCHUP = 10000;
+
+bool fBlockIndexSnapshot = true;
+
+static int64_t nLastBlockIndexSnapshot = 0;
+
+static boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blkindex.snapshot";
+}
+
+// The contents of a snapshot file, memory mapped where possible
+class CBlockIndexSnapshotFile
+{
+private:
+    CBlockIndexSnapshotFile(const CBlockIndexSnapshotFile&);
+    CBlockIndexSnapshotFile& operator=(const CBlockIndexSnapshotFile&);
+
+    bool fMapped;
+    vector<char> vData;
+
+public:
+    const char* pbegin;
+    size_t nSize;
+
+    CBlockIndexSnapshotFile() : fMapped(false), pbegin(NULL), nSize(0) {}
+
+    ~CBlockIndexSnapshotFile()
+    {
+#ifndef WIN32
+        if (fMapped)
+            munmap((void*)pbegin, nSize);
+#endif
+    }
+
+    bool Open(const boost::filesystem::path& path)
+    {
+        FILE* file = fopen(path.string().c_str(), "rb");
+        if (!file)
+            return false;
+        fseek(file, 0, SEEK_END);
+        long nFileSize = ftell(file);
+        if (nFileSize <= 0)
+        {
+            fclose(file);
+            return false;
+        }
+        nSize = nFileSize;
+#ifndef WIN32
+        void* p = mmap(NULL, nSize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (p != MAP_FAILED)
+        {
+            fMapped = true;
+            pbegin = (const char*)p;
+            fclose(file);
+            return true;
+        }
+#endif
+        vData.resize(nSize);
+        fseek(file, 0, SEEK_SET);
+        bool fRead = fread(&vData[0], 1, nSize, file) == nSize;
+        fclose(file);
+        pbegin = &vData[0];
+        return fRead;
+    }
+};
+
+// Forget a partly loaded block index, so it can be loaded another way
+static void ClearLoadedBlockIndex()
+{
+    // Entries outside the arenas were allocated one by one
+    const CBlockIndex* pArenaBegin = vBlockIndexArena.empty() || vBlockIndexArena[0].empty() ? NULL : &vBlockIndexArena[0][0];
+    const CBlockIndex* pArenaEnd = pArenaBegin ? pArenaBegin + vBlockIndexArena[0].size() : NULL;
+    for (CBlockIndexMap::const_iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        if (!(mi->second >= pArenaBegin && mi->second < pArenaEnd))
+            delete mi->second;
+    mapBlockIndex.clear();
+    mapBlockIndexByPos.clear();
+    setStakeSeen.clear();
+    pindexGenesisBlock = NULL;
+    vBlockIndexArena.clear();
+}
+
+// Load the block index from the snapshot file, if there is one that matches
+// the database. Blocks the database has gained on its best chain since the
+// snapshot was written are read from the database and added. If it gained
+// any others the snapshot is no use, see nBlockIndexCount.
+static bool LoadBlockIndexSnapshot(CTxDB& txdb)
+{
+    boost::filesystem::path path = GetBlockIndexSnapshotPath();
+    CBlockIndexSnapshotFile file;
+    if (!file.Open(path))
+        return false;
+
+    // Header, entries, then the hash of everything before it
+    CDataStream ssHeader(SER_DISK, CLIENT_VERSION);
+    unsigned char pchMagic[4];
+    int nSnapshotVersion = 0, nDbVersion = 0;
+    uint256 hashSnapshotBest;
+    unsigned int nEntries = 0;
+    ssHeader << FLATDATA(pchMagic) << nSnapshotVersion << nDbVersion << hashSnapshotBest << nEntries;
+    unsigned int nHeaderSize = ssHeader.size();
+    unsigned int nEntrySize = ::GetSerializeSize(CBlockIndexSnapshotEntry(), SER_DISK, CLIENT_VERSION);
+    if (file.nSize < nHeaderSize + sizeof(uint256))
+        return error("LoadBlockIndexSnapshot() : %s is truncated", path.string());
+
+    ssHeader = CDataStream(file.pbegin, file.pbegin + nHeaderSize, SER_DISK, CLIENT_VERSION);
+    ssHeader >> FLATDATA(pchMagic) >> nSnapshotVersion >> nDbVersion >> hashSnapshotBest >> nEntries;
+    if (memcmp(pchMagic, pchBlockIndexSnapshotMagic, sizeof(pchMagic)) != 0 || nSnapshotVersion != BLOCKINDEX_SNAPSHOT_VERSION)
+        return error("LoadBlockIndexSnapshot() : %s has an unknown format", path.string());
+    if (file.nSize != nHeaderSize + (uint64_t)nEntries * nEntrySize + sizeof(uint256))
+        return error("LoadBlockIndexSnapshot() : %s has the wrong size", path.string());
+
+    const char* pend = file.pbegin + file.nSize - sizeof(uint256);
+    uint256 hashChecksum;
+    memcpy(hashChecksum.begin(), pend, sizeof(uint256));
+    if (Hash(file.pbegin, pend) != hashChecksum)
+        return error("LoadBlockIndexSnapshot() : checksum mismatch in %s", path.string());
+
+    // The database records which snapshot it was last consistent with
+    int nVersion = 0;
+    uint256 hashExpected, hashBest;
+    if (!txdb.ReadVersion(nVersion) || nVersion != nDbVersion ||
+        !txdb.ReadBlockIndexSnapshotHash(hashExpected) || hashExpected != hashChecksum)
+    {
+        LogPrintf("LoadBlockIndexSnapshot() : %s doesn't belong to this database, ignoring it\n", path.string());
+        return false;
+    }
+    if (!txdb.ReadHashBestChain(hashBest))
+        return false;
+
+    // Entries are stored by height, so the chain trust and skip pointers can
+    // be filled in as they are linked
+    vBlockIndexArena.assign(1, vector<CBlockIndex>());
+    vector<CBlockIndex>& vIndex = vBlockIndexArena[0];
+    vIndex.reserve(nEntries);
+    vector<uint256> vHashPrev;
+    vHashPrev.reserve(nEntries);
+    mapBlockIndex.reserve(nEntries);
+    mapBlockIndexByPos.reserve(nEntries);
+    try {
+        const char* p = file.pbegin + nHeaderSize;
+        for (unsigned int nDone = 0; nDone < nEntries; )
+        {
+            boost::this_thread::interruption_point();
+            unsigned int nChunk = std::min(nEntries - nDone, BLOCKINDEX_SNAPSHOT_CHUNK);
+            CDataStream ss(p, p + nChunk * nEntrySize, SER_DISK, CLIENT_VERSION);
+            for (unsigned int i = 0; i < nChunk; i++)
+            {
+                CBlockIndexSnapshotEntry entry;
+                ss >> entry;
+                if (!vIndex.empty() && entry.index.nHeight < vIndex.back().nHeight)
+                    throw runtime_error("entries out of order");
+                vIndex.push_back(entry.index);
+                vHashPrev.push_back(entry.hashPrev);
+                CBlockIndex* pindexNew = &vIndex.back();
+                pindexNew->phashBlock = &pindexNew->hashBlock;
+                if (!mapBlockIndex.insert(make_pair(pindexNew->hashBlock, pindexNew)).second)
+                    throw runtime_error("duplicate entry " + pindexNew->hashBlock.ToString());
+            }
+            p += nChunk * nEntrySize;
+            nDone += nChunk;
+        }
+
+        for (unsigned int i = 0; i < vIndex.size(); i++)
+        {
+            CBlockIndex* pindexNew = &vIndex[i];
+            pindexNew->pprev = InsertBlockIndex(vHashPrev[i]);
+            if (pindexNew->pprev && pindexNew->pprev->nFile != 0 && pindexNew->pprev->nHeight + 1 != pindexNew->nHeight)
+                throw runtime_error("bad height at " + pindexNew->hashBlock.ToString());
+            pindexNew->nChainTrust = (pindexNew->pprev ? pindexNew->pprev->nChainTrust : 0) + pindexNew->GetBlockTrust();
+            pindexNew->BuildSkip();
+            if (!AddLoadedBlockIndex(pindexNew))
+                throw runtime_error("bad entry " + pindexNew->hashBlock.ToString());
+        }
+        vector<uint256>().swap(vHashPrev);
+
+        // Catch up with blocks connected after the snapshot was written
+        vector<pair<uint256, CDiskBlockIndex> > vMissing;
+        for (uint256 hash = hashBest; ; )
+        {
+            CBlockIndex* pindex = mapBlockIndex[hash];
+            if (pindex)
+            {
+                if (pindex->nFile == 0)
+                    throw runtime_error("best chain runs into a missing entry");
+                break;
+            }
+            if (vMissing.size() >= MAX_BLOCKINDEX_SNAPSHOT_CATCHUP)
+                throw runtime_error("too far behind the database");
+            CDiskBlockIndex diskindex;
+            if (!txdb.ReadBlockIndex(hash, diskindex) || diskindex.hashPrev == 0)
+                throw runtime_error("best chain doesn't lead back to the snapshot");
+            vMissing.push_back(make_pair(hash, diskindex));
+            hash = diskindex.hashPrev;
+        }
+        // Anything else added since, like a block on a side branch, can only
+        // be found by reading the whole block index
+        unsigned int nCount = 0;
+        if (!txdb.ReadBlockIndexCount(nCount) || nCount != nEntries + vMissing.size())
+            throw runtime_error("block index entries were added off the best chain");
+        nBlockIndexCount = nCount;
+        for (int i = vMissing.size() - 1; i >= 0; i--)
+        {
+            CBlockIndex* pindexNew = new CBlockIndex(vMissing[i].second);
+            pindexNew->hashBlock = vMissing[i].first;
+            pindexNew->phashBlock = &pindexNew->hashBlock;
+            pindexNew->pprev = mapBlockIndex[vMissing[i].second.hashPrev];
+            pindexNew->pnext = NULL;
+            pindexNew->nChainTrust = pindexNew->pprev->nChainTrust + pindexNew->GetBlockTrust();
+            pindexNew->BuildSkip();
+            mapBlockIndex.insert(make_pair(pindexNew->hashBlock, pindexNew));
+            if (!AddLoadedBlockIndex(pindexNew))
+                throw runtime_error("bad entry " + pindexNew->hashBlock.ToString());
+        }
+        if (!vMissing.empty())
+            LogPrintf("LoadBlockIndexSnapshot() : added %u blocks from the database\n", vMissing.size());
+
+        // pnext follows the best chain as it is in the database now
+        for (CBlockIndexMap::const_iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+            mi->second->pnext = NULL;
+        for (CBlockIndex* pindex = mapBlockIndex[hashBest]; pindex->pprev; pindex = pindex->pprev)
+            pindex->pprev->pnext = pindex;
+    }
+    catch (boost::thread_interrupted&) {
+        ClearLoadedBlockIndex();
+        throw;
+    }
+    catch (std::exception& e) {
+        LogPrintf("LoadBlockIndexSnapshot() : %s in %s, loading from the database instead\n", e.what(), path.string());
+        ClearLoadedBlockIndex();
+        return false;
+    }
+    return true;
+}
+
+// Sort block index entries for the snapshot, parents before children
+static bool CompareBlockIndexHeight(const CBlockIndex* pa, const CBlockIndex* pb)
+{
+    return pa->nHeight < pb->nHeight;
+}
+
+bool WriteBlockIndexSnapshot()
+{
+    // The background thread and shutdown may both get here
+    static CCriticalSection cs_snapshot;
+    LOCK(cs_snapshot);
+    if (!txdb)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    CTxDB txdbSnapshot("r+");
+    int nDbVersion = 0;
+    uint256 hashBest;
+    unsigned int nEntries = 0;
+    CDataStream ssEntries(SER_DISK, CLIENT_VERSION);
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        // Only the copy is made under cs_main, writing it out happens after
+        LOCK(cs_main);
+        if (pindexBest == NULL)
+            return false;
+        if (!txdbSnapshot.ReadVersion(nDbVersion))
+            return error("WriteBlockIndexSnapshot() : database version not found");
+        // Only a snapshot of what the database holds on disk is any use
+        if (!txdbSnapshot.ReadHashBestChain(hashBest) || hashBest != hashBestChain)
+            return false;
+
+        vector<CBlockIndex*> vIndex;
+        vIndex.reserve(mapBlockIndex.size());
+        for (CBlockIndexMap::const_iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        {
+            // Leave out entries only known as a link from another one
+            if (mi->second->nFile != 0)
+                vIndex.push_back(mi->second);
+        }
+        if (vIndex.size() != nBlockIndexCount)
+            return error("WriteBlockIndexSnapshot() : %u entries in memory, %u in the database", vIndex.size(), nBlockIndexCount);
+        sort(vIndex.begin(), vIndex.end(), CompareBlockIndexHeight);
+
+        ssEntries.reserve(vIndex.size() * ::GetSerializeSize(CBlockIndexSnapshotEntry(), SER_DISK, CLIENT_VERSION));
+        BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+        {
+            CBlockIndexSnapshotEntry entry;
+            entry.index = *pindex;
+            entry.hashPrev = pindex->pprev ? pindex->pprev->GetBlockHash() : 0;
+            ssEntries << entry;
+        }
+        nEntries = vIndex.size();
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+
+    boost::filesystem::path path = GetBlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = path;
+    pathTmp += ".new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("WriteBlockIndexSnapshot() : open %s failed", pathTmp.string());
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+    uint256 hashChecksum;
+    try {
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << FLATDATA(pchBlockIndexSnapshotMagic) << BLOCKINDEX_SNAPSHOT_VERSION << nDbVersion << hashBest << nEntries;
+        hasher.write(&ss[0], ss.size());
+        fileout.write(&ss[0], ss.size());
+        if (!ssEntries.empty())
+        {
+            hasher.write(&ssEntries[0], ssEntries.size());
+            fileout.write(&ssEntries[0], ssEntries.size());
+        }
+        hashChecksum = hasher.GetHash();
+        fileout << hashChecksum;
+        fflush(fileout);
+        FileCommit(fileout);
+    }
+    catch (std::exception& e) {
+        fileout.fclose();
+        boost::filesystem::remove(pathTmp);
+        return error("WriteBlockIndexSnapshot() : %s", e.what());
+    }
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, path))
+        return error("WriteBlockIndexSnapshot() : rename to %s failed", path.string());
+    if (!txdbSnapshot.WriteBlockIndexSnapshotHash(hashChecksum))
+        return error("WriteBlockIndexSnapshot() : recording the snapshot in the database failed");
+
+    nLastBlockIndexSnapshot = GetTime();
+    LogPrintf("WriteBlockIndexSnapshot() : %u entries in %dms\n", nEntries, GetTimeMillis() - nStart);
+    return true;
+}
+
+void ThreadBlockIndexSnapshot()
+{
+    RenameThread("mokacoin-snapshot");
+
+    // Block connection holds cs_main throughout, so whenever the snapshot
+    // gets it the best chain globals match the database
+    while (true)
+    {
+        MilliSleep(60 * 1000);
+        if (GetTime() - nLastBlockIndexSnapshot >= BLOCKINDEX_SNAPSHOT_INTERVAL)
+            WriteBlockIndexSnapshot();
+    }
+}
+
+bool CTxDB::LoadBlockIndex()
+{
+    if (mapBlockIndex.size() > 0) {
+        // Already loaded once in this session. It can happen during migration
+        // from BDB.
+        return true;
+    }
+    // The block index is an in-memory structure that maps hashes to on-disk
+    // locations where the contents of the block can be found. Here, we scan it
+    // out of the DB and into mapBlockIndex, or from the snapshot written at
+    // the last shutdown when there is a usable one.
+    int64_t nStart = GetTimeMillis();
+    nLastBlockIndexSnapshot = GetTime();
+    if (fBlockIndexSnapshot && LoadBlockIndexSnapshot(*this))
+        LogPrintf("LoadBlockIndex(): %u entries from the snapshot in %dms\n", mapBlockIndex.size(), GetTimeMillis() - nStart);
+    else
     {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        if (!LoadBlockIndexScan(pdb))
+            return false;
+        // Databases written before the count was kept get it now
+        unsigned int nCount = 0;
+        if (!ReadBlockIndexCount(nCount) || nCount != nBlockIndexCount)
+            Write(string("blockindexcount"), nBlockIndexCount);
     }
+    LogPrintf("LoadBlockIndex(): %u entries, hash table slots take %u bytes\n",
+      (unsigned int)mapBlockIndex.size(), (unsigned int)mapBlockIndex.MemoryUsage());
 
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
@@ -401,6 +1229,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    chainActive.SetTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -413,133 +1242,7 @@ bool CTxDB::LoadBlockIndex()
     ReadBestInvalidTrust(bnBestInvalidTrust);
     nBestInvalidTrust = bnBestInvalidTrust.getuint256();
 
-    // Verify blocks in the best chain
-    int nCheckLevel = GetArg("-checklevel", 1);
-    int nCheckDepth = GetArg( "-checkblocks", 500);
-    if (nCheckDepth == 0)
-        nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > nBestHeight)
-        nCheckDepth = nBestHeight;
-    LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CBlockIndex* pindexFork = NULL;
-    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
-    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
-    {
-        boost::this_thread::interruption_point();
-        if (pindex->nHeight < nBestHeight-nCheckDepth)
-            break;
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        // check level 1: verify block validity
-        // check level 7: verify block signature too
-        if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
-        {
-            LogPrintf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-            pindexFork = pindex->pprev;
-        }
-        // check level 2: verify transaction index validity
-        if (nCheckLevel>1)
-        {
-            pair<unsigned int, unsigned int> pos = make_pair(pindex->nFile, pindex->nBlockPos);
-            mapBlockPos[pos] = pindex;
-            BOOST_FOREACH(const CTransaction &tx, block.vtx)
-            {
-                uint256 hashTx = tx.GetHash();
-                CTxIndex txindex;
-                if (ReadTxIndex(hashTx, txindex))
-                {
-                    // check level 3: checker transaction hashes
-                    if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
-                    {
-                        // either an error or a duplicate transaction
-                        CTransaction txFound;
-                        if (!txFound.ReadFromDisk(txindex.pos))
-                        {
-                            LogPrintf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString());
-                            pindexFork = pindex->pprev;
-                        }
-                        else
-                            if (txFound.GetHash() != hashTx) // not a duplicate tx
-                            {
-                                LogPrintf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString());
-                                pindexFork = pindex->pprev;
-                            }
-                    }
-                    // check level 4: check whether spent txouts were spent within the main chain
-                    unsigned int nOutput = 0;
-                    if (nCheckLevel>3)
-                    {
-                        BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
-                        {
-                            if (!txpos.IsNull())
-                            {
-                                pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
-                                if (!mapBlockPos.count(posFind))
-                                {
-                                    LogPrintf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString(), hashTx.ToString());
-                                    pindexFork = pindex->pprev;
-                                }
-                                // check level 6: check whether spent txouts were spent by a valid transaction that consume them
-                                if (nCheckLevel>5)
-                                {
-                                    CTransaction txSpend;
-                                    if (!txSpend.ReadFromDisk(txpos))
-                                    {
-                                        LogPrintf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else if (!txSpend.CheckTransaction())
-                                    {
-                                        LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else
-                                    {
-                                        bool fFound = false;
-                                        BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
-                                            if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
-                                                fFound = true;
-                                        if (!fFound)
-                                        {
-                                            LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString(), nOutput);
-                                            pindexFork = pindex->pprev;
-                                        }
-                                    }
-                                }
-                            }
-                            nOutput++;
-                        }
-                    }
-                }
-                // check level 5: check whether all prevouts are marked spent
-                if (nCheckLevel>4)
-                {
-                     BOOST_FOREACH(const CTxIn &txin, tx.vin)
-                     {
-                          CTxIndex txindex;
-                          if (ReadTxIndex(txin.prevout.hash, txindex))
-                              if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
-                              {
-                                  LogPrintf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString(), txin.prevout.n, hashTx.ToString());
-                                  pindexFork = pindex->pprev;
-                              }
-                     }
-                }
-            }
-        }
-    }
-    if (pindexFork)
-    {
-        boost::this_thread::interruption_point();
-        // Reorg back to the fork
-        LogPrintf("LoadBlockIndex() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
-        CBlock block;
-        if (!block.ReadFromDisk(pindexFork))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        CTxDB txdb;
-        block.SetBestChain(txdb, pindexFork);
-    }
+    // The best chain is verified in the background, see ThreadVerifyChain
 
     return true;
 }
@@ -12,9 +12,89 @@
 #include <string>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+/** Default for -txindexcache, the transaction index write-back cache in megabytes */
+static const int DEFAULT_TXINDEX_CACHE = 32;
+/** Flush a dirty transaction index cache at least this often, in seconds */
+static const int64_t TXINDEX_CACHE_FLUSH_INTERVAL = 10 * 60;
+
+/** Size of the transaction index cache in bytes, 0 when disabled */
+extern int64_t nTxIndexCacheSize;
+
+/** Write the dirty entries of the transaction index cache to disk */
+bool FlushTxIndexCache();
+
+/** Drop the transaction index cache without writing it, as a crash would */
+void DiscardTxIndexCache();
+
+/** Write a new block index snapshot at least this often, in seconds */
+static const int64_t BLOCKINDEX_SNAPSHOT_INTERVAL = 6 * 60 * 60;
+
+/** Whether the block index is saved to a snapshot file for faster restarts */
+extern bool fBlockIndexSnapshot;
+
+/** Save the block index to the snapshot file, which the next start loads
+ *  instead of scanning the database. Only holds cs_main while copying the
+ *  entries, so call it without holding it. */
+bool WriteBlockIndexSnapshot();
+
+/** Write a new block index snapshot every BLOCKINDEX_SNAPSHOT_INTERVAL */
+void ThreadBlockIndexSnapshot();
+
+// Index of the puts and deletes queued in a leveldb::WriteBatch. A WriteBatch
+// can only be walked from the start, and a reorganization queues thousands of
+// writes in one; reads during the transaction look the serialized key up in
+// this hash table instead.
+class CBatchOverlay
+{
+private:
+    // key -> (deleted, value); the last operation on a key wins, as in the batch
+    typedef boost::unordered_map<std::string, std::pair<bool, std::string> > EntryMap;
+    EntryMap mapEntries;
+
+    std::pair<bool, std::string>& Entry(const std::string& key)
+    {
+        EntryMap::iterator it = mapEntries.find(key);
+        if (it == mapEntries.end())
+            it = mapEntries.insert(std::make_pair(key, std::make_pair(true, std::string()))).first;
+        return it->second;
+    }
+
+public:
+    void Put(const std::string& key, const std::string& value)
+    {
+        std::pair<bool, std::string>& entry = Entry(key);
+        entry.first = false;
+        entry.second = value;
+    }
+
+    void Delete(const std::string& key)
+    {
+        std::pair<bool, std::string>& entry = Entry(key);
+        entry.first = true;
+        entry.second.clear();
+    }
+
+    // Returns true if the batch touches key, and sets either value or deleted
+    bool Find(const std::string& key, std::string* value, bool* deleted) const
+    {
+        EntryMap::const_iterator it = mapEntries.find(key);
+        if (it == mapEntries.end())
+            return false;
+        *deleted = it->second.first;
+        if (!*deleted)
+            *value = it->second.second;
+        return true;
+    }
+
+    void Clear() { mapEntries.clear(); }
+    size_t size() const { return mapEntries.size(); }
+};
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -46,6 +126,13 @@ private:
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
     leveldb::WriteBatch *activeBatch;
+    // The same writes and deletes, indexed for reads during the transaction
+    CBatchOverlay batchOverlay;
+    // Transaction index updates of the open transaction when the txindex
+    // cache is enabled; a null CTxIndex stands for an erase
+    std::map<uint256, CTxIndex> mapTxIndexTxn;
+    // Block index entries added by the open transaction
+    unsigned int nBlockIndexAddedTxn;
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
@@ -56,6 +143,8 @@ protected:
     // delete for it.
     bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
 
+    bool WriteTxIndex(const uint256& hash, const CTxIndex& txindex);
+
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
@@ -112,6 +201,7 @@ protected:
 
         if (activeBatch) {
             activeBatch->Put(ssKey.str(), ssValue.str());
+            batchOverlay.Put(ssKey.str(), ssValue.str());
             return true;
         }
         leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
@@ -135,6 +225,7 @@ protected:
         ssKey << key;
         if (activeBatch) {
             activeBatch->Delete(ssKey.str());
+            batchOverlay.Delete(ssKey.str());
             return true;
         }
         leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
@@ -151,8 +242,8 @@ protected:
 
         if (activeBatch) {
             bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
+            if (ScanBatch(ssKey, &unused, &deleted)) {
+                return !deleted;
             }
         }
 
@@ -169,6 +260,9 @@ public:
     {
         delete activeBatch;
         activeBatch = NULL;
+        batchOverlay.Clear();
+        mapTxIndexTxn.clear();
+        nBlockIndexAddedTxn = 0;
         return true;
     }
 
@@ -192,9 +286,17 @@ public:
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
+    bool ReadBlockIndex(uint256 hash, CDiskBlockIndex& blockindex);
+    bool ReadBlockIndexSnapshotHash(uint256& hash);
+    bool WriteBlockIndexSnapshotHash(uint256 hash);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool AddBlockIndex(const CDiskBlockIndex& blockindex);
+    bool ReadBlockIndexCount(unsigned int& nCount);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
+    bool ReadHashTxIndexBest(uint256& hashTxIndexBest);
+    bool WriteHashTxIndexBest(uint256 hashTxIndexBest);
+    bool EraseHashTxIndexBest();
     bool ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust);
     bool WriteBestInvalidTrust(CBigNum bnBestInvalidTrust);
     bool LoadBlockIndex();
@@ -1448,6 +1448,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
             {
                 wtxNew.vin.clear();
                 wtxNew.vout.clear();
+                wtxNew.InvalidateCache();
                 wtxNew.fFromMe = true;
 
                 int64_t nTotalValue = nValue + nFeeRet;
@@ -1586,6 +1587,7 @@ bool CWallet::CreateTransactionWithLock(const vector<pair<CScript, CLockData> >&
             {
                 wtxNew.vin.clear();
                 wtxNew.vout.clear();
+                wtxNew.InvalidateCache();
                 wtxNew.fFromMe = true;
 
                 int64_t nTotalValue = nValue + nFeeRet;
@@ -1709,6 +1711,80 @@ uint64_t CWallet::GetStakeWeight() const
     return nWeight;
 }
 
+// Refresh the staking candidate cache for the given coins. Entries whose block
+// left the main chain are dropped on a new tip, coins that are no longer
+// selected are forgotten and only new coins are read from disk.
+void CWallet::CacheStakeCandidates(CTxDB& txdb, const set<pair<const CWalletTx*,unsigned int> >& setCoins, map<COutPoint, CStakeCandidate>& mapCandidatesRet)
+{
+    LOCK2(cs_main, cs_wallet);
+
+    if (hashStakeCandidatesBest != hashBestChain)
+    {
+        for (map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.begin(); it != mapStakeCandidates.end();)
+        {
+            CBlockIndexMap::iterator mi = mapBlockIndex.find((*it).second.hashBlockFrom);
+            if (mi == mapBlockIndex.end() || !(*mi).second->IsInMainChain())
+                mapStakeCandidates.erase(it++);
+            else
+                ++it;
+        }
+        hashStakeCandidatesBest = hashBestChain;
+    }
+
+    mapCandidatesRet.clear();
+    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    {
+        COutPoint prevout(pcoin.first->GetHash(), pcoin.second);
+        map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.find(prevout);
+        if (it != mapStakeCandidates.end())
+        {
+            mapCandidatesRet.insert(*it);
+            continue;
+        }
+
+        CStakeCandidate candidate;
+        if (GetStakeCandidate(txdb, prevout, candidate))
+            mapCandidatesRet.insert(make_pair(prevout, candidate));
+    }
+
+    mapStakeCandidates = mapCandidatesRet;
+}
+
+// Check whether any staking coin has a kernel at nTime, without building the
+// coinstake. Lets the stake miner skip assembling blocks it could not sign.
+bool CWallet::HasStakeKernel(unsigned int nBits, int64_t nTime)
+{
+    CBlockIndex* pindexPrev = pindexBest;
+
+    int64_t nBalance = GetBalance();
+    if (nBalance <= nReserveBalance)
+        return false;
+
+    set<pair<const CWalletTx*,unsigned int> > setCoins;
+    int64_t nValueIn = 0;
+    if (!SelectCoinsForStaking(nBalance - nReserveBalance, setCoins, nValueIn))
+        return false;
+    if (setCoins.empty())
+        return false;
+
+    CTxDB txdb("r");
+    map<COutPoint, CStakeCandidate> mapCandidates;
+    CacheStakeCandidates(txdb, setCoins, mapCandidates);
+
+    vector<CStakeCandidate> vCandidates;
+    vCandidates.reserve(mapCandidates.size());
+    for (map<COutPoint, CStakeCandidate>::const_iterator it = mapCandidates.begin(); it != mapCandidates.end(); ++it)
+        vCandidates.push_back((*it).second);
+
+    vector<int64_t> vKernelTime;
+    SearchStakeKernels(pindexPrev, nBits, nTime, 1, vCandidates, vKernelTime);
+    BOOST_FOREACH(int64_t nKernelTime, vKernelTime)
+        if (nKernelTime != 0)
+            return true;
+
+    return false;
+}
+
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CTransaction& txNew, CKey& key)
 {
     CBlockIndex* pindexPrev = pindexBest;
@@ -1744,78 +1820,82 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     int64_t nCredit = 0;
     CScript scriptPubKeyKernel;
     CTxDB txdb("r");
+    map<COutPoint, CStakeCandidate> mapCandidates;
+    CacheStakeCandidates(txdb, setCoins, mapCandidates);
+
+    // Search all coins at once
+    static int nMaxStakeSearchInterval = 60;
+    vector<CStakeCandidate> vCandidates;
+    vCandidates.reserve(setCoins.size());
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
     {
-        static int nMaxStakeSearchInterval = 60;
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBest; n++)
-        {
-            boost::this_thread::interruption_point();
-            // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            int64_t nBlockTime;
-            if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, &nBlockTime))
-            {
-                // Found a kernel
-                LogPrint("coinstake", "CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-                    valtype& vchPubKey = vSolutions[0];
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
+        map<COutPoint, CStakeCandidate>::const_iterator mi = mapCandidates.find(COutPoint(pcoin.first->GetHash(), pcoin.second));
+        vCandidates.push_back(mi != mapCandidates.end() ? (*mi).second : CStakeCandidate());
+    }
+    vector<int64_t> vKernelTime;
+    SearchStakeKernels(pindexPrev, nBits, txNew.nTime, min(nSearchInterval, (int64_t)nMaxStakeSearchInterval), vCandidates, vKernelTime);
+    boost::this_thread::interruption_point();
 
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
+    unsigned int nCandidate = 0;
+    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    {
+        int64_t nKernelTime = vKernelTime[nCandidate++];
+        if (nKernelTime == 0 || pindexPrev != pindexBest)
+            continue;
 
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut, 0));
+        // Found a kernel
+        LogPrint("coinstake", "CreateCoinStake : kernel found\n");
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+        {
+            LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
+            continue;
+        }
+        LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        {
+            LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
+            continue;  // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            // convert to pay to public key type
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+        }
+        if (whichType == TX_PUBKEY)
+        {
+            valtype& vchPubKey = vSolutions[0];
+            if (!keystore.GetKey(Hash160(vchPubKey), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
 
-                LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+            if (key.GetPubKey() != vchPubKey)
+            {
+                LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+                continue; // keys mismatch
             }
+
+            scriptPubKeyOut = scriptPubKeyKernel;
         }
 
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        txNew.nTime = nKernelTime;
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut, 0));
+
+        LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
+        break; // if kernel is found stop searching
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
@@ -1868,6 +1948,7 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     }
     else
         txNew.vout[1].nValue = nCredit;
+    txNew.InvalidateCache();
 
     // Sign
     int nIn = 0;
@@ -2609,7 +2690,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        CBlockIndexMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 
 #include "crypter.h"
+#include "kernel.h"
 #include "main.h"
 #include "key.h"
 #include "keystore.h"
@@ -93,6 +94,11 @@ class CWallet : public CCryptoKeyStore, public CWalletInterface
 private:
     bool SelectCoinsForStaking(int64_t nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
     bool SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl=NULL) const;
+    void CacheStakeCandidates(CTxDB& txdb, const std::set<std::pair<const CWalletTx*,unsigned int> >& setCoins, std::map<COutPoint, CStakeCandidate>& mapCandidatesRet);
+
+    // Kernel inputs of the coins selected for staking, valid for hashStakeCandidatesBest
+    std::map<COutPoint, CStakeCandidate> mapStakeCandidates;
+    uint256 hashStakeCandidatesBest;
 
     CWalletDB *pwalletdbEncryption;
 
@@ -221,6 +227,7 @@ public:
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
 
     uint64_t GetStakeWeight() const;
+    bool HasStakeKernel(unsigned int nBits, int64_t nTime);
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CTransaction& txNew, CKey& key);
 
     std::string SendMoney(CScript scriptPubKey, int64_t nValue, CWalletTx& wtxNew, bool fAskFee=false);